@@ -0,0 +1,138 @@
+// Microbenchmark of the hashing strategies (memory map and chunked reads with several buffer sizes) across file
+// sizes, on the device holding DIR. Every size is measured cold (pages dropped from the page cache) and warm.
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "calibration.h"
+
+#define WRITE_BLOCK_SIZE (1024 * 1024)
+
+static const guint64 file_sizes[] = { 64 * 1024, 1024 * 1024, 16 * 1024 * 1024, 256 * 1024 * 1024, 1024 * 1024 * 1024 };
+static const gsize buffer_sizes[] = { 1024 * 1024, 4 * 1024 * 1024, 16 * 1024 * 1024, 64 * 1024 * 1024 };
+
+
+static void
+show_help (const gchar *prog_name)
+{
+    g_print ("Usage:\n");
+    g_print ("  %s [--repeat N] [--max-size MB] [DIR]\n\n", prog_name);
+    g_print ("Writes test files in DIR (default: the temporary directory) and prints the hashing throughput of every\n");
+    g_print ("strategy for each file size. Best of N runs (default 3); files larger than --max-size (default 1024) are skipped.\n");
+}
+
+
+static gchar *
+create_test_file (const gchar *dir,
+                  guint64      size)
+{
+    gchar *path = g_build_filename (dir, "ffc-bench-XXXXXX", NULL);
+    int fd = g_mkstemp (path);
+    if (fd < 0) {
+        g_printerr ("Couldn't create a test file in %s\n", dir);
+        g_free (path);
+        return NULL;
+    }
+
+    // Random content: nothing can be compressed or deduplicated by the filesystem
+    guint32 *block = g_new (guint32, WRITE_BLOCK_SIZE / sizeof(guint32));
+    GRand *rand = g_rand_new_with_seed ((guint32)size);
+    gboolean ok = TRUE;
+    for (guint64 written = 0; written < size && ok; written += WRITE_BLOCK_SIZE) {
+        for (gsize i = 0; i < WRITE_BLOCK_SIZE / sizeof(guint32); i++) block[i] = g_rand_int (rand);
+        gsize len = (gsize)MIN((guint64)WRITE_BLOCK_SIZE, size - written);
+        ok = write (fd, block, len) == (ssize_t)len;
+    }
+    // Dirty pages can't be dropped: cold runs need the data on the device
+    ok = ok && fsync (fd) == 0;
+    close (fd);
+    g_rand_free (rand);
+    g_free (block);
+
+    if (!ok) {
+        g_printerr ("Couldn't write the test file %s\n", path);
+        g_unlink (path);
+        g_free (path);
+        return NULL;
+    }
+    return path;
+}
+
+
+// Best of repeat runs, in MB/s (0 on failure)
+static gdouble
+measure (const gchar  *path,
+         guint64       size,
+         HashStrategy  strategy,
+         gsize         buffer_size,
+         gboolean      cold,
+         guint         repeat)
+{
+    gdouble best = -1;
+    if (!cold) calibration_measure (path, strategy, buffer_size, FALSE);
+    for (guint i = 0; i < repeat; i++) {
+        gdouble seconds = calibration_measure (path, strategy, buffer_size, cold);
+        if (seconds < 0) return 0;
+        if (best < 0 || seconds < best) best = seconds;
+    }
+    return (gdouble)size / (1024 * 1024) / MAX(best, 1e-9);
+}
+
+
+int
+main (int argc, char *argv[])
+{
+    guint repeat = 3;
+    guint64 max_size = 1024ULL * 1024 * 1024;
+    const gchar *dir = g_get_tmp_dir ();
+
+    for (int i = 1; i < argc; i++) {
+        if (g_strcmp0 (argv[i], "-h") == 0 || g_strcmp0 (argv[i], "--help") == 0) {
+            show_help (argv[0]);
+            return 0;
+        } else if (g_strcmp0 (argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = (guint)g_ascii_strtoull (argv[++i], NULL, 10);
+        } else if (g_strcmp0 (argv[i], "--max-size") == 0 && i + 1 < argc) {
+            max_size = g_ascii_strtoull (argv[++i], NULL, 10) * 1024 * 1024;
+        } else if (argv[i][0] != '-') {
+            dir = argv[i];
+        } else {
+            show_help (argv[0]);
+            return -1;
+        }
+    }
+    if (repeat == 0) {
+        show_help (argv[0]);
+        return -1;
+    }
+
+    g_print ("%-10s %-16s %12s %12s\n", "size", "strategy", "cold MB/s", "warm MB/s");
+    for (gsize i = 0; i < G_N_ELEMENTS (file_sizes) && file_sizes[i] <= max_size; i++) {
+        gchar *path = create_test_file (dir, file_sizes[i]);
+        if (path == NULL) return -1;
+        gchar *size = g_format_size (file_sizes[i]);
+
+        g_print ("%-10s %-16s %12.1f %12.1f\n", size, "mmap",
+                 measure (path, file_sizes[i], HASH_STRATEGY_MMAP, 0, TRUE, repeat),
+                 measure (path, file_sizes[i], HASH_STRATEGY_MMAP, 0, FALSE, repeat));
+        for (gsize j = 0; j < G_N_ELEMENTS (buffer_sizes); j++) {
+            // Larger buffers read the same single block
+            if (j > 0 && buffer_sizes[j - 1] >= file_sizes[i]) break;
+            gchar *buffer = g_format_size (buffer_sizes[j]);
+            gchar *label = g_strdup_printf ("read %s", buffer);
+            g_print ("%-10s %-16s %12.1f %12.1f\n", size, label,
+                     measure (path, file_sizes[i], HASH_STRATEGY_CHUNKED, buffer_sizes[j], TRUE, repeat),
+                     measure (path, file_sizes[i], HASH_STRATEGY_CHUNKED, buffer_sizes[j], FALSE, repeat));
+            g_free (label);
+            g_free (buffer);
+        }
+
+        g_free (size);
+        g_unlink (path);
+        g_free (path);
+    }
+
+    return 0;
+}
@@ -0,0 +1,284 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <lmdb.h>
+#include "bulk_load.h"
+#include "record_stream.h"
+
+#define BULK_MIN_RUN_MEMORY   (16 * 1024 * 1024)
+#define BULK_RUN_MEMORY_RATIO 10                // use at most 1/10 of the usable RAM for the in-memory run
+#define BULK_IO_BUFFER_SIZE   (1024 * 1024)
+
+typedef struct bulk_run_t {
+    FILE *file;             // spilled run (already unlinked), NULL for the in-memory run
+    GPtrArray *items;       // in-memory run
+    guint next_index;
+    RecordItem *current;    // head of the run during the merge
+} BulkRun;
+
+struct bulk_loader_t {
+    DatabaseData *db_data;
+    gchar *spill_dir;
+    GMutex lock;
+    GPtrArray *items;       // current in-memory run, protected by lock
+    gsize items_memory;
+    gsize run_memory_limit;
+    GPtrArray *runs;        // spilled runs, protected by lock
+};
+
+
+static gint
+compare_item_ptrs (gconstpointer a,
+                   gconstpointer b)
+{
+    return record_item_compare (*(RecordItem * const *)a, *(RecordItem * const *)b);
+}
+
+
+static void
+bulk_run_free (gpointer data)
+{
+    BulkRun *run = data;
+    if (run->file) fclose (run->file);
+    if (run->items) g_ptr_array_free (run->items, TRUE);
+    g_free (run->current);
+    g_free (run);
+}
+
+
+BulkLoader *
+bulk_loader_new (DatabaseData *db_data,
+                 ConfigData   *config_data)
+{
+    BulkLoader *loader = g_try_new0 (BulkLoader, 1);
+    if (!loader) {
+        g_log (NULL, G_LOG_LEVEL_ERROR, "Failed to allocate memory for BulkLoader");
+        return NULL;
+    }
+    loader->db_data = db_data;
+    // Spill next to the database: same filesystem and sized for it, unlike a possibly RAM-backed /tmp
+    loader->spill_dir = g_strdup (config_data->db_path);
+    g_mutex_init (&loader->lock);
+    loader->items = g_ptr_array_new_with_free_func (g_free);
+    loader->run_memory_limit = MAX (config_data->usable_ram / BULK_RUN_MEMORY_RATIO, BULK_MIN_RUN_MEMORY);
+    loader->runs = g_ptr_array_new_with_free_func (bulk_run_free);
+
+    return loader;
+}
+
+
+static gboolean
+write_item (FILE             *file,
+            const RecordItem *item)
+{
+    guint32 key_len = (guint32)item->key_len;
+    return fwrite (&key_len, sizeof(key_len), 1, file) == 1 &&
+           fwrite (item->key, item->key_len, 1, file) == 1 &&
+           fwrite (&item->entry, sizeof(FileEntryData), 1, file) == 1;
+}
+
+
+static RecordItem *
+read_item (FILE *file)
+{
+    guint32 key_len;
+    if (fread (&key_len, sizeof(key_len), 1, file) != 1) return NULL;
+
+    RecordItem *item = g_malloc (sizeof(RecordItem) + key_len);
+    item->key_len = key_len;
+    if (fread (item->key, key_len, 1, file) != 1 || fread (&item->entry, sizeof(FileEntryData), 1, file) != 1) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Truncated bulk-load run file\n");
+        g_free (item);
+        return NULL;
+    }
+    return item;
+}
+
+
+// Sorts a full run and writes it to an anonymous temporary file; runs outside the loader lock
+static BulkRun *
+spill_run (BulkLoader *loader,
+           GPtrArray  *items)
+{
+    g_ptr_array_sort (items, compare_item_ptrs);
+
+    gchar *template = g_build_filename (loader->spill_dir, "bulk-run-XXXXXX", NULL);
+    gint fd = g_mkstemp (template);
+    if (fd < 0) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Failed to create bulk-load run file in %s: %s\n", loader->spill_dir, g_strerror (errno));
+        g_free (template);
+        return NULL;
+    }
+    // The file lives on through the descriptor and disappears on its own, even after a crash
+    g_unlink (template);
+    g_free (template);
+
+    FILE *file = fdopen (fd, "w+b");
+    if (!file) {
+        close (fd);
+        return NULL;
+    }
+    setvbuf (file, NULL, _IOFBF, BULK_IO_BUFFER_SIZE);
+
+    gboolean ok = TRUE;
+    for (guint i = 0; i < items->len && ok; i++) {
+        ok = write_item (file, g_ptr_array_index (items, i));
+    }
+    if (!ok || fflush (file) != 0 || fseek (file, 0, SEEK_SET) != 0) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Failed to write bulk-load run file: %s\n", g_strerror (errno));
+        fclose (file);
+        return NULL;
+    }
+
+    BulkRun *run = g_new0 (BulkRun, 1);
+    run->file = file;
+    return run;
+}
+
+
+void
+bulk_loader_add (BulkLoader          *loader,
+                 const gchar         *filepath,
+                 const FileEntryData *entry)
+{
+    gsize key_len = strlen (filepath) + 1;
+    RecordItem *item = record_item_new (filepath, key_len, entry);
+
+    GPtrArray *full_run = NULL;
+    g_mutex_lock (&loader->lock);
+    g_ptr_array_add (loader->items, item);
+    loader->items_memory += sizeof(RecordItem) + key_len + sizeof(gpointer);
+    if (loader->items_memory >= loader->run_memory_limit) {
+        // Swap the run out and let this worker sort and spill it while the others keep adding
+        full_run = loader->items;
+        loader->items = g_ptr_array_new_with_free_func (g_free);
+        loader->items_memory = 0;
+    }
+    g_mutex_unlock (&loader->lock);
+
+    if (full_run) {
+        BulkRun *run = spill_run (loader, full_run);
+        g_mutex_lock (&loader->lock);
+        if (run) {
+            g_ptr_array_add (loader->runs, run);
+            g_ptr_array_free (full_run, TRUE);
+        } else {
+            // Keep the records in memory rather than losing them
+            for (guint i = 0; i < full_run->len; i++) g_ptr_array_add (loader->items, g_ptr_array_index (full_run, i));
+            g_ptr_array_set_free_func (full_run, NULL);
+            g_ptr_array_free (full_run, TRUE);
+        }
+        g_mutex_unlock (&loader->lock);
+    }
+}
+
+
+static gboolean
+bulk_run_advance (BulkRun *run)
+{
+    g_free (run->current);
+    run->current = NULL;
+
+    if (run->file) {
+        run->current = read_item (run->file);
+    } else if (run->next_index < run->items->len) {
+        // Take ownership of the item so that it can be freed as soon as it has been written
+        run->current = g_ptr_array_index (run->items, run->next_index);
+        run->items->pdata[run->next_index++] = NULL;
+    }
+    return run->current != NULL;
+}
+
+
+// Binary min-heap of runs ordered by their current key
+static void
+heap_sift_down (BulkRun **heap,
+                guint     n,
+                guint     i)
+{
+    while (TRUE) {
+        guint smallest = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < n && record_item_compare (heap[l]->current, heap[smallest]->current) < 0) smallest = l;
+        if (r < n && record_item_compare (heap[r]->current, heap[smallest]->current) < 0) smallest = r;
+        if (smallest == i) return;
+        BulkRun *tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+
+gboolean
+bulk_loader_finish (BulkLoader *loader,
+                    guint64    *written)
+{
+    DatabaseData *db_data = loader->db_data;
+    *written = 0;
+
+    // The last run stays in memory
+    g_ptr_array_sort (loader->items, compare_item_ptrs);
+    BulkRun *memory_run = g_new0 (BulkRun, 1);
+    memory_run->items = loader->items;
+    loader->items = g_ptr_array_new_with_free_func (g_free);
+    g_ptr_array_add (loader->runs, memory_run);
+
+    g_debug ("Bulk load: merging %u sorted runs", loader->runs->len);
+
+    BulkRun **heap = g_new (BulkRun *, loader->runs->len);
+    guint n = 0;
+    for (guint i = 0; i < loader->runs->len; i++) {
+        BulkRun *run = g_ptr_array_index (loader->runs, i);
+        if (bulk_run_advance (run)) heap[n++] = run;
+    }
+    for (guint i = n / 2; i-- > 0;) heap_sift_down (heap, n, i);
+
+    // The databases are empty, so the writer appends (MDB_APPEND) the merged keys in one txn per batch
+    RecordWriter *writer = record_writer_new (db_data);
+    GByteArray *last_key = g_byte_array_new ();
+
+    gboolean ok = TRUE;
+    while (n > 0 && ok) {
+        BulkRun *run = heap[0];
+        RecordItem *item = run->current;
+        run->current = NULL;
+
+        MDB_val key = { .mv_size = item->key_len, .mv_data = item->key };
+        MDB_val previous = { .mv_size = last_key->len, .mv_data = last_key->data };
+        if (last_key->len > 0 && db_compare_keys (&previous, &key) == 0) {
+            // The same path reached twice (e.g. through a symlinked directory): keep the first record
+            g_free (item);
+        } else {
+            g_byte_array_set_size (last_key, 0);
+            g_byte_array_append (last_key, (const guint8 *)item->key, (guint)item->key_len);
+            ok = record_writer_take (writer, item);
+        }
+
+        if (!bulk_run_advance (run)) heap[0] = heap[--n];
+        if (n > 0) heap_sift_down (heap, n, 0);
+    }
+
+    ok = ok && record_writer_finish (writer);
+    *written = record_writer_written (writer);
+    record_writer_free (writer);
+    g_byte_array_free (last_key, TRUE);
+    g_free (heap);
+    g_ptr_array_set_size (loader->runs, 0);
+
+    return ok;
+}
+
+
+void
+bulk_loader_free (BulkLoader *loader)
+{
+    if (!loader) return;
+    g_ptr_array_free (loader->items, TRUE);
+    g_ptr_array_free (loader->runs, TRUE);
+    g_mutex_clear (&loader->lock);
+    g_free (loader->spill_dir);
+    g_free (loader);
+}
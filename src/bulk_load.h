@@ -0,0 +1,26 @@
+#pragma once
+
+#include <glib.h>
+#include "config.h"
+#include "database.h"
+
+// Bulk loader for an initial add into empty databases: records are collected into sorted runs
+// (spilled to temporary files next to the database when over the memory budget), then merged
+// and written with MDB_APPEND in large transactions, which produces densely packed B-trees.
+// Nothing is written before bulk_loader_finish(): an interrupted first add keeps no records.
+typedef struct bulk_loader_t BulkLoader;
+
+BulkLoader *bulk_loader_new    (DatabaseData        *db_data,
+                                ConfigData          *config_data);
+
+// Thread-safe: called by the workers for every hashed file
+void        bulk_loader_add    (BulkLoader          *loader,
+                                const gchar         *filepath,
+                                const FileEntryData *entry);
+
+// Merges all runs into the databases. FALSE when a transaction failed: the records of the batches committed before
+// it stay in the databases (a later add completes them). *written counts the committed records either way.
+gboolean    bulk_loader_finish (BulkLoader          *loader,
+                                guint64             *written);
+
+void        bulk_loader_free   (BulkLoader          *loader);
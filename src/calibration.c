@@ -0,0 +1,311 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "calibration.h"
+#include "process_file.h"
+
+#define CALIBRATION_FILE "hash-calibration.conf"     // next to the database, see calibration_load()
+#define PROBE_MAX_ENTRIES 20000             // directory entries looked at per device while looking for sample files
+#define PROBE_FILES_PER_CLASS 2
+#define PROBE_MIN_FILE_SIZE (64 * 1024)     // below this, open() and close() dominate whatever the strategy
+#define PROBE_TIE_RATIO 1.05                // a larger buffer has to be 5% faster to be preferred
+
+// Upper bounds of the size classes mmap and chunked reads are compared on; larger files are not probed
+static const guint64 probe_classes[] = { 1024 * 1024, 16 * 1024 * 1024, 128 * 1024 * 1024 };
+#define N_PROBE_CLASSES G_N_ELEMENTS (probe_classes)
+
+static const gsize probe_buffer_sizes[] = { 1024 * 1024, 4 * 1024 * 1024, 16 * 1024 * 1024, 64 * 1024 * 1024 };
+
+struct calibration_t {
+    GHashTable *devices;    // dev_t (gint64) -> HashTuning
+};
+
+typedef struct probe_t {
+    GPtrArray *files[N_PROBE_CLASSES];
+    gchar *largest;         // the largest sample, for the buffer size
+    goffset largest_size;
+} Probe;
+
+
+gdouble
+calibration_measure (const gchar  *path,
+                     HashStrategy  strategy,
+                     gsize         buffer_size,
+                     gboolean      cold)
+{
+    int fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (cold) posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    guint64 hash = 0;
+    gint64 start = g_get_monotonic_time ();
+    gboolean ok = (strategy == HASH_STRATEGY_MMAP) ? hash_mapped_file (fd, &hash)
+                                                    : (hash = hash_chunked_file (fd, path, buffer_size)) != 0;
+    gint64 elapsed = g_get_monotonic_time () - start;
+    close (fd);
+
+    return ok ? (gdouble)elapsed / G_USEC_PER_SEC : -1;
+}
+
+
+static void
+probe_add (Probe       *probe,
+           const gchar *path,
+           GStatBuf    *st)
+{
+    // Sparse files are hashed without reading their holes: they say nothing about the device
+    if (st->st_size < PROBE_MIN_FILE_SIZE || (guint64)st->st_blocks * 512 < (guint64)st->st_size) return;
+
+    for (guint i = 0; i < N_PROBE_CLASSES; i++) {
+        if ((guint64)st->st_size > probe_classes[i]) continue;
+        if (probe->files[i]->len < PROBE_FILES_PER_CLASS) {
+            g_ptr_array_add (probe->files[i], g_strdup (path));
+            if (st->st_size > probe->largest_size) {
+                g_free (probe->largest);
+                probe->largest = g_strdup (path);
+                probe->largest_size = st->st_size;
+            }
+        }
+        return;
+    }
+}
+
+
+static gboolean
+probe_full (const Probe *probe)
+{
+    for (guint i = 0; i < N_PROBE_CLASSES; i++) {
+        if (probe->files[i]->len < PROBE_FILES_PER_CLASS) return FALSE;
+    }
+    return TRUE;
+}
+
+
+// Breadth-first from root, without leaving its device, until every size class has its samples
+static void
+collect_samples (const gchar *root,
+                 dev_t        dev,
+                 Probe       *probe)
+{
+    GQueue dirs = G_QUEUE_INIT;
+    g_queue_push_tail (&dirs, g_strdup (root));
+
+    guint entries = 0;
+    gchar *dir_path;
+    while (entries < PROBE_MAX_ENTRIES && !probe_full (probe) && (dir_path = g_queue_pop_head (&dirs)) != NULL) {
+        GDir *dir = g_dir_open (dir_path, 0, NULL);
+        if (dir) {
+            const gchar *name;
+            while (entries < PROBE_MAX_ENTRIES && (name = g_dir_read_name (dir)) != NULL) {
+                entries++;
+                gchar *path = g_build_filename (dir_path, name, NULL);
+                GStatBuf st;
+                if (g_lstat (path, &st) == 0 && st.st_dev == dev) {
+                    if (S_ISDIR (st.st_mode)) {
+                        g_queue_push_tail (&dirs, path);
+                        continue;
+                    }
+                    if (S_ISREG (st.st_mode)) probe_add (probe, path, &st);
+                }
+                g_free (path);
+            }
+            g_dir_close (dir);
+        }
+        g_free (dir_path);
+    }
+    g_queue_clear_full (&dirs, g_free);
+}
+
+
+// Cold mmap and chunked reads are compared class by class, smallest first: files are mapped up to the largest
+// class where mapping still wins. The buffer size is then picked on the largest sample.
+static gboolean
+probe_device (const gchar      *root,
+              dev_t             dev,
+              const HashTuning *fallback,
+              HashTuning       *tuning)
+{
+    Probe probe = { 0 };
+    for (guint i = 0; i < N_PROBE_CLASSES; i++) {
+        probe.files[i] = g_ptr_array_new_with_free_func (g_free);
+    }
+    collect_samples (root, dev, &probe);
+
+    *tuning = *fallback;
+    gboolean measured = FALSE;
+    gboolean mmap_wins = TRUE;
+    tuning->mmap_threshold = 0;
+    for (guint i = 0; i < N_PROBE_CLASSES; i++) {
+        gdouble mmap_time = 0, chunked_time = 0;
+        gboolean ok = probe.files[i]->len > 0;
+        for (guint j = 0; j < probe.files[i]->len && ok; j++) {
+            const gchar *path = g_ptr_array_index (probe.files[i], j);
+            gdouble m = calibration_measure (path, HASH_STRATEGY_MMAP, 0, TRUE);
+            gdouble c = calibration_measure (path, HASH_STRATEGY_CHUNKED, fallback->buffer_size, TRUE);
+            ok = m >= 0 && c >= 0;
+            mmap_time += m;
+            chunked_time += c;
+        }
+        if (!ok) continue;
+
+        measured = TRUE;
+        g_debug ("Calibration of %s: files up to %" G_GUINT64_FORMAT " bytes hashed in %.3f s mapped, %.3f s read",
+                 root, probe_classes[i], mmap_time, chunked_time);
+        if (mmap_wins && mmap_time <= chunked_time) {
+            tuning->mmap_threshold = (i == N_PROBE_CLASSES - 1) ? G_MAXUINT64 : probe_classes[i];
+        } else {
+            mmap_wins = FALSE;
+        }
+    }
+    if (!measured) tuning->mmap_threshold = fallback->mmap_threshold;
+
+    // Buffers larger than the file can't be told apart
+    if (probe.largest_size >= (goffset)probe_buffer_sizes[1]) {
+        gdouble best_time = -1;
+        for (guint i = 0; i < G_N_ELEMENTS (probe_buffer_sizes); i++) {
+            if (i > 0 && (goffset)probe_buffer_sizes[i - 1] >= probe.largest_size) break;
+            gdouble t = calibration_measure (probe.largest, HASH_STRATEGY_CHUNKED, probe_buffer_sizes[i], TRUE);
+            if (t < 0) continue;
+            if (best_time < 0 || t * PROBE_TIE_RATIO < best_time) {
+                best_time = t;
+                tuning->buffer_size = probe_buffer_sizes[i];
+            }
+        }
+        measured = measured || best_time >= 0;
+    }
+
+    for (guint i = 0; i < N_PROBE_CLASSES; i++) {
+        g_ptr_array_free (probe.files[i], TRUE);
+    }
+    g_free (probe.largest);
+
+    return measured;
+}
+
+
+static void
+add_device (Calibration      *calibration,
+            dev_t             dev,
+            const HashTuning *tuning)
+{
+    gint64 *key = g_new (gint64, 1);
+    *key = (gint64)dev;
+    HashTuning *value = g_new (HashTuning, 1);
+    *value = *tuning;
+    g_hash_table_replace (calibration->devices, key, value);
+}
+
+
+static void
+load_cached (Calibration *calibration,
+             GKeyFile    *key_file)
+{
+    gchar **groups = g_key_file_get_groups (key_file, NULL);
+    for (gchar **group = groups; *group != NULL; group++) {
+        guint dev_major, dev_minor;
+        if (sscanf (*group, "device %u:%u", &dev_major, &dev_minor) != 2) continue;
+
+        GError *error = NULL;
+        HashTuning tuning;
+        tuning.mmap_threshold = g_key_file_get_uint64 (key_file, *group, "mmap_threshold", &error);
+        if (error == NULL) tuning.buffer_size = g_key_file_get_uint64 (key_file, *group, "buffer_size", &error);
+        if (error != NULL || tuning.buffer_size == 0) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "Ignoring the invalid hash calibration of device %u:%u", dev_major, dev_minor);
+            g_clear_error (&error);
+            continue;
+        }
+        add_device (calibration, makedev (dev_major, dev_minor), &tuning);
+    }
+    g_strfreev (groups);
+}
+
+
+Calibration *
+calibration_load (const ConfigData *config_data)
+{
+    Calibration *calibration = g_try_new0 (Calibration, 1);
+    if (!calibration) {
+        g_log (NULL, G_LOG_LEVEL_ERROR, "Failed to allocate memory for Calibration");
+        return NULL;
+    }
+    calibration->devices = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, g_free);
+
+    // The cache lives next to the database: it describes the devices this database is built from
+    gchar *cache_path = g_build_filename (config_data->db_path, CALIBRATION_FILE, NULL);
+    GKeyFile *key_file = g_key_file_new ();
+    GError *error = NULL;
+    if (g_key_file_load_from_file (key_file, cache_path, G_KEY_FILE_NONE, &error)) {
+        load_cached (calibration, key_file);
+    } else if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Couldn't read the hash calibration %s: %s", cache_path, error->message);
+    }
+    g_clear_error (&error);
+
+    HashTuning fallback = hash_tuning_default (config_data);
+    gboolean probed = FALSE;
+    gchar **roots = g_strsplit (config_data->directories, ",", -1);
+    for (guint i = 0; roots[i] != NULL; i++) {
+        GStatBuf st;
+        if (g_stat (roots[i], &st) != 0 || calibration_lookup (calibration, st.st_dev) != NULL) continue;
+
+        HashTuning tuning;
+        g_message ("Calibrating the hashing strategy for the device of %s", roots[i]);
+        if (!probe_device (roots[i], st.st_dev, &fallback, &tuning)) {
+            g_message ("No sample files found under %s, using the default hashing strategy", roots[i]);
+            continue;
+        }
+        add_device (calibration, st.st_dev, &tuning);
+
+        gchar *buffer = g_format_size (tuning.buffer_size);
+        if (tuning.mmap_threshold == G_MAXUINT64) {
+            g_message ("Device %u:%u: mapping files whenever RAM allows, %s read buffer", major (st.st_dev), minor (st.st_dev), buffer);
+        } else {
+            gchar *threshold = g_format_size (tuning.mmap_threshold);
+            g_message ("Device %u:%u: mapping files below %s, %s read buffer", major (st.st_dev), minor (st.st_dev), threshold, buffer);
+            g_free (threshold);
+        }
+        g_free (buffer);
+
+        gchar *group = g_strdup_printf ("device %u:%u", major (st.st_dev), minor (st.st_dev));
+        g_key_file_set_string (key_file, group, "directory", roots[i]);
+        g_key_file_set_uint64 (key_file, group, "mmap_threshold", tuning.mmap_threshold);
+        g_key_file_set_uint64 (key_file, group, "buffer_size", tuning.buffer_size);
+        g_key_file_set_int64 (key_file, group, "calibrated_at", g_get_real_time () / G_USEC_PER_SEC);
+        g_free (group);
+        probed = TRUE;
+    }
+    g_strfreev (roots);
+
+    if (probed && !g_key_file_save_to_file (key_file, cache_path, &error)) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Couldn't save the hash calibration %s: %s", cache_path, error->message);
+        g_clear_error (&error);
+    }
+    g_key_file_free (key_file);
+    g_free (cache_path);
+
+    return calibration;
+}
+
+
+const HashTuning *
+calibration_lookup (const Calibration *calibration,
+                    dev_t              dev)
+{
+    if (calibration == NULL) return NULL;
+    gint64 key = (gint64)dev;
+    return g_hash_table_lookup (calibration->devices, &key);
+}
+
+
+void
+calibration_free (Calibration *calibration)
+{
+    if (!calibration) return;
+
+    g_hash_table_destroy (calibration->devices);
+    g_free (calibration);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <sys/types.h>
+#include <glib.h>
+#include "config.h"
+
+// How plain hashes are computed on a device
+typedef struct hash_tuning_t {
+    guint64 mmap_threshold;     // files smaller than this are hashed through a memory map, larger ones are read in chunks
+    gsize buffer_size;          // read buffer of the chunked path
+} HashTuning;
+
+typedef enum hash_strategy_t {
+    HASH_STRATEGY_MMAP = 0,
+    HASH_STRATEGY_CHUNKED
+} HashStrategy;
+
+// Calibrated HashTuning of every device holding a configured directory. The probe results are cached in
+// db_path, so that each device is probed once. Read-only once loaded: workers look it up without locking.
+typedef struct calibration_t Calibration;
+
+// Seconds taken to hash the file at path with the strategy (buffer_size is used by HASH_STRATEGY_CHUNKED). With cold,
+// the pages of the file are dropped from the page cache first so that the device is measured. Negative on failure.
+gdouble calibration_measure       (const gchar       *path,
+                                   HashStrategy       strategy,
+                                   gsize              buffer_size,
+                                   gboolean           cold);
+
+// Loads the cached calibrations and probes the devices of the configured directories that have none yet
+Calibration *calibration_load     (const ConfigData  *config_data);
+
+// NULL when the device was not calibrated (or calibration is NULL)
+const HashTuning *calibration_lookup (const Calibration *calibration,
+                                      dev_t              dev);
+
+void calibration_free             (Calibration       *calibration);
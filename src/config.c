@@ -1,6 +1,8 @@
 #include <glib.h>
 #include <glib/gstdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <xxhash.h>
 #include "config.h"
 
 
@@ -94,6 +96,32 @@ load_config (const char *config_path)
     // Reserve one thread for the queue-consumer thread
     config_data->threads_count = (config_data->threads_count > 2) ? config_data->threads_count-1 : config_data->threads_count;
 
+    // Adaptive mode: threads_count is only the starting point, the bounds may go beyond the core count for I/O-bound trees
+    config_data->adaptive_threads = g_key_file_get_boolean (key_file, "settings", "adaptive_threads", NULL);
+    config_data->min_threads = config_data->max_threads = config_data->threads_count;
+    if (config_data->adaptive_threads) {
+        t_val = g_key_file_get_integer (key_file, "settings", "min_threads", &config_error);
+        if (config_error != NULL || t_val < 1 || t_val > MAX_ADAPTIVE_THREADS) {
+            if (config_error == NULL || config_error->code != G_KEY_FILE_ERROR_KEY_NOT_FOUND) {
+                g_log (NULL, G_LOG_LEVEL_WARNING, "Invalid min_threads value: %d. Using the default value instead.", t_val);
+            }
+            t_val = 1;
+            g_clear_error (&config_error);
+        }
+        config_data->min_threads = (guint)t_val;
+
+        t_val = g_key_file_get_integer (key_file, "settings", "max_threads", &config_error);
+        if (config_error != NULL || t_val < (gint)config_data->min_threads || t_val > MAX_ADAPTIVE_THREADS) {
+            if (config_error == NULL || config_error->code != G_KEY_FILE_ERROR_KEY_NOT_FOUND) {
+                g_log (NULL, G_LOG_LEVEL_WARNING, "Invalid max_threads value: %d. Using the default value instead.", t_val);
+            }
+            t_val = (gint)MAX(config_data->threads_count, config_data->min_threads);
+            g_clear_error (&config_error);
+        }
+        config_data->max_threads = (guint)t_val;
+        config_data->threads_count = CLAMP(config_data->threads_count, config_data->min_threads, config_data->max_threads);
+    }
+
     t_val = g_key_file_get_integer (key_file, "settings", "ram_usage_percent", &config_error);
     if ((config_error != NULL && config_error->code == G_KEY_FILE_ERROR_KEY_NOT_FOUND) || t_val < 10 || t_val > 90) {
         g_log (NULL, G_LOG_LEVEL_WARNING, "Invalid ram_usage_percent value: %u. Using the default value instead.", t_val);
@@ -101,14 +129,48 @@ load_config (const char *config_path)
         g_clear_error (&config_error);
     }
     config_data->usable_ram = get_free_memory () * t_val / 100;
-    config_data->max_ram_per_thread = config_data->usable_ram / config_data->threads_count;
+    // Sized for the largest number of threads that may run at the same time
+    config_data->max_ram_per_thread = config_data->usable_ram / config_data->max_threads;
+
+    t_val = g_key_file_get_integer (key_file, "settings", "io_memory_percent", &config_error);
+    if (config_error != NULL && config_error->code == G_KEY_FILE_ERROR_KEY_NOT_FOUND) {
+        t_val = DEFAULT_IO_MEMORY_PERCENT;
+        g_clear_error (&config_error);
+    } else if (config_error != NULL || t_val < 10 || t_val > 90) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Invalid io_memory_percent value: %d. Using the default value instead.", t_val);
+        t_val = DEFAULT_IO_MEMORY_PERCENT;
+        g_clear_error (&config_error);
+    }
+    config_data->io_memory_budget = MAX (config_data->usable_ram * t_val / 100, MIN_IO_MEMORY_BYTES);
+
+    t_val = g_key_file_get_integer (key_file, "settings", "prefetch_window", &config_error);
+    if (config_error != NULL && config_error->code == G_KEY_FILE_ERROR_KEY_NOT_FOUND) {
+        t_val = (gint)(config_data->threads_count * PREFETCH_FILES_PER_THREAD);
+        g_clear_error (&config_error);
+    } else if (config_error != NULL || t_val < 0) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Invalid prefetch_window value: %d. Using the default value instead.", t_val);
+        t_val = (gint)(config_data->threads_count * PREFETCH_FILES_PER_THREAD);
+        g_clear_error (&config_error);
+    }
+    config_data->prefetch_window = t_val;
 
-    t_val = g_key_file_get_integer (key_file, "database", "db_size_mb", NULL);
-    if (t_val < 5) {
-        g_log (NULL, G_LOG_LEVEL_WARNING, "Invalid db_size_mb value: %u. Using the default value instead.", t_val);
-        t_val = DEFAULT_DB_SIZE_IN_MB;
+    t_val = g_key_file_get_integer (key_file, "settings", "read_timeout", &config_error);
+    if (config_error != NULL && config_error->code == G_KEY_FILE_ERROR_KEY_NOT_FOUND) {
+        t_val = DEFAULT_READ_TIMEOUT_SEC;
+        g_clear_error (&config_error);
+    } else if (config_error != NULL || t_val < 0) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Invalid read_timeout value: %d. Using the default value instead.", t_val);
+        t_val = DEFAULT_READ_TIMEOUT_SEC;
+        g_clear_error (&config_error);
     }
-    config_data->db_size_bytes = t_val * 1024 * 1024;
+    config_data->read_timeout_us = (guint64)t_val * G_USEC_PER_SEC;
+
+    guint64 db_size_mb = g_key_file_get_uint64 (key_file, "database", "db_size_mb", NULL);
+    if (db_size_mb < 5 || db_size_mb > G_MAXUINT64 / (1024 * 1024)) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Invalid db_size_mb value: %" G_GUINT64_FORMAT ". Using the default value instead.", db_size_mb);
+        db_size_mb = DEFAULT_DB_SIZE_IN_MB;
+    }
+    config_data->db_size_bytes = db_size_mb * 1024 * 1024;
 
     gchar *t_str = g_key_file_get_string (key_file, "database", "db_path", NULL);
     config_data->db_path = (t_str != NULL) ? g_strdup (t_str) : g_strdup (DEFAULT_DB_PATH);
@@ -126,6 +188,29 @@ load_config (const char *config_path)
     config_data->db_mapasync = g_key_file_get_boolean (key_file, "database", "lmdb_mapasync", NULL);
     config_data->db_writemap = g_key_file_get_boolean (key_file, "database", "lmdb_writemap", NULL);
 
+    t_str = g_key_file_get_string (key_file, "database", "shard_layout", NULL);
+    if (t_str == NULL || g_strcmp0 (t_str, "none") == 0) {
+        config_data->shard_layout = SHARD_NONE;
+    } else if (g_strcmp0 (t_str, "root") == 0) {
+        config_data->shard_layout = SHARD_BY_ROOT;
+    } else if (g_strcmp0 (t_str, "hash") == 0) {
+        config_data->shard_layout = SHARD_BY_HASH;
+    } else {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Invalid shard_layout value: %s. Using a single database instead.", t_str);
+        config_data->shard_layout = SHARD_NONE;
+    }
+    g_free (t_str);
+
+    t_val = g_key_file_get_integer (key_file, "database", "shard_count", &config_error);
+    if (config_error != NULL || t_val < 1 || t_val > MAX_SHARD_COUNT) {
+        if (config_error == NULL || config_error->code != G_KEY_FILE_ERROR_KEY_NOT_FOUND) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "Invalid shard_count value: %d. Using the default value instead.", t_val);
+        }
+        t_val = DEFAULT_SHARD_COUNT;
+        g_clear_error (&config_error);
+    }
+    config_data->shard_count = t_val;
+
     gboolean t_val_bool = g_key_file_get_boolean (key_file, "logging", "log_to_file_enabled", &config_error);
     if (!t_val_bool && (config_error != NULL && (config_error->code == G_KEY_FILE_ERROR_INVALID_VALUE || config_error->code == G_KEY_FILE_ERROR_KEY_NOT_FOUND))) {
         g_log (NULL, G_LOG_LEVEL_WARNING, "Couldn't get the value for log_to_file_enabled. Setting it to the default one.");
@@ -152,6 +237,27 @@ load_config (const char *config_path)
         }
     }
 
+    t_val = g_key_file_get_integer (key_file, "logging", "log_buffer_entries", &config_error);
+    if (config_error != NULL || t_val < 16 || t_val > MAX_LOG_BUFFER_ENTRIES) {
+        if (config_error == NULL || config_error->code != G_KEY_FILE_ERROR_KEY_NOT_FOUND) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "Invalid log_buffer_entries value: %d. Using the default value instead.", t_val);
+        }
+        t_val = DEFAULT_LOG_BUFFER_ENTRIES;
+        g_clear_error (&config_error);
+    }
+    config_data->log_buffer_entries = t_val;
+
+    t_str = g_key_file_get_string (key_file, "logging", "log_overflow_policy", NULL);
+    if (t_str == NULL || g_strcmp0 (t_str, "block") == 0) {
+        config_data->log_drop_on_overflow = FALSE;
+    } else if (g_strcmp0 (t_str, "drop") == 0) {
+        config_data->log_drop_on_overflow = TRUE;
+    } else {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Invalid log_overflow_policy value: %s. Using 'block' instead.", t_str);
+        config_data->log_drop_on_overflow = FALSE;
+    }
+    g_free (t_str);
+
     t_val = g_key_file_get_integer (key_file, "scanning", "max_recursion_depth", &config_error);
     if ((config_error != NULL && config_error->code == G_KEY_FILE_ERROR_KEY_NOT_FOUND) || t_val < 0 || t_val > 64) {
         g_log (NULL, G_LOG_LEVEL_WARNING, "Invalid max_recursion_depth value: %u. Using the default value instead.", t_val);
@@ -175,7 +281,16 @@ load_config (const char *config_path)
         free_config (config_data);
         return NULL;
     }
-    config_data->directories = g_strdup (t_str);
+    // Records are keyed by absolute path: relative entries are resolved against the working directory once, here
+    gchar **dirs = g_strsplit (t_str, ",", -1);
+    for (guint i = 0; dirs[i]; i++) {
+        if (dirs[i][0] == '\0' || g_path_is_absolute (dirs[i])) continue;
+        gchar *absolute = g_canonicalize_filename (dirs[i], NULL);
+        g_free (dirs[i]);
+        dirs[i] = absolute;
+    }
+    config_data->directories = g_strjoinv (",", dirs);
+    g_strfreev (dirs);
     g_free (t_str);
 
     t_str = g_key_file_get_string (key_file, "scanning", "exclude_directories", NULL);
@@ -192,12 +307,105 @@ load_config (const char *config_path)
     if (g_utf8_strlen (t_str, -1) > 0) config_data->exclude_extensions = g_strdup (t_str);
     g_free (t_str);
 
+    t_str = g_key_file_get_string (key_file, "scanning", "exclude_patterns", NULL);
+    if (t_str && g_utf8_strlen (t_str, -1) > 0) config_data->exclude_patterns = g_strdup (t_str);
+    g_free (t_str);
+
+    t_val = g_key_file_get_integer (key_file, "verification", "verify_cycle_days", &config_error);
+    if (config_error != NULL && config_error->code == G_KEY_FILE_ERROR_KEY_NOT_FOUND) {
+        t_val = DEFAULT_VERIFY_CYCLE_DAYS;
+        g_clear_error (&config_error);
+    } else if (config_error != NULL || t_val < 0) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Invalid verify_cycle_days value: %d. Using the default value instead.", t_val);
+        t_val = DEFAULT_VERIFY_CYCLE_DAYS;
+        g_clear_error (&config_error);
+    }
+    config_data->verify_cycle_days = t_val;
+
+    config_data->sample_fingerprint = g_key_file_get_boolean (key_file, "verification", "sample_fingerprint", NULL);
+
+    t_val = g_key_file_get_integer (key_file, "verification", "sample_min_size_mb", &config_error);
+    if (config_error != NULL && config_error->code == G_KEY_FILE_ERROR_KEY_NOT_FOUND) {
+        t_val = DEFAULT_SAMPLE_MIN_SIZE_MB;
+        g_clear_error (&config_error);
+    } else if (config_error != NULL || t_val < 0) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Invalid sample_min_size_mb value: %d. Using the default value instead.", t_val);
+        t_val = DEFAULT_SAMPLE_MIN_SIZE_MB;
+        g_clear_error (&config_error);
+    }
+    config_data->sample_min_size = (guint64)t_val * 1024 * 1024;
+
+    t_val_bool = g_key_file_get_boolean (key_file, "verification", "sparse_hashing", &config_error);
+    if (config_error != NULL) {
+        if (config_error->code != G_KEY_FILE_ERROR_KEY_NOT_FOUND) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "Couldn't get the value for sparse_hashing. Setting it to the default one.");
+        }
+        t_val_bool = DEFAULT_SPARSE_HASHING;
+        g_clear_error (&config_error);
+    }
+    config_data->sparse_hashing = t_val_bool;
+
+    t_val_bool = g_key_file_get_boolean (key_file, "verification", "detect_moves", &config_error);
+    if (config_error != NULL) {
+        if (config_error->code != G_KEY_FILE_ERROR_KEY_NOT_FOUND) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "Couldn't get the value for detect_moves. Setting it to the default one.");
+        }
+        t_val_bool = DEFAULT_DETECT_MOVES;
+        g_clear_error (&config_error);
+    }
+    config_data->detect_moves = t_val_bool;
+
+    t_val_bool = g_key_file_get_boolean (key_file, "settings", "calibrate_hashing", &config_error);
+    if (config_error != NULL) {
+        if (config_error->code != G_KEY_FILE_ERROR_KEY_NOT_FOUND) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "Couldn't get the value for calibrate_hashing. Setting it to the default one.");
+        }
+        t_val_bool = DEFAULT_CALIBRATE_HASHING;
+        g_clear_error (&config_error);
+    }
+    config_data->calibrate_hashing = t_val_bool;
+
+    t_str = g_key_file_get_string (key_file, "server", "socket_path", NULL);
+    config_data->socket_path = g_strdup ((t_str && g_utf8_strlen (t_str, -1) > 0) ? t_str : DEFAULT_SOCKET_PATH);
+    g_free (t_str);
+
+    t_str = g_key_file_get_string (key_file, "server", "allowed_users", NULL);
+    if (t_str && g_utf8_strlen (t_str, -1) > 0) config_data->allowed_users = g_strdup (t_str);
+    g_free (t_str);
+
+    t_str = g_key_file_get_string (key_file, "server", "allowed_groups", NULL);
+    if (t_str && g_utf8_strlen (t_str, -1) > 0) config_data->allowed_groups = g_strdup (t_str);
+    g_free (t_str);
+
     g_key_file_free (key_file);
 
     return config_data;
 }
 
 
+gboolean
+config_in_slice (const ConfigData *config_data,
+                 const gchar      *top_path)
+{
+    if (config_data->slice_count <= 1) return TRUE;
+    return XXH3_64bits (top_path, strlen (top_path)) % config_data->slice_count == config_data->slice_index;
+}
+
+
+void
+config_set_slice (ConfigData *config_data,
+                  guint       slice_index,
+                  guint       slice_count)
+{
+    config_data->slice_index = slice_index;
+    config_data->slice_count = slice_count;
+
+    gchar *db_path = g_strdup_printf ("%s.slice-%u-of-%u", config_data->db_path, slice_index, slice_count);
+    g_free (config_data->db_path);
+    config_data->db_path = db_path;
+}
+
+
 void
 free_config (ConfigData *config)
 {
@@ -206,5 +414,9 @@ free_config (ConfigData *config)
     g_free (config->directories);
     g_free (config->exclude_directories);
     g_free (config->exclude_extensions);
+    g_free (config->exclude_patterns);
+    g_free (config->socket_path);
+    g_free (config->allowed_users);
+    g_free (config->allowed_groups);
     g_free (config);
 }
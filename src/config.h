@@ -6,39 +6,92 @@
 #define DEFAULT_CONFIG_PATH         "/etc/ffc.conf"
 #define DEFAULT_DB_PATH             "/var/lib/ffc/ffc.db"
 #define DEFAULT_LOG_PATH            "/var/log/ffc/ffc.log"
+#define DEFAULT_SOCKET_PATH         "/run/ffc/ffc.sock"
+#define DEFAULT_LOG_BUFFER_ENTRIES  8192
+#define MAX_LOG_BUFFER_ENTRIES      1048576
 #define DEFAULT_DB_SIZE_IN_MB       15
 #define DEFAULT_RAM_USAGE_PERCENT   70
+#define PREFETCH_FILES_PER_THREAD   4
+#define DEFAULT_IO_MEMORY_PERCENT   50
+#define MIN_IO_MEMORY_BYTES         (32 * 1024 * 1024)
+#define MAX_ADAPTIVE_THREADS        256
 #define DEFAULT_MAX_RECURSION_DEPTH 10
 #define DEFAULT_LOG_TO_FILE         TRUE
 #define DEFAULT_EXCLUDE_HIDDEN      TRUE
+#define DEFAULT_VERIFY_CYCLE_DAYS   7
+#define DEFAULT_SAMPLE_MIN_SIZE_MB  64
+#define DEFAULT_SPARSE_HASHING      TRUE
+#define DEFAULT_CALIBRATE_HASHING   FALSE
+#define DEFAULT_DETECT_MOVES        TRUE
+#define DEFAULT_READ_TIMEOUT_SEC    300
+#define DEFAULT_SHARD_COUNT         8
+#define MAX_SHARD_COUNT             256
 
 typedef enum mode_t {
     MODE_ADD = 1,
     MODE_CHECK = 2,
-    MODE_UPDATE = 3
+    MODE_UPDATE = 3,
+    MODE_MERGE = 4,
+    MODE_DUPLICATES = 5,
+    MODE_COMPACT = 6,
+    MODE_EXPORT = 7,
+    MODE_IMPORT = 8,
+    MODE_DIFF = 9
 } Mode;
 
+typedef enum shard_layout_t {
+    SHARD_NONE = 0,     // one environment at db_path
+    SHARD_BY_ROOT,      // one environment per configured root directory
+    SHARD_BY_HASH       // shard_count environments, files routed by path hash
+} ShardLayout;
+
 typedef struct config_t {
     guint threads_count;
+    gboolean adaptive_threads;  // tune the number of hashing threads between min_threads and max_threads while running
+    guint min_threads;
+    guint max_threads;
     guint64 usable_ram;
     guint64 max_ram_per_thread;
+    guint64 io_memory_budget;   // file data (read buffers, mapped windows) all workers may hold at the same time
+    guint prefetch_window;   // files queued for the workers whose reading is started ahead of them (0 disables)
+    gboolean calibrate_hashing; // probe mmap against chunked reads per device, instead of deciding from the per-thread RAM
+    guint64 read_timeout_us;    // a file whose reads make no progress for this long is given up (0 = never)
 
     gchar *db_path;
-    guint db_size_bytes;
+    guint64 db_size_bytes;
     // LMDB performance/durability toggles
     gboolean db_nosync;      // Reduce fsync frequency (unsafe on power loss)
     gboolean db_nometasync;  // Skip metadata syncs (unsafe on power loss)
     gboolean db_mapasync;    // Allow OS to flush asynchronously (unsafe on crash)
     gboolean db_writemap;    // Use writeable memory map (faster, but riskier with multiple processes)
+    ShardLayout shard_layout;
+    guint shard_count;       // number of shards for SHARD_BY_HASH
 
     gboolean logging_enabled;
     gchar *log_path;
+    guint log_buffer_entries;        // capacity of the asynchronous log queue (rounded up to a power of two)
+    gboolean log_drop_on_overflow;   // drop messages when the queue is full instead of waiting for the writer
 
     guint max_recursion_depth;
     gchar *directories;
     gboolean exclude_hidden;
     gchar *exclude_directories;
     gchar *exclude_extensions;
+    gchar *exclude_patterns;  // globs: '/abs/*/path', 'name', '*.ext', '**', trailing '/' for directories only
+    guint slice_index;        // --shard i/N: only scan the entries right below the roots that fall into slice i ...
+    guint slice_count;        // ... of N (see config_in_slice); 0 scans everything
+
+    guint verify_cycle_days;  // every file must get a full-content check at least this often (0 disables)
+    guint64 time_budget_us;   // budgeted check: stop full-content checks after this much time (0 = no limit)
+    guint64 byte_budget;      // budgeted check: hash at most this many bytes per run (0 = no limit)
+    gboolean sample_fingerprint;  // store a fingerprint of a few sampled blocks and compare it before hashing the whole file
+    guint64 sample_min_size;      // files smaller than this are always hashed fully
+    gboolean sparse_hashing;      // hash sparse files without reading their holes (HASH_FORMAT_SPARSE)
+    gboolean detect_moves;        // pair files missing in the database with records whose file is gone (same inode or hash)
+
+    gchar *socket_path;       // Unix socket the serve command listens on
+    gchar *allowed_users;     // comma-separated user names or uids that may send requests besides root and the server's user (NULL if none)
+    gchar *allowed_groups;    // same for the primary group of the client, besides the server's group (NULL if none)
 
     gboolean verbose; // enable verbose console output and debug logs
 
@@ -47,4 +100,14 @@ typedef struct config_t {
 
 ConfigData *load_config (const char *config_path);
 
+// TRUE when the entry at top_path (a file or directory right below a scanned root) belongs to the slice of this
+// host. The split only depends on the path, so hosts scanning the same mount points get disjoint slices.
+gboolean config_in_slice (const ConfigData *config_data,
+                          const gchar      *top_path);
+
+// Applies --shard i/N: records go to their own database, db_path.slice-i-of-N
+void config_set_slice    (ConfigData       *config_data,
+                          guint             slice_index,
+                          guint             slice_count);
+
 void free_config        (ConfigData *config);
\ No newline at end of file
@@ -1,49 +1,501 @@
+#define _GNU_SOURCE     // F_OFD_SETLK
+
 #include <lmdb.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <xxhash.h>
+#include <glib/gstdio.h>
 #include "config.h"
 #include "database.h"
 
 #include <unistd.h>
 
+#define MERGE_BATCH_SIZE 10000
+#define DB_GROWTH_FACTOR 2
+// Rough on-disk cost of one record: average path, the entry itself and B-tree overhead with half-full pages
+#define DB_RECORD_SIZE_ESTIMATE 640
+#define DB_EXPECT_GRANULARITY 4096
+// Named databases of every environment; their names are keys of the main database, sorting before every absolute path
+#define DB_HASH_INDEX_NAME ".hash-index"
+#define DB_INODE_INDEX_NAME ".inode-index"
+#define DB_ROLLUP_NAME ".rollups"
+#define DB_NAMED_DBS 3
+#define DB_DATA_FILE "data.mdb"
+#define DB_LOCK_FILE "lock.mdb"
+#define DB_COMPACT_SUFFIX ".compact"
+
+
+void
+db_read_entry (const MDB_val *data,
+               FileEntryData *entry)
+{
+    memset (entry, 0, sizeof(FileEntryData));
+    memcpy (entry, data->mv_data, MIN(data->mv_size, sizeof(FileEntryData)));
+}
+
+
+gint
+db_compare_keys (const MDB_val *a,
+                 const MDB_val *b)
+{
+    gsize len = MIN (a->mv_size, b->mv_size);
+    int diff = memcmp (a->mv_data, b->mv_data, len);
+    if (diff != 0) return diff;
+    return (a->mv_size > b->mv_size) - (a->mv_size < b->mv_size);
+}
+
+
+// Moves path from old_value to new_value in an index (0: no entry)
+static int
+index_update (MDB_txn *txn,
+              MDB_dbi  dbi,
+              MDB_val *path,
+              guint64  old_value,
+              guint64  new_value)
+{
+    if (old_value == new_value) return 0;
+
+    MDB_val index_key = { .mv_size = sizeof(guint64), .mv_data = &old_value };
+    if (old_value != 0) {
+        int rc = mdb_del (txn, dbi, &index_key, path);
+        if (rc != 0 && rc != MDB_NOTFOUND) return rc;
+    }
+    if (new_value == 0) return 0;
+
+    index_key.mv_data = &new_value;
+    int rc = mdb_put (txn, dbi, &index_key, path, MDB_NODUPDATA);
+    return rc == MDB_KEYEXIST ? 0 : rc;
+}
+
+
+guint64
+db_inode_key (guint64 device,
+              guint64 inode)
+{
+    if (inode == 0) return 0;
+    guint64 fields[2] = { GUINT64_TO_LE (device), GUINT64_TO_LE (inode) };
+    guint64 key = XXH3_64bits (fields, sizeof(fields));
+    // Collisions only add candidates: movers compare the device and inode of the record itself
+    return key != 0 ? key : 1;
+}
+
+
+guint64
+db_rollup_leaf (const gchar         *path,
+                const FileEntryData *entry)
+{
+    guint64 fields[2] = { GUINT64_TO_LE (entry->hash), GUINT64_TO_LE ((guint64)entry->size) };
+    return XXH3_64bits_withSeed (fields, sizeof(fields), XXH3_64bits (path, strlen (path)));
+}
+
+
+// Applies the change of one record (its leaf digest, and the number of records: -1, 0 or +1)
+// to the rollups of every directory above it
+static int
+rollup_update (MDB_txn     *txn,
+               MDB_dbi      dbi,
+               const gchar *path,
+               guint64      delta_sum,
+               gint         delta_files)
+{
+    if (delta_sum == 0 && delta_files == 0) return 0;
+
+    gchar dir[PATH_MAX];
+    gsize len = strnlen (path, sizeof(dir) - 1);
+    memcpy (dir, path, len);
+    dir[len] = '\0';
+
+    int rc = 0;
+    for (gchar *slash = strrchr (dir, '/'); slash != NULL && rc == 0; slash = strrchr (dir, '/')) {
+        // "/a/b" -> "/a" -> "/"
+        if (slash == dir) {
+            if (dir[1] == '\0') break;
+            dir[1] = '\0';
+        } else {
+            *slash = '\0';
+        }
+
+        MDB_val key = { .mv_size = strlen (dir) + 1, .mv_data = dir }, data;
+        DbRollup rollup = { 0 };
+        rc = mdb_get (txn, dbi, &key, &data);
+        if (rc == 0) {
+            memcpy (&rollup, data.mv_data, MIN(data.mv_size, sizeof(rollup)));
+        } else if (rc != MDB_NOTFOUND) {
+            break;
+        }
+        rollup.sum += delta_sum;
+        rollup.files += (guint64)(gint64)delta_files;
+
+        if (rollup.files == 0) {
+            rc = mdb_del (txn, dbi, &key, NULL);
+            if (rc == MDB_NOTFOUND) rc = 0;
+        } else {
+            data.mv_size = sizeof(rollup);
+            data.mv_data = &rollup;
+            rc = mdb_put (txn, dbi, &key, &data, 0);
+        }
+    }
+    return rc;
+}
+
+
+int
+db_put_entry (DbShard      *shard,
+              MDB_txn      *txn,
+              MDB_val      *key,
+              MDB_val      *data,
+              unsigned int  flags)
+{
+    FileEntryData entry, old = { 0 };
+    gboolean replaced = FALSE;
+    const gchar *path = key->mv_data;
+
+    if (key->mv_size < 2 || path[0] != '/' || path[key->mv_size - 1] != '\0') {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Refusing to store a record that is not keyed by an absolute path: %.*s",
+               (int)key->mv_size, path);
+        return EINVAL;
+    }
+    db_read_entry (data, &entry);
+
+    if (!(flags & MDB_APPEND)) {
+        MDB_val old_data;
+        int rc = mdb_get (txn, shard->dbi, key, &old_data);
+        if (rc == 0) {
+            db_read_entry (&old_data, &old);
+            replaced = TRUE;
+        } else if (rc != MDB_NOTFOUND) {
+            return rc;
+        }
+    }
+
+    int rc = mdb_put (txn, shard->dbi, key, data, flags);
+    if (rc == 0) rc = index_update (txn, shard->hash_dbi, key, old.hash, entry.hash);
+    if (rc == 0) rc = index_update (txn, shard->inode_dbi, key, db_inode_key (old.device, (guint64)old.inode),
+                                    db_inode_key (entry.device, (guint64)entry.inode));
+    if (rc == 0) {
+        // Metadata-only rewrites (e.g. the time of the last verification) leave the rollups alone
+        guint64 leaf = db_rollup_leaf (key->mv_data, &entry);
+        guint64 old_leaf = replaced ? db_rollup_leaf (key->mv_data, &old) : 0;
+        rc = rollup_update (txn, shard->rollup_dbi, key->mv_data, leaf - old_leaf, replaced ? 0 : 1);
+    }
+    return rc;
+}
+
+
+int
+db_del_entry (DbShard *shard,
+              MDB_txn *txn,
+              MDB_val *key)
+{
+    MDB_val data;
+    int rc = mdb_get (txn, shard->dbi, key, &data);
+    if (rc != 0) return rc;
+
+    FileEntryData old;
+    db_read_entry (&data, &old);
+    rc = mdb_del (txn, shard->dbi, key, NULL);
+    if (rc == 0) rc = index_update (txn, shard->hash_dbi, key, old.hash, 0);
+    if (rc == 0) rc = index_update (txn, shard->inode_dbi, key, db_inode_key (old.device, (guint64)old.inode), 0);
+    if (rc == 0) rc = rollup_update (txn, shard->rollup_dbi, key->mv_data, 0 - db_rollup_leaf (key->mv_data, &old), -1);
+    return rc;
+}
+
+
+DbRollup
+db_get_rollup (DatabaseData  *db_data,
+               MDB_txn      **txns,
+               const gchar   *dir_path)
+{
+    DbRollup total = { 0 };
+    MDB_val key = { .mv_size = strlen (dir_path) + 1, .mv_data = (void *)dir_path }, data;
+
+    for (guint i = 0; i < db_data->n_shards; i++) {
+        DbRollup rollup = { 0 };
+        if (mdb_get (txns[i], db_data->shards[i].rollup_dbi, &key, &data) != 0) continue;
+        memcpy (&rollup, data.mv_data, MIN(data.mv_size, sizeof(rollup)));
+        total.sum += rollup.sum;
+        total.files += rollup.files;
+    }
+    return total;
+}
+
+
+int
+db_cursor_first (MDB_cursor *cursor,
+                 MDB_val    *key,
+                 MDB_val    *data)
+{
+    key->mv_size = 1;
+    key->mv_data = (void *)"/";
+    return mdb_cursor_get (cursor, key, data, MDB_SET_RANGE);
+}
+
+
+void
+db_find_paths (DbShard   *shard,
+               MDB_txn   *txn,
+               DbIndex    index,
+               guint64    value,
+               GPtrArray *paths)
+{
+    MDB_cursor *cursor;
+    MDB_val key = { .mv_size = sizeof(guint64), .mv_data = &value }, data;
+
+    if (value == 0 || mdb_cursor_open (txn, index == DB_INDEX_HASH ? shard->hash_dbi : shard->inode_dbi, &cursor) != 0) return;
+    int rc = mdb_cursor_get (cursor, &key, &data, MDB_SET);
+    while (rc == 0) {
+        g_ptr_array_add (paths, g_strndup (data.mv_data, data.mv_size));
+        rc = mdb_cursor_get (cursor, &key, &data, MDB_NEXT_DUP);
+    }
+    mdb_cursor_close (cursor);
+}
+
+
+int
+db_txn_begin (DbShard       *shard,
+              unsigned int   flags,
+              MDB_txn      **txn,
+              guint64       *map_size)
+{
+    g_rw_lock_reader_lock (&shard->resize_lock);
+    int rc = mdb_txn_begin (shard->env, NULL, flags, txn);
+    if (rc == MDB_MAP_RESIZED) {
+        // Another process grew the map: adopt its size and retry
+        g_rw_lock_reader_unlock (&shard->resize_lock);
+        g_rw_lock_writer_lock (&shard->resize_lock);
+        rc = mdb_env_set_mapsize (shard->env, 0);
+        if (rc == 0) {
+            MDB_envinfo info;
+            mdb_env_info (shard->env, &info);
+            shard->map_size = info.me_mapsize;
+        }
+        g_rw_lock_writer_unlock (&shard->resize_lock);
+        g_rw_lock_reader_lock (&shard->resize_lock);
+        rc = mdb_txn_begin (shard->env, NULL, flags, txn);
+    }
+    if (rc != 0) {
+        g_rw_lock_reader_unlock (&shard->resize_lock);
+        return rc;
+    }
+    if (map_size) *map_size = shard->map_size;
+    return 0;
+}
+
+
+int
+db_txn_commit (DbShard *shard,
+               MDB_txn *txn)
+{
+    int rc = mdb_txn_commit (txn);
+    g_rw_lock_reader_unlock (&shard->resize_lock);
+    return rc;
+}
+
+
+void
+db_txn_abort (DbShard *shard,
+              MDB_txn *txn)
+{
+    mdb_txn_abort (txn);
+    g_rw_lock_reader_unlock (&shard->resize_lock);
+}
+
+
+static gboolean
+resize_map (DbShard *shard,
+            guint64  observed_map_size,
+            guint64  new_map_size)
+{
+    gboolean grown = TRUE;
+
+    // No transaction of this process may be active while the map is resized: wait for all of them to finish
+    g_rw_lock_writer_lock (&shard->resize_lock);
+    if (shard->map_size == observed_map_size && new_map_size > shard->map_size) {
+        int rc = mdb_env_set_mapsize (shard->env, new_map_size);
+        if (rc == 0) {
+            g_message ("Database map of %s grown from %" G_GUINT64_FORMAT " to %" G_GUINT64_FORMAT " bytes",
+                       shard->path, shard->map_size, new_map_size);
+            shard->map_size = new_map_size;
+        } else {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "Error in mdb_env_set_mapsize: %s", mdb_strerror (rc));
+            grown = FALSE;
+        }
+    }
+    // else: somebody else already grew the map since the caller observed it
+    g_rw_lock_writer_unlock (&shard->resize_lock);
+
+    return grown;
+}
+
+
+gboolean
+db_grow (DbShard *shard,
+         guint64  observed_map_size)
+{
+    if (observed_map_size > G_MAXUINT64 / DB_GROWTH_FACTOR) return FALSE;
+    return resize_map (shard, observed_map_size, observed_map_size * DB_GROWTH_FACTOR);
+}
+
+
+void
+db_expect_begin (DatabaseData *db_data)
+{
+    for (guint i = 0; i < db_data->n_shards; i++) {
+        DbShard *shard = &db_data->shards[i];
+        MDB_stat stat;
+        // Files already stored are counted twice when the pass rewrites them: the estimate stays within twice the
+        // records, instead of growing with every pass of a long-lived context
+        g_rw_lock_reader_lock (&shard->resize_lock);
+        int rc = mdb_env_stat (shard->env, &stat);
+        g_rw_lock_reader_unlock (&shard->resize_lock);
+        // The main database also holds the entries naming the index databases
+        gsize stored = rc == 0 && stat.ms_entries > DB_NAMED_DBS ? stat.ms_entries - DB_NAMED_DBS : 0;
+        g_atomic_pointer_set (&shard->expected_records, stored);
+    }
+}
+
+
+void
+db_expect_records (DbShard *shard,
+                   guint64  count)
+{
+    // Queue consumers of concurrent passes share the shard; only re-evaluate every few thousand files
+    gsize previous = g_atomic_pointer_add (&shard->expected_records, (gsize)count);
+    guint64 expected = (guint64)previous + count;
+    if (previous / DB_EXPECT_GRANULARITY == expected / DB_EXPECT_GRANULARITY) return;
+
+    guint64 needed = expected * DB_RECORD_SIZE_ESTIMATE;
+    g_rw_lock_reader_lock (&shard->resize_lock);
+    guint64 current = shard->map_size;
+    g_rw_lock_reader_unlock (&shard->resize_lock);
+    if (needed <= current) return;
+
+    guint64 target = current;
+    while (target < needed && target <= G_MAXUINT64 / DB_GROWTH_FACTOR) target *= DB_GROWTH_FACTOR;
+    resize_map (shard, current, target);
+}
+
+
+static void
+close_env (DbShard *shard)
+{
+    if (shard->env && shard->hash_dbi) mdb_dbi_close (shard->env, shard->hash_dbi);
+    if (shard->env && shard->inode_dbi) mdb_dbi_close (shard->env, shard->inode_dbi);
+    if (shard->env && shard->rollup_dbi) mdb_dbi_close (shard->env, shard->rollup_dbi);
+    if (shard->env && shard->dbi) mdb_dbi_close (shard->env, shard->dbi);
+    if (shard->env) mdb_env_close (shard->env);
+    shard->env = NULL;
+    shard->dbi = shard->hash_dbi = shard->inode_dbi = shard->rollup_dbi = 0;
+}
+
+
+static void
+close_shard (DbShard *shard)
+{
+    close_env (shard);
+    g_free (shard->path);
+    g_free (shard->root);
+    g_rw_lock_clear (&shard->resize_lock);
+}
+
 
 void
 free_db (DatabaseData *db_data)
 {
     if (db_data) {
-        if (db_data->env && db_data->dbi) mdb_dbi_close (db_data->env, db_data->dbi);
-        if (db_data->env) mdb_env_close (db_data->env);
+        for (guint i = 0; i < db_data->n_shards; i++) {
+            close_shard (&db_data->shards[i]);
+        }
+        g_free (db_data->shards);
         g_free (db_data);
     }
 }
 
 
-DatabaseData *
-init_db (ConfigData *config_data)
+// Adds every record to the hash and inode indexes and/or to the rollups, in a single write transaction,
+// grown and retried on MDB_MAP_FULL
+static gboolean
+build_indexes (DbShard  *shard,
+               gboolean  hashes,
+               gboolean  rollups)
 {
-    if (!config_data || !config_data->db_path) {
-        g_log (NULL, G_LOG_LEVEL_ERROR, "Invalid configuration data");
-        return NULL;
+    guint64 indexed;
+    int rc;
+
+    do {
+        MDB_txn *txn;
+        MDB_cursor *cursor;
+        MDB_val key, data;
+        guint64 map_size = 0;
+
+        indexed = 0;
+        rc = db_txn_begin (shard, 0, &txn, &map_size);
+        if (rc != 0) break;
+        rc = mdb_cursor_open (txn, shard->dbi, &cursor);
+        if (rc == 0) {
+            for (int found = db_cursor_first (cursor, &key, &data); found == 0 && rc == 0;
+                 found = mdb_cursor_get (cursor, &key, &data, MDB_NEXT)) {
+                FileEntryData entry;
+                db_read_entry (&data, &entry);
+                if (hashes) {
+                    rc = index_update (txn, shard->hash_dbi, &key, 0, entry.hash);
+                    if (rc == 0) rc = index_update (txn, shard->inode_dbi, &key, 0, db_inode_key (entry.device, (guint64)entry.inode));
+                }
+                if (rollups && rc == 0) rc = rollup_update (txn, shard->rollup_dbi, key.mv_data, db_rollup_leaf (key.mv_data, &entry), 1);
+                indexed++;
+            }
+            mdb_cursor_close (cursor);
+        }
+        if (rc == 0) {
+            rc = db_txn_commit (shard, txn);
+        } else {
+            db_txn_abort (shard, txn);
+        }
+        if (rc == MDB_MAP_FULL && !db_grow (shard, map_size)) break;
+    } while (rc == MDB_MAP_FULL);
+
+    if (rc != 0) {
+        g_log (NULL, G_LOG_LEVEL_ERROR, "Indexing %s failed: %s", shard->path, mdb_strerror (rc));
+        return FALSE;
+    }
+    if (indexed > 0) {
+        g_message ("Indexed %" G_GUINT64_FORMAT " records of %s%s%s", indexed, shard->path,
+                   hashes ? " by content hash and inode" : "", rollups ? " into directory rollups" : "");
     }
+    return TRUE;
+}
 
-    DatabaseData *db_data = g_try_new0 (DatabaseData, 1);
-    if (!db_data) {
-        g_log (NULL, G_LOG_LEVEL_ERROR, "Failed to allocate memory for DatabaseData");
-        return NULL;
+
+static gboolean
+open_shard (DbShard    *shard,
+            ConfigData *config_data)
+{
+    if (g_mkdir_with_parents (shard->path, 0755) != 0) {
+        g_log (NULL, G_LOG_LEVEL_ERROR, "Unable to create the database directory: %s", shard->path);
+        return FALSE;
     }
 
-    int rc = mdb_env_create (&db_data->env);
+    int rc = mdb_env_create (&shard->env);
     if (rc != 0) {
         g_log (NULL, G_LOG_LEVEL_ERROR, "Error in mdb_env_create: %s", mdb_strerror (rc));
-        g_free (db_data);
-        return NULL;
+        shard->env = NULL;
+        return FALSE;
     }
 
-    rc = mdb_env_set_mapsize (db_data->env, config_data->db_size_bytes);
+    rc = mdb_env_set_mapsize (shard->env, config_data->db_size_bytes);
     if (rc != 0) {
         g_log (NULL, G_LOG_LEVEL_ERROR, "Error in mdb_env_set_mapsize: %s", mdb_strerror (rc));
-        g_free (db_data);
-        return NULL;
+        return FALSE;
+    }
+
+    rc = mdb_env_set_maxdbs (shard->env, DB_NAMED_DBS);
+    if (rc != 0) {
+        g_log (NULL, G_LOG_LEVEL_ERROR, "Error in mdb_env_set_maxdbs: %s", mdb_strerror (rc));
+        return FALSE;
     }
 
     unsigned int env_flags = 0;
@@ -52,30 +504,479 @@ init_db (ConfigData *config_data)
     if (config_data->db_nosync)     env_flags |= MDB_NOSYNC;
     if (config_data->db_nometasync) env_flags |= MDB_NOMETASYNC;
 
-    rc = mdb_env_open (db_data->env, config_data->db_path, env_flags, 0644);
+    rc = mdb_env_open (shard->env, shard->path, env_flags, 0644);
     if (rc != 0) {
-        g_log (NULL, G_LOG_LEVEL_ERROR, "Error in mdb_env_open: %s", mdb_strerror (rc));
-        mdb_env_close (db_data->env);
-        g_free (db_data);
-        return NULL;
+        g_log (NULL, G_LOG_LEVEL_ERROR, "Error in mdb_env_open (%s): %s", shard->path, mdb_strerror (rc));
+        return FALSE;
     }
 
+    // An existing database may already be larger than the configured size: LMDB keeps the larger one
+    MDB_envinfo env_info;
+    mdb_env_info (shard->env, &env_info);
+    shard->map_size = env_info.me_mapsize;
+
     MDB_txn *txn;
-    rc = mdb_txn_begin (db_data->env, NULL, 0, &txn);
+    rc = mdb_txn_begin (shard->env, NULL, 0, &txn);
     if (rc != 0) {
         g_log (NULL, G_LOG_LEVEL_ERROR, "Error in mdb_txn_begin: %s", mdb_strerror (rc));
-        g_free (db_data);
-        return NULL;
+        return FALSE;
     }
 
-    rc = mdb_dbi_open (txn, NULL, 0, &db_data->dbi);
+    rc = mdb_dbi_open (txn, NULL, 0, &shard->dbi);
+    if (rc == 0) rc = mdb_dbi_open (txn, DB_HASH_INDEX_NAME, MDB_CREATE | MDB_DUPSORT, &shard->hash_dbi);
+    if (rc == 0) rc = mdb_dbi_open (txn, DB_INODE_INDEX_NAME, MDB_CREATE | MDB_DUPSORT, &shard->inode_dbi);
+    if (rc == 0) rc = mdb_dbi_open (txn, DB_ROLLUP_NAME, MDB_CREATE, &shard->rollup_dbi);
     if (rc != 0) {
         mdb_txn_abort (txn);
         g_log (NULL, G_LOG_LEVEL_ERROR, "Error in mdb_dbi_open: %s", mdb_strerror (rc));
-        g_free (db_data);
+        return FALSE;
+    }
+
+    // Databases written before the indexes existed get them now, once
+    MDB_stat index_stat;
+    gboolean build_hashes = mdb_stat (txn, shard->hash_dbi, &index_stat) == 0 && index_stat.ms_entries == 0;
+    gboolean build_rollups = mdb_stat (txn, shard->rollup_dbi, &index_stat) == 0 && index_stat.ms_entries == 0;
+    rc = mdb_txn_commit (txn);
+    if (rc != 0) {
+        g_log (NULL, G_LOG_LEVEL_ERROR, "Error in mdb_txn_commit: %s", mdb_strerror (rc));
+        return FALSE;
+    }
+
+    return !(build_hashes || build_rollups) || build_indexes (shard, build_hashes, build_rollups);
+}
+
+
+// Lays out the shards for the configured layout. The unsharded environment always lives at db_path itself,
+// shards live in sub-directories of it so that both layouts can coexist (see db_merge_shards).
+static void
+plan_shards (DatabaseData *db_data,
+             ConfigData   *config_data,
+             ShardLayout   layout)
+{
+    db_data->layout = layout;
+
+    if (layout == SHARD_BY_ROOT) {
+        gchar **roots = g_strsplit (config_data->directories, ",", -1);
+        db_data->n_shards = g_strv_length (roots);
+        db_data->shards = g_new0 (DbShard, db_data->n_shards);
+        for (guint i = 0; i < db_data->n_shards; i++) {
+            gchar *name = g_strdup_printf ("root-%016" G_GINT64_MODIFIER "x", (guint64)XXH3_64bits (roots[i], strlen (roots[i])));
+            db_data->shards[i].path = g_build_filename (config_data->db_path, name, NULL);
+            db_data->shards[i].root = g_strdup (roots[i]);
+            g_free (name);
+        }
+        g_strfreev (roots);
+    } else if (layout == SHARD_BY_HASH) {
+        db_data->n_shards = config_data->shard_count;
+        db_data->shards = g_new0 (DbShard, db_data->n_shards);
+        for (guint i = 0; i < db_data->n_shards; i++) {
+            gchar *name = g_strdup_printf ("hash-%u-of-%u", i, db_data->n_shards);
+            db_data->shards[i].path = g_build_filename (config_data->db_path, name, NULL);
+            g_free (name);
+        }
+    } else {
+        db_data->n_shards = 1;
+        db_data->shards = g_new0 (DbShard, 1);
+        db_data->shards[0].path = g_strdup (config_data->db_path);
+    }
+
+    for (guint i = 0; i < db_data->n_shards; i++) {
+        g_rw_lock_init (&db_data->shards[i].resize_lock);
+    }
+}
+
+
+static DatabaseData *
+open_db (ConfigData  *config_data,
+         ShardLayout  layout)
+{
+    if (!config_data || !config_data->db_path) {
+        g_log (NULL, G_LOG_LEVEL_ERROR, "Invalid configuration data");
         return NULL;
     }
-    mdb_txn_commit (txn);
+
+    DatabaseData *db_data = g_try_new0 (DatabaseData, 1);
+    if (!db_data) {
+        g_log (NULL, G_LOG_LEVEL_ERROR, "Failed to allocate memory for DatabaseData");
+        return NULL;
+    }
+
+    plan_shards (db_data, config_data, layout);
+    for (guint i = 0; i < db_data->n_shards; i++) {
+        if (!open_shard (&db_data->shards[i], config_data)) {
+            free_db (db_data);
+            return NULL;
+        }
+    }
 
     return db_data;
-}
\ No newline at end of file
+}
+
+
+DatabaseData *
+init_db (ConfigData *config_data)
+{
+    return open_db (config_data, config_data->shard_layout);
+}
+
+
+DatabaseData *
+db_open_at (ConfigData  *config_data,
+            const gchar *db_path)
+{
+    if (!g_file_test (db_path, G_FILE_TEST_IS_DIR)) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "No database at %s", db_path);
+        return NULL;
+    }
+
+    // Same settings and layout, another place
+    ConfigData source_config = *config_data;
+    source_config.db_path = (gchar *)db_path;
+    return open_db (&source_config, config_data->shard_layout);
+}
+
+
+static gboolean
+path_in_root (const gchar *filepath,
+              const gchar *root)
+{
+    gsize len = strlen (root);
+    if (strncmp (filepath, root, len) != 0) return FALSE;
+    return len > 0 && (root[len - 1] == '/' || filepath[len] == '/' || filepath[len] == '\0');
+}
+
+
+DbShard *
+db_route (DatabaseData *db_data,
+          const gchar  *filepath)
+{
+    if (db_data->layout == SHARD_BY_HASH) {
+        return &db_data->shards[XXH3_64bits (filepath, strlen (filepath)) % db_data->n_shards];
+    }
+
+    if (db_data->layout == SHARD_BY_ROOT) {
+        // Nested roots: the longest matching root wins
+        DbShard *best = NULL;
+        gsize best_len = 0;
+        for (guint i = 0; i < db_data->n_shards; i++) {
+            gsize len = strlen (db_data->shards[i].root);
+            if (len > best_len && path_in_root (filepath, db_data->shards[i].root)) {
+                best = &db_data->shards[i];
+                best_len = len;
+            }
+        }
+        if (best) return best;
+    }
+
+    return &db_data->shards[0];
+}
+
+
+gboolean
+db_is_empty (DatabaseData *db_data)
+{
+    for (guint i = 0; i < db_data->n_shards; i++) {
+        MDB_stat stat;
+        // The main database also holds the entries naming the index databases
+        if (mdb_env_stat (db_data->shards[i].env, &stat) != 0 || stat.ms_entries > DB_NAMED_DBS) return FALSE;
+    }
+    return TRUE;
+}
+
+
+guint64
+db_record_count (DbShard *shard,
+                 MDB_txn *txn)
+{
+    MDB_stat stat;
+    // The main database also holds the entries naming the index databases
+    if (mdb_stat (txn, shard->dbi, &stat) != 0 || stat.ms_entries <= DB_NAMED_DBS) return 0;
+    return stat.ms_entries - DB_NAMED_DBS;
+}
+
+
+// Copies all records of source into target; on MDB_MAP_FULL the target grows and the copy starts over (puts are idempotent)
+static gboolean
+copy_shard (DbShard *source,
+            DbShard *target,
+            guint64 *copied)
+{
+    MDB_txn *read_txn, *write_txn;
+    MDB_cursor *cursor;
+    MDB_val key, data;
+    int rc;
+
+    do {
+        rc = db_txn_begin (source, MDB_RDONLY, &read_txn, NULL);
+        if (rc != 0) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "mdb_txn_begin failed: %s\n", mdb_strerror (rc));
+            return FALSE;
+        }
+        rc = mdb_cursor_open (read_txn, source->dbi, &cursor);
+        if (rc != 0) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "mdb_cursor_open failed: %s\n", mdb_strerror (rc));
+            db_txn_abort (source, read_txn);
+            return FALSE;
+        }
+
+        guint64 map_size = 0;
+        guint64 count = 0;
+        guint batch = 0;
+        write_txn = NULL;
+        for (int found = db_cursor_first (cursor, &key, &data); rc == 0 && found == 0;
+             found = mdb_cursor_get (cursor, &key, &data, MDB_NEXT)) {
+            if (write_txn == NULL) {
+                rc = db_txn_begin (target, 0, &write_txn, &map_size);
+                if (rc != 0) {
+                    write_txn = NULL;
+                    break;
+                }
+            }
+            // Shard records are the most recent ones: they replace whatever the unified database holds
+            rc = db_put_entry (target, write_txn, &key, &data, 0);
+            if (rc != 0) break;
+            count++;
+            if (++batch == MERGE_BATCH_SIZE) {
+                rc = db_txn_commit (target, write_txn);
+                write_txn = NULL;
+                batch = 0;
+            }
+        }
+        if (rc == 0 && write_txn != NULL) {
+            rc = db_txn_commit (target, write_txn);
+            write_txn = NULL;
+        }
+        if (write_txn != NULL) db_txn_abort (target, write_txn);
+        mdb_cursor_close (cursor);
+        db_txn_abort (source, read_txn);
+
+        if (rc == 0) *copied += count;
+        if (rc == MDB_MAP_FULL && !db_grow (target, map_size)) break;
+    } while (rc == MDB_MAP_FULL);
+
+    if (rc != 0) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Merging %s failed: %s\n", source->path, mdb_strerror (rc));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+gboolean
+db_merge_shards (DatabaseData *db_data,
+                 ConfigData   *config_data)
+{
+    if (db_data->layout == SHARD_NONE) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "The database is not sharded, nothing to merge");
+        return FALSE;
+    }
+
+    DatabaseData *unified = open_db (config_data, SHARD_NONE);
+    if (unified == NULL) return FALSE;
+
+    gboolean ok = TRUE;
+    guint64 copied = 0;
+    for (guint i = 0; i < db_data->n_shards && ok; i++) {
+        ok = copy_shard (&db_data->shards[i], &unified->shards[0], &copied);
+    }
+    g_message ("Merged %" G_GUINT64_FORMAT " records from %u shards into %s", copied, db_data->n_shards, unified->shards[0].path);
+
+    free_db (unified);
+    return ok;
+}
+
+
+// LMDB holds a shared lock on the first byte of the lock file for as long as an environment is open, and waits
+// for it while another process holds an exclusive one. Takes that exclusive lock, with the environment of this
+// process closed: FALSE when another process has the environment open. The lock is an OFD lock, owned by *fd
+// (-1 without a lock file): closing it releases the lock without touching other locks of this process.
+static gboolean
+lock_env_exclusive (DbShard *shard,
+                    int     *fd)
+{
+    gchar *lock_path = g_build_filename (shard->path, DB_LOCK_FILE, NULL);
+    *fd = g_open (lock_path, O_RDWR | O_CLOEXEC, 0);
+    g_free (lock_path);
+    if (*fd < 0) return TRUE;
+
+    struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = 0, .l_len = 1, .l_pid = 0 };
+    if (fcntl (*fd, F_OFD_SETLK, &lock) == 0) return TRUE;
+    close (*fd);
+    *fd = -1;
+    return FALSE;
+}
+
+
+static gboolean
+same_file_state (const GStatBuf *a,
+                 const GStatBuf *b)
+{
+    return a->st_size == b->st_size && a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+
+static gboolean
+sync_directory (const gchar *path)
+{
+    int fd = g_open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+    if (fd < 0) return FALSE;
+    gboolean ok = fsync (fd) == 0;
+    close (fd);
+    return ok;
+}
+
+
+static gboolean
+write_compact_copy (DbShard     *shard,
+                    const gchar *copy_path)
+{
+    int fd = g_open (copy_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Failed to create %s: %s", copy_path, g_strerror (errno));
+        return FALSE;
+    }
+
+    g_rw_lock_reader_lock (&shard->resize_lock);
+    int rc = mdb_env_copyfd2 (shard->env, fd, MDB_CP_COMPACT);
+    g_rw_lock_reader_unlock (&shard->resize_lock);
+    if (rc == 0 && fsync (fd) != 0) rc = errno;
+    close (fd);
+    if (rc != 0) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Compacting %s failed: %s", shard->path, mdb_strerror (rc));
+        g_unlink (copy_path);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+// Writes a compacted copy (free pages dropped, pages renumbered) next to the data file, then swaps it in
+// with rename() and reopens the shard: the data file is either the old or the new one at any time.
+// The swap happens with the environment closed and locked against other processes, which would otherwise
+// keep writing to the replaced file; one that wrote since the copy was taken leaves the shard as it is.
+static gboolean
+compact_shard (DbShard    *shard,
+               ConfigData *config_data)
+{
+    gchar *data_path = g_build_filename (shard->path, DB_DATA_FILE, NULL);
+    gchar *copy_path = g_strconcat (data_path, DB_COMPACT_SUFFIX, NULL);
+    GStatBuf before = { 0 }, current = { 0 }, after = { 0 };
+    gboolean ok = g_stat (data_path, &before) == 0 && write_compact_copy (shard, copy_path);
+
+    if (ok) {
+        int lock_fd;
+        close_env (shard);
+        if (!lock_env_exclusive (shard, &lock_fd)) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "%s is open in another process, not compacted", shard->path);
+            ok = FALSE;
+        } else if (g_stat (data_path, &current) != 0 || !same_file_state (&before, &current)) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "%s was written by another process meanwhile, not compacted", shard->path);
+            ok = FALSE;
+        } else if (g_rename (copy_path, data_path) != 0) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "Failed to replace %s: %s", data_path, g_strerror (errno));
+            ok = FALSE;
+        } else {
+            sync_directory (shard->path);
+            g_stat (data_path, &after);
+            g_message ("Compacted %s from %" G_GUINT64_FORMAT " to %" G_GUINT64_FORMAT " bytes",
+                       shard->path, (guint64)before.st_size, (guint64)after.st_size);
+        }
+        if (lock_fd >= 0) close (lock_fd);
+        if (!ok) g_unlink (copy_path);
+        ok = open_shard (shard, config_data) && ok;
+    }
+
+    g_free (copy_path);
+    g_free (data_path);
+    return ok;
+}
+
+
+gboolean
+db_compact (DatabaseData *db_data,
+            ConfigData   *config_data)
+{
+    gboolean ok = TRUE;
+    for (guint i = 0; i < db_data->n_shards; i++) {
+        ok = compact_shard (&db_data->shards[i], config_data) && ok;
+    }
+    return ok;
+}
+
+
+guint64
+db_find_duplicates (DatabaseData    *db_data,
+                    DbDuplicateFunc  func,
+                    gpointer         user_data)
+{
+    guint n = db_data->n_shards;
+    MDB_txn **txns = g_new0 (MDB_txn *, n);
+    MDB_cursor **cursors = g_new0 (MDB_cursor *, n);
+    MDB_val *keys = g_new0 (MDB_val, n);
+    gboolean *active = g_new0 (gboolean, n);
+    MDB_val data;
+
+    // One read transaction per shard for the whole scan: every cursor sees a consistent index
+    for (guint i = 0; i < n; i++) {
+        DbShard *shard = &db_data->shards[i];
+        if (db_txn_begin (shard, MDB_RDONLY, &txns[i], NULL) != 0) {
+            txns[i] = NULL;
+            continue;
+        }
+        if (mdb_cursor_open (txns[i], shard->hash_dbi, &cursors[i]) != 0) {
+            cursors[i] = NULL;
+            continue;
+        }
+        active[i] = mdb_cursor_get (cursors[i], &keys[i], &data, MDB_FIRST) == 0;
+    }
+
+    guint64 groups = 0;
+    GPtrArray *paths = g_ptr_array_new_with_free_func (g_free);
+    while (TRUE) {
+        gint lowest = -1;
+        for (guint i = 0; i < n; i++) {
+            if (active[i] && (lowest < 0 || memcmp (keys[i].mv_data, keys[lowest].mv_data, sizeof(guint64)) < 0)) lowest = (gint)i;
+        }
+        if (lowest < 0) break;
+
+        guint64 hash;
+        memcpy (&hash, keys[lowest].mv_data, sizeof(guint64));
+        goffset size = 0;
+        for (guint i = 0; i < n; i++) {
+            if (!active[i] || memcmp (keys[i].mv_data, &hash, sizeof(guint64)) != 0) continue;
+
+            int rc = mdb_cursor_get (cursors[i], &keys[i], &data, MDB_GET_CURRENT);
+            while (rc == 0) {
+                g_ptr_array_add (paths, g_strndup (data.mv_data, data.mv_size));
+                rc = mdb_cursor_get (cursors[i], &keys[i], &data, MDB_NEXT_DUP);
+            }
+            if (size == 0) {
+                MDB_val key = { .mv_size = strlen (g_ptr_array_index (paths, 0)) + 1, .mv_data = g_ptr_array_index (paths, 0) };
+                FileEntryData entry;
+                if (mdb_get (txns[i], db_data->shards[i].dbi, &key, &data) == 0) {
+                    db_read_entry (&data, &entry);
+                    size = entry.size;
+                }
+            }
+            active[i] = mdb_cursor_get (cursors[i], &keys[i], &data, MDB_NEXT_NODUP) == 0;
+        }
+
+        if (paths->len > 1) {
+            func (hash, size, paths, user_data);
+            groups++;
+        }
+        g_ptr_array_set_size (paths, 0);
+    }
+    g_ptr_array_free (paths, TRUE);
+
+    for (guint i = 0; i < n; i++) {
+        if (cursors[i]) mdb_cursor_close (cursors[i]);
+        if (txns[i]) db_txn_abort (&db_data->shards[i], txns[i]);
+    }
+    g_free (active);
+    g_free (keys);
+    g_free (cursors);
+    g_free (txns);
+
+    return groups;
+}
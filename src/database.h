@@ -1,10 +1,167 @@
 #pragma once
 
-typedef struct database_t {
+#include <sys/types.h>
+#include <glib.h>
+#include "config.h"
+
+typedef struct db_shard_t {
     MDB_env *env;
-    MDB_dbi dbi;
+    MDB_dbi dbi;        // file records, keyed by path
+    MDB_dbi hash_dbi;   // content hash -> paths (MDB_DUPSORT)
+    MDB_dbi inode_dbi;  // db_inode_key() -> paths (MDB_DUPSORT)
+    MDB_dbi rollup_dbi; // directory path -> DbRollup of the records below it
+    gchar *path;        // environment directory
+    gchar *root;        // scanned root routed to this shard (SHARD_BY_ROOT only)
+    guint64 map_size;
+    GRWLock resize_lock;    // held shared by every transaction, exclusively while the map is resized
+    gsize expected_records; // atomic: records stored when the running passes began plus the files they routed here
+} DbShard;
+
+typedef struct database_t {
+    DbShard *shards;    // a single shard at db_path when the layout is not sharded
+    guint n_shards;
+    ShardLayout layout;
 } DatabaseData;
 
-DatabaseData *init_db (ConfigData   *config_data);
+// How FileEntryData.hash was computed
+typedef enum hash_format_t {
+    HASH_FORMAT_PLAIN = 0,  // XXH3 of the content
+    HASH_FORMAT_SPARSE      // XXH3 of the all-zero 4 KiB block runs and of the remaining data: holes are never read
+} HashFormat;
+
+// On-disk record stored for every file (key is the NUL-terminated file path).
+// New fields are only ever appended: records written by older versions are shorter and the missing fields read back as zero.
+typedef struct file_entry_t {
+    gchar *filepath;        // unused, kept for on-disk layout compatibility
+    guint64 hash;
+    ino_t inode;
+    nlink_t link_count;
+    blkcnt_t block_count;
+    gint64 last_verified;   // unix time (seconds) of the last full-content hash of this file
+    goffset size;
+    guint64 sample_hash;    // fingerprint of the size and a few sampled blocks, 0 when none was stored
+    guint32 hash_format;    // HashFormat of hash
+    guint64 device;         // st_dev of the file, 0 in records written before it was stored
+} FileEntryData;
+
+// Rollup of a directory: the records below it at any depth, combined so that one record can be added or
+// removed without reading the others. Shards of the same database add up.
+typedef struct db_rollup_t {
+    guint64 sum;        // sum (mod 2^64) of db_rollup_leaf() over the records
+    guint64 files;      // number of records
+} DbRollup;
+
+// Secondary indexes kept by db_put_entry() and db_del_entry()
+typedef enum db_index_t {
+    DB_INDEX_HASH,
+    DB_INDEX_INODE
+} DbIndex;
+
+DatabaseData *init_db   (ConfigData    *config_data);
+
+// Opens the databases written with the same configuration at another db_path (e.g. by a --shard run)
+DatabaseData *db_open_at (ConfigData   *config_data,
+                          const gchar  *db_path);
+
+void free_db            (DatabaseData  *db_data);
+
+DbShard *db_route       (DatabaseData  *db_data,
+                         const gchar   *filepath);
+
+// TRUE when no shard holds any record yet (a first add can then be bulk-loaded)
+gboolean db_is_empty    (DatabaseData  *db_data);
+
+// Records of shard->dbi as seen by txn; 0 when it cannot be read
+guint64 db_record_count (DbShard       *shard,
+                         MDB_txn       *txn);
+
+gboolean db_merge_shards (DatabaseData *db_data,
+                          ConfigData   *config_data);
+
+// Rewrites every shard without its free pages, so that the data files shrink to the live records.
+// Nothing else may use the database meanwhile: shards open in another process are skipped.
+gboolean db_compact      (DatabaseData *db_data,
+                          ConfigData   *config_data);
+
+typedef void (*DbDuplicateFunc) (guint64          hash,
+                                 goffset          size,
+                                 const GPtrArray *paths,
+                                 gpointer         user_data);
+
+// Merges the hash indexes of all shards in key order and calls func for every hash stored with two or more paths
+guint64 db_find_duplicates (DatabaseData    *db_data,
+                            DbDuplicateFunc  func,
+                            gpointer         user_data);
+
+void db_read_entry      (const MDB_val *data,
+                         FileEntryData *entry);
+
+// Same order as LMDB's default key comparison: memcmp on the common length, then the shorter key first.
+// For code that orders keys outside the database (merges, sorted runs, dump checks).
+gint db_compare_keys    (const MDB_val *a,
+                         const MDB_val *b);
+
+// Every record write goes through these, which keep the hash and inode indexes of the shard in step with the records.
+// flags are passed to mdb_put(): with MDB_APPEND the key is known to be new. db_del_entry() returns MDB_NOTFOUND
+// when there is no record. db_put_entry() refuses (EINVAL) any key other than a NUL-terminated absolute path:
+// walks start at "/" (db_cursor_first()), so such a record would never be seen again.
+int  db_put_entry       (DbShard       *shard,
+                         MDB_txn       *txn,
+                         MDB_val       *key,
+                         MDB_val       *data,
+                         unsigned int   flags);
+
+int  db_del_entry       (DbShard       *shard,
+                         MDB_txn       *txn,
+                         MDB_val       *key);
+
+// Positions the cursor on the first record of shard->dbi. Walks must start here rather than at MDB_FIRST:
+// the entries naming the index databases sort before every absolute path.
+int  db_cursor_first    (MDB_cursor    *cursor,
+                         MDB_val       *key,
+                         MDB_val       *data);
+
+// Digest of a record in the rollups: the path, the content hash and the size. Host-specific fields
+// (inode, links, blocks, time of the last verification) are left out, so that replicas compare equal.
+guint64 db_rollup_leaf  (const gchar         *path,
+                         const FileEntryData *entry);
+
+// Sum of the rollups of dir_path in every shard (dir_path without trailing '/', except for "/")
+DbRollup db_get_rollup  (DatabaseData  *db_data,
+                         MDB_txn      **txns,
+                         const gchar   *dir_path);
+
+// Value of a file in the inode index: inode numbers repeat across filesystems, so the device is part of it.
+// 0 (not indexed) when the inode is unknown.
+guint64 db_inode_key    (guint64        device,
+                         guint64        inode);
+
+// Appends the paths stored with the value (content hash or db_inode_key()) in the index, as NUL terminated strings
+void db_find_paths      (DbShard       *shard,
+                         MDB_txn       *txn,
+                         DbIndex        index,
+                         guint64        value,
+                         GPtrArray     *paths);
+
+// Transactions must be started and finished through these wrappers so that the map can be grown safely.
+// db_txn_begin() optionally returns the map size the transaction runs with, to be passed to db_grow() on MDB_MAP_FULL.
+int  db_txn_begin       (DbShard       *shard,
+                         unsigned int   flags,
+                         MDB_txn      **txn,
+                         guint64       *map_size);
+
+int  db_txn_commit      (DbShard       *shard,
+                         MDB_txn       *txn);
+
+void db_txn_abort       (DbShard       *shard,
+                         MDB_txn       *txn);
+
+gboolean db_grow        (DbShard       *shard,
+                         guint64        observed_map_size);
+
+// Starts the estimate of a writing pass over from the records stored now
+void db_expect_begin    (DatabaseData  *db_data);
 
-void free_db          (DatabaseData *db_data);
\ No newline at end of file
+// count more files will be written by the running passes; grows the map ahead of them
+void db_expect_records  (DbShard       *shard,
+                         guint64        count);
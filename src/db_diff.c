@@ -0,0 +1,201 @@
+#include <glib.h>
+#include <lmdb.h>
+#include <string.h>
+#include "db_diff.h"
+
+typedef struct diff_side_t {
+    DatabaseData *db_data;
+    MDB_txn **txns;             // one read transaction per shard, for a consistent view
+    MDB_cursor **cursors;       // on the records of every shard
+} DiffSide;
+
+typedef struct diff_context_t {
+    DiffSide sides[2];
+    DbDiffFunc func;
+    gpointer user_data;
+    gint64 differences;
+} DiffContext;
+
+
+static void
+side_close (DiffSide *side)
+{
+    for (guint i = 0; side->txns && i < side->db_data->n_shards; i++) {
+        if (side->cursors[i]) mdb_cursor_close (side->cursors[i]);
+        if (side->txns[i]) db_txn_abort (&side->db_data->shards[i], side->txns[i]);
+    }
+    g_free (side->cursors);
+    g_free (side->txns);
+}
+
+
+static gboolean
+side_open (DiffSide     *side,
+           DatabaseData *db_data)
+{
+    side->db_data = db_data;
+    side->txns = g_new0 (MDB_txn *, db_data->n_shards);
+    side->cursors = g_new0 (MDB_cursor *, db_data->n_shards);
+
+    for (guint i = 0; i < db_data->n_shards; i++) {
+        DbShard *shard = &db_data->shards[i];
+        int rc = db_txn_begin (shard, MDB_RDONLY, &side->txns[i], NULL);
+        if (rc != 0) {
+            side->txns[i] = NULL;
+        } else {
+            rc = mdb_cursor_open (side->txns[i], shard->dbi, &side->cursors[i]);
+        }
+        if (rc != 0) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "Failed to read %s: %s", shard->path, mdb_strerror (rc));
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+
+// Collects the direct children of the directory prefix (ending with '/'): files with their rollup leaf,
+// and subdirectories, whose records are skipped with a single seek each
+static void
+list_children (DiffSide    *side,
+               const gchar *prefix,
+               GHashTable  *files,
+               GHashTable  *dirs)
+{
+    gsize prefix_len = strlen (prefix);
+    GString *seek = g_string_new (prefix);
+
+    for (guint i = 0; i < side->db_data->n_shards; i++) {
+        MDB_val key = { .mv_size = prefix_len, .mv_data = (void *)prefix }, data;
+        int rc = mdb_cursor_get (side->cursors[i], &key, &data, MDB_SET_RANGE);
+        while (rc == 0 && key.mv_size > prefix_len + 1 && memcmp (key.mv_data, prefix, prefix_len) == 0) {
+            const gchar *name = (const gchar *)key.mv_data + prefix_len;
+            const gchar *slash = memchr (name, '/', key.mv_size - prefix_len - 1);
+            if (slash) {
+                gsize name_len = (gsize)(slash - name);
+                g_hash_table_add (dirs, g_strndup (name, name_len));
+                // "prefix/name0" sorts right after every "prefix/name/..." key
+                g_string_truncate (seek, prefix_len);
+                g_string_append_len (seek, name, (gssize)name_len);
+                g_string_append_c (seek, '/' + 1);
+                key.mv_size = seek->len;
+                key.mv_data = seek->str;
+                rc = mdb_cursor_get (side->cursors[i], &key, &data, MDB_SET_RANGE);
+            } else {
+                FileEntryData entry;
+                db_read_entry (&data, &entry);
+                guint64 *leaf = g_new (guint64, 1);
+                *leaf = db_rollup_leaf (key.mv_data, &entry);
+                g_hash_table_insert (files, g_strdup (name), leaf);
+                rc = mdb_cursor_get (side->cursors[i], &key, &data, MDB_NEXT);
+            }
+        }
+    }
+    g_string_free (seek, TRUE);
+}
+
+
+static gint
+compare_names (gconstpointer a,
+               gconstpointer b)
+{
+    return strcmp (*(const gchar * const *)a, *(const gchar * const *)b);
+}
+
+
+// Names found on either side, sorted; the strings belong to the tables
+static GPtrArray *
+sorted_union (GHashTable *a,
+              GHashTable *b)
+{
+    GPtrArray *names = g_ptr_array_new ();
+    GHashTableIter iter;
+    gpointer name;
+
+    g_hash_table_iter_init (&iter, a);
+    while (g_hash_table_iter_next (&iter, &name, NULL)) g_ptr_array_add (names, name);
+    g_hash_table_iter_init (&iter, b);
+    while (g_hash_table_iter_next (&iter, &name, NULL)) {
+        if (!g_hash_table_contains (a, name)) g_ptr_array_add (names, name);
+    }
+    g_ptr_array_sort (names, compare_names);
+    return names;
+}
+
+
+static void
+report (DiffContext *ctx,
+        const gchar *prefix,
+        const gchar *name,
+        DbDiffKind   kind)
+{
+    gchar *path = g_strconcat (prefix, name, NULL);
+    ctx->func (path, kind, ctx->user_data);
+    ctx->differences++;
+    g_free (path);
+}
+
+
+static void
+diff_dir (DiffContext *ctx,
+          const gchar *dir)
+{
+    DbRollup here = db_get_rollup (ctx->sides[0].db_data, ctx->sides[0].txns, dir);
+    DbRollup other = db_get_rollup (ctx->sides[1].db_data, ctx->sides[1].txns, dir);
+    if (here.sum == other.sum && here.files == other.files) return;
+
+    gchar *prefix = g_str_has_suffix (dir, "/") ? g_strdup (dir) : g_strconcat (dir, "/", NULL);
+    GHashTable *files[2], *dirs[2];
+    for (guint s = 0; s < 2; s++) {
+        files[s] = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+        dirs[s] = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        list_children (&ctx->sides[s], prefix, files[s], dirs[s]);
+    }
+
+    GPtrArray *names = sorted_union (files[0], files[1]);
+    for (guint i = 0; i < names->len; i++) {
+        const gchar *name = g_ptr_array_index (names, i);
+        const guint64 *leaf_here = g_hash_table_lookup (files[0], name);
+        const guint64 *leaf_other = g_hash_table_lookup (files[1], name);
+        if (leaf_other == NULL) {
+            report (ctx, prefix, name, DB_DIFF_ONLY_HERE);
+        } else if (leaf_here == NULL) {
+            report (ctx, prefix, name, DB_DIFF_ONLY_OTHER);
+        } else if (*leaf_here != *leaf_other) {
+            report (ctx, prefix, name, DB_DIFF_CHANGED);
+        }
+    }
+    g_ptr_array_free (names, TRUE);
+
+    names = sorted_union (dirs[0], dirs[1]);
+    for (guint i = 0; i < names->len; i++) {
+        gchar *child = g_strconcat (prefix, g_ptr_array_index (names, i), NULL);
+        diff_dir (ctx, child);
+        g_free (child);
+    }
+    g_ptr_array_free (names, TRUE);
+
+    for (guint s = 0; s < 2; s++) {
+        g_hash_table_destroy (files[s]);
+        g_hash_table_destroy (dirs[s]);
+    }
+    g_free (prefix);
+}
+
+
+gint64
+db_diff (DatabaseData *here,
+         DatabaseData *other,
+         DbDiffFunc    func,
+         gpointer      user_data)
+{
+    DiffContext ctx = { .func = func, .user_data = user_data };
+
+    gboolean ok = side_open (&ctx.sides[0], here) && side_open (&ctx.sides[1], other);
+    // Every record is below "/", whose rollup covers the whole database
+    if (ok) diff_dir (&ctx, "/");
+    side_close (&ctx.sides[0]);
+    side_close (&ctx.sides[1]);
+
+    return ok ? ctx.differences : -1;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <glib.h>
+#include "database.h"
+
+typedef enum db_diff_kind_t {
+    DB_DIFF_ONLY_HERE = 0,  // the record is only in the first database
+    DB_DIFF_ONLY_OTHER,     // the record is only in the second database
+    DB_DIFF_CHANGED         // both hold the path with a different content hash or size
+} DbDiffKind;
+
+typedef void (*DbDiffFunc) (const gchar *path,
+                            DbDiffKind   kind,
+                            gpointer     user_data);
+
+// Compares two databases top-down through their directory rollups, descending only into the directories
+// whose rollups differ: identical databases cost one rollup lookup per shard. The layouts may differ.
+// Calls func for every differing record in path order within each directory and returns their number,
+// or -1 when a database cannot be read.
+gint64 db_diff (DatabaseData *here,
+                DatabaseData *other,
+                DbDiffFunc    func,
+                gpointer      user_data);
@@ -0,0 +1,279 @@
+#include <glib.h>
+#include <lmdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <xxhash.h>
+#include "dump.h"
+#include "record_stream.h"
+
+#define DUMP_MAGIC             "FFCDUMP"
+#define DUMP_MAGIC_SIZE        8                   // including the NUL
+#define DUMP_VERSION           2                   // 2: the device follows the hash format
+#define DUMP_BLOCK_HEADER_SIZE 8                   // record count and payload size
+#define DUMP_BLOCK_SIZE        (1024 * 1024)       // payload written per block
+#define DUMP_MAX_BLOCK_SIZE    (64 * 1024 * 1024)  // larger payload sizes are rejected as corrupt
+#define DUMP_RECORD_FIELDS     (8 * 8 + 4)         // fixed-size fields after the path
+
+
+static void
+put_u32 (GByteArray *buffer,
+         guint32     value)
+{
+    value = GUINT32_TO_LE (value);
+    g_byte_array_append (buffer, (const guint8 *)&value, sizeof(value));
+}
+
+
+static void
+put_u64 (GByteArray *buffer,
+         guint64     value)
+{
+    value = GUINT64_TO_LE (value);
+    g_byte_array_append (buffer, (const guint8 *)&value, sizeof(value));
+}
+
+
+static guint32
+get_u32 (const guint8 *data)
+{
+    guint32 value;
+    memcpy (&value, data, sizeof(value));
+    return GUINT32_FROM_LE (value);
+}
+
+
+static guint64
+get_u64 (const guint8 *data)
+{
+    guint64 value;
+    memcpy (&value, data, sizeof(value));
+    return GUINT64_FROM_LE (value);
+}
+
+
+// block starts with room for its header, which is filled in here; the block is emptied afterwards
+static gboolean
+write_block (FILE       *out,
+             GByteArray *block,
+             guint32     n_records)
+{
+    guint32 header[2] = { GUINT32_TO_LE (n_records), GUINT32_TO_LE (block->len - DUMP_BLOCK_HEADER_SIZE) };
+    memcpy (block->data, header, sizeof(header));
+    guint64 checksum = GUINT64_TO_LE (XXH3_64bits (block->data, block->len));
+
+    gboolean ok = fwrite (block->data, block->len, 1, out) == 1 && fwrite (&checksum, sizeof(checksum), 1, out) == 1;
+    g_byte_array_set_size (block, DUMP_BLOCK_HEADER_SIZE);
+    return ok;
+}
+
+
+static void
+encode_record (GByteArray          *block,
+               const MDB_val       *key,
+               const FileEntryData *entry)
+{
+    // Keys are stored with their NUL
+    put_u32 (block, (guint32)(key->mv_size - 1));
+    g_byte_array_append (block, key->mv_data, (guint)(key->mv_size - 1));
+    put_u64 (block, entry->hash);
+    put_u64 (block, (guint64)entry->inode);
+    put_u64 (block, (guint64)entry->link_count);
+    put_u64 (block, (guint64)entry->block_count);
+    put_u64 (block, (guint64)entry->last_verified);
+    put_u64 (block, (guint64)entry->size);
+    put_u64 (block, entry->sample_hash);
+    put_u32 (block, entry->hash_format);
+    put_u64 (block, entry->device);
+}
+
+
+gint64
+dump_export (DatabaseData *db_data,
+             FILE         *out)
+{
+    // One read transaction per shard: the dump is a consistent snapshot of every shard
+    RecordMerger *merger = record_merger_new (&db_data, 1);
+    if (merger == NULL) return -1;
+
+    gchar magic[DUMP_MAGIC_SIZE] = DUMP_MAGIC;
+    guint32 version = GUINT32_TO_LE (DUMP_VERSION);
+    gboolean ok = fwrite (magic, sizeof(magic), 1, out) == 1 && fwrite (&version, sizeof(version), 1, out) == 1;
+
+    GByteArray *block = g_byte_array_sized_new (DUMP_BLOCK_SIZE + DUMP_BLOCK_HEADER_SIZE + 1024);
+    g_byte_array_set_size (block, DUMP_BLOCK_HEADER_SIZE);
+    guint32 block_records = 0;
+    guint64 exported = 0;
+    MDB_val key;
+    FileEntryData entry;
+    while (ok && record_merger_next (merger, &key, &entry)) {
+        encode_record (block, &key, &entry);
+        block_records++;
+        exported++;
+        if (block->len >= DUMP_BLOCK_SIZE + DUMP_BLOCK_HEADER_SIZE) {
+            ok = write_block (out, block, block_records);
+            block_records = 0;
+        }
+    }
+
+    if (ok && block_records > 0) ok = write_block (out, block, block_records);
+    if (ok) {
+        put_u64 (block, exported);
+        ok = write_block (out, block, 0);
+    }
+    ok = ok && fflush (out) == 0;
+    g_byte_array_free (block, TRUE);
+    record_merger_free (merger);
+
+    if (!ok) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Export failed after %" G_GUINT64_FORMAT " records", exported);
+        return -1;
+    }
+    g_message ("Exported %" G_GUINT64_FORMAT " records from %u databases", exported, db_data->n_shards);
+    return (gint64)exported;
+}
+
+
+// Decodes the records of a verified block; fails on anything that could not have been written by dump_export()
+static gboolean
+decode_block (const guint8 *payload,
+              gsize         size,
+              guint32       n_records,
+              GByteArray   *last_key,
+              GPtrArray    *items)
+{
+    gsize pos = 0;
+    for (guint32 r = 0; r < n_records; r++) {
+        if (size - pos < sizeof(guint32)) return FALSE;
+        guint32 path_len = get_u32 (payload + pos);
+        pos += sizeof(guint32);
+        if (path_len == 0 || size - pos < (gsize)path_len + DUMP_RECORD_FIELDS) return FALSE;
+
+        const guint8 *path = payload + pos;
+        if (path[0] != '/' || memchr (path, '\0', path_len) != NULL) return FALSE;
+
+        RecordItem *item = g_malloc0 (sizeof(RecordItem) + path_len + 1);
+        item->key_len = path_len + 1;
+        memcpy (item->key, path, path_len);
+        pos += path_len;
+
+        // Strictly ascending keys, or MDB_APPEND would fail half way
+        MDB_val key = { .mv_size = item->key_len, .mv_data = item->key };
+        MDB_val previous = { .mv_size = last_key->len, .mv_data = last_key->data };
+        if (last_key->len > 0 && db_compare_keys (&previous, &key) >= 0) {
+            g_free (item);
+            return FALSE;
+        }
+        g_byte_array_set_size (last_key, 0);
+        g_byte_array_append (last_key, (const guint8 *)item->key, (guint)item->key_len);
+
+        item->entry.hash = get_u64 (payload + pos);
+        item->entry.inode = (ino_t)get_u64 (payload + pos + 8);
+        item->entry.link_count = (nlink_t)get_u64 (payload + pos + 16);
+        item->entry.block_count = (blkcnt_t)get_u64 (payload + pos + 24);
+        item->entry.last_verified = (gint64)get_u64 (payload + pos + 32);
+        item->entry.size = (goffset)get_u64 (payload + pos + 40);
+        item->entry.sample_hash = get_u64 (payload + pos + 48);
+        item->entry.hash_format = get_u32 (payload + pos + 56);
+        item->entry.device = get_u64 (payload + pos + 60);
+        pos += DUMP_RECORD_FIELDS;
+
+        g_ptr_array_add (items, item);
+    }
+    return pos == size;
+}
+
+
+gint64
+dump_import (DatabaseData *db_data,
+             FILE         *in)
+{
+    gchar magic[DUMP_MAGIC_SIZE];
+    guint32 version;
+    if (fread (magic, sizeof(magic), 1, in) != 1 || memcmp (magic, DUMP_MAGIC, sizeof(magic)) != 0 ||
+        fread (&version, sizeof(version), 1, in) != 1) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Not a FastFileCheck dump");
+        return -1;
+    }
+    if (GUINT32_FROM_LE (version) != DUMP_VERSION) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Unsupported dump version %u", GUINT32_FROM_LE (version));
+        return -1;
+    }
+    if (!db_is_empty (db_data)) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "A dump can only be imported into empty databases");
+        return -1;
+    }
+
+    RecordWriter *writer = record_writer_new (db_data);
+    GPtrArray *items = g_ptr_array_new_with_free_func (g_free);
+    GByteArray *block = g_byte_array_new ();
+    GByteArray *last_key = g_byte_array_new ();
+    guint64 decoded = 0, blocks = 0;
+    gboolean ok = TRUE, complete = FALSE;
+
+    while (ok && !complete) {
+        g_byte_array_set_size (block, DUMP_BLOCK_HEADER_SIZE);
+        if (fread (block->data, DUMP_BLOCK_HEADER_SIZE, 1, in) != 1) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "Truncated dump: end marker missing");
+            ok = FALSE;
+            break;
+        }
+        guint32 n_records = get_u32 (block->data);
+        guint32 size = get_u32 (block->data + 4);
+        guint64 checksum;
+        if (size > DUMP_MAX_BLOCK_SIZE) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "Corrupt dump: block %" G_GUINT64_FORMAT " has a size of %u bytes", blocks, size);
+            ok = FALSE;
+            break;
+        }
+        g_byte_array_set_size (block, DUMP_BLOCK_HEADER_SIZE + size);
+        if ((size > 0 && fread (block->data + DUMP_BLOCK_HEADER_SIZE, size, 1, in) != 1) ||
+            fread (&checksum, sizeof(checksum), 1, in) != 1) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "Truncated dump in block %" G_GUINT64_FORMAT, blocks);
+            ok = FALSE;
+            break;
+        }
+        if (GUINT64_FROM_LE (checksum) != XXH3_64bits (block->data, block->len)) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "Corrupt dump: checksum mismatch in block %" G_GUINT64_FORMAT, blocks);
+            ok = FALSE;
+            break;
+        }
+
+        const guint8 *payload = block->data + DUMP_BLOCK_HEADER_SIZE;
+        if (n_records == 0) {
+            // End marker: the total guards against lost blocks
+            complete = TRUE;
+            if (size != sizeof(guint64) || get_u64 (payload) != decoded) {
+                g_log (NULL, G_LOG_LEVEL_WARNING, "Corrupt dump: record count mismatch");
+                ok = FALSE;
+            }
+            break;
+        }
+        if (!decode_block (payload, size, n_records, last_key, items)) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "Corrupt dump: malformed block %" G_GUINT64_FORMAT, blocks);
+            ok = FALSE;
+            break;
+        }
+        decoded += items->len;
+        blocks++;
+
+        for (guint i = 0; i < items->len && ok; i++) {
+            ok = record_writer_take (writer, g_ptr_array_index (items, i));
+            items->pdata[i] = NULL;
+        }
+        g_ptr_array_set_size (items, 0);
+    }
+
+    ok = ok && record_writer_finish (writer);
+    guint64 imported = record_writer_written (writer);
+    record_writer_free (writer);
+    g_ptr_array_free (items, TRUE);
+    g_byte_array_free (block, TRUE);
+    g_byte_array_free (last_key, TRUE);
+
+    if (!ok) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Import stopped: %" G_GUINT64_FORMAT " records of the dump were written", imported);
+        return -1;
+    }
+    g_message ("Imported %" G_GUINT64_FORMAT " records into %u databases", imported, db_data->n_shards);
+    return (gint64)imported;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdio.h>
+#include <glib.h>
+#include "database.h"
+
+// Portable database dump: the records of all shards in ascending key order, with every field written
+// as a fixed-size little-endian integer, so that a dump can be moved between hosts and shard layouts.
+//
+//   header:  "FFCDUMP" '\0', u32 version
+//   blocks:  u32 record count, u32 payload size, payload, u64 XXH3 of the count, size and payload
+//   record:  u32 path length, path (no NUL), u64 hash, u64 inode, u64 link count, u64 block count,
+//            u64 last verified, u64 size, u64 sample hash, u32 hash format, u64 device
+//   end:     a block with no records whose payload is the u64 total record count
+//
+// Inode and device are exported as stored, so that the inode index of an import matches the files of the same host.
+// On another host they simply differ from the files: the first update stores the local ones.
+//
+// Returns the number of records written, or -1 on error
+gint64 dump_export (DatabaseData *db_data,
+                    FILE         *out);
+
+// Loads a dump into empty databases with MDB_APPEND (records are routed to the shards of the configured
+// layout). Every block is checked before any of its records is written. Returns the number of records
+// written, or -1 on error: the databases may then hold part of the dump.
+gint64 dump_import (DatabaseData *db_data,
+                    FILE         *in);
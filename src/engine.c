@@ -0,0 +1,813 @@
+#include <glib.h>
+#include "ffc.h"
+#include "calibration.h"
+#include "database.h"
+#include "dump.h"
+#include "io_watchdog.h"
+#include "memory_budget.h"
+#include "process_directories.h"
+#include "process_file.h"
+#include "queue.h"
+#include "record_stream.h"
+#include "report.h"
+#include "summary.h"
+#include "verification.h"
+
+G_STATIC_ASSERT (FFC_RESULT_SKIPPED == PROCESS_FILE_SKIPPED);
+G_STATIC_ASSERT (FFC_RESULT_FAILED == PROCESS_FILE_FAILED);
+
+struct ffc_context_t {
+    ConfigData *config_data;
+    DatabaseData *db_data;
+    GThreadPool *thread_pool;   // exclusive pool: the workers stay alive between runs and batches
+    MemoryBudget *memory_budget;    // shared by all runs, like the workers that reserve from it
+    Calibration *calibration;       // NULL unless calibrate_hashing is set
+    IoWatchdog *io_watchdog;        // NULL when read_timeout is 0
+};
+
+typedef struct ffc_job_t {
+    ConsumerData *consumer_data;
+    gchar *path;
+    gboolean prefetched;    // handed to the prefetcher as well, which must hear when the job is done
+} FfcJob;
+
+typedef void (*FeedFunc) (ConsumerData *consumer_data,
+                          gpointer      feed_data);
+
+#define TUNER_WINDOW_US         (2 * G_USEC_PER_SEC)
+#define TUNER_MIN_GAIN          0.05            // a probe must beat the current setting by 5% to be kept
+#define TUNER_BYTES_PER_FILE    (64 * 1024)     // per-file cost (open, stat, database) in the throughput score
+
+typedef struct thread_tuner_t {
+    ConsumerData *consumer_data;
+    gboolean stop;          // protected by lock
+    GMutex lock;
+    GCond cond;
+} ThreadTuner;
+
+static gint tuner_running = 0;  // atomic: concurrent runs (e.g. served tree requests) share the pool and one tuner
+G_LOCK_DEFINE_STATIC (pool_threads);    // changes of the pool size that depend on the current one
+
+
+// Sets the number of threads doing work: the workers blocked in files given up by the watchdog come on top
+static void
+set_pool_threads (ConsumerData *consumer_data,
+                  guint         n_threads)
+{
+    G_LOCK (pool_threads);
+    g_thread_pool_set_max_threads (consumer_data->thread_pool, (gint)(n_threads + io_watchdog_stuck (consumer_data->io_watchdog)), NULL);
+    G_UNLOCK (pool_threads);
+}
+
+
+static void
+lend_pool_thread (GThreadPool *pool,
+                  gint         delta)
+{
+    G_LOCK (pool_threads);
+    g_thread_pool_set_max_threads (pool, g_thread_pool_get_max_threads (pool) + delta, NULL);
+    G_UNLOCK (pool_threads);
+}
+
+
+// Everything a run waits for once a file is done, by its worker or by the watchdog
+static void
+finish_job (FfcJob *job,
+            guint   result)
+{
+    ConsumerData *consumer_data = job->consumer_data;
+
+    g_atomic_int_inc (&consumer_data->files_done);
+    if (job->prefetched) prefetcher_done (consumer_data->prefetcher);
+    consumer_data_notify (consumer_data, job->path, result);
+
+    // Decrement under the lock: the waiter may free consumer_data as soon as it sees zero
+    g_mutex_lock (&consumer_data->pending_lock);
+    if (g_atomic_int_dec_and_test (&consumer_data->pending)) {
+        g_cond_broadcast (&consumer_data->pending_cond);
+    }
+    g_mutex_unlock (&consumer_data->pending_lock);
+}
+
+
+// Called by the watchdog while the worker of the job is blocked reading it: the run doesn't wait for that worker,
+// and the pool gets a thread in its place until it returns
+static void
+abandon_job (const gchar *path,
+             gpointer     data,
+             gpointer     user_data)
+{
+    FfcJob *job = (FfcJob *)data;
+    FfcContext *ctx = (FfcContext *)user_data;
+
+    g_log (NULL, G_LOG_LEVEL_WARNING, "No read progress for %" G_GUINT64_FORMAT " seconds, giving up on %s",
+           ctx->config_data->read_timeout_us / G_USEC_PER_SEC, path);
+    record_change (job->consumer_data->summary_data, path, CHANGE_TIMEOUT);
+    lend_pool_thread (ctx->thread_pool, 1);
+    finish_job (job, CHANGE_BIT(CHANGE_TIMEOUT));
+}
+
+
+static void
+worker_thread (gpointer data,
+               gpointer user_data)
+{
+    FfcJob *job = (FfcJob *)data;
+    FfcContext *ctx = (FfcContext *)user_data;
+
+    io_watch_file_begin (ctx->io_watchdog, job->path, job);
+    guint result = process_file (job->path, job->consumer_data);
+    if (io_watch_file_end ()) {
+        finish_job (job, result);
+    } else {
+        // Given up while this thread was blocked: the watchdog finished the job, the lent thread goes back
+        lend_pool_thread (ctx->thread_pool, -1);
+    }
+    g_free (job->path);
+    g_free (job);
+}
+
+
+static void
+submit_job (ConsumerData *consumer_data,
+            gchar        *path)
+{
+    FfcJob *job = g_new0 (FfcJob, 1);
+    job->consumer_data = consumer_data;
+    job->path = path;
+    // Metadata-only passes don't read the files: nothing to prefetch
+    if (consumer_data->prefetcher && (consumer_data->mode != MODE_CHECK || (consumer_data->check_scope & CHECK_CONTENT))) {
+        prefetcher_push (consumer_data->prefetcher, path);
+        job->prefetched = TRUE;
+    }
+    g_atomic_int_inc (&consumer_data->pending);
+    g_thread_pool_push (consumer_data->thread_pool, job, NULL);
+}
+
+
+static void
+wait_for_jobs (ConsumerData *consumer_data)
+{
+    g_mutex_lock (&consumer_data->pending_lock);
+    while (g_atomic_int_get (&consumer_data->pending) > 0) {
+        g_cond_wait (&consumer_data->pending_cond, &consumer_data->pending_lock);
+    }
+    g_mutex_unlock (&consumer_data->pending_lock);
+}
+
+
+static void
+dispatch_file (ConsumerData *consumer_data,
+               gchar        *file_path)
+{
+    if (consumer_data->mode != MODE_CHECK) {
+        // Grow the database map ahead of the writers, based on the number of files seen so far
+        db_expect_records (db_route (consumer_data->db_data, file_path), 1);
+    }
+    submit_job (consumer_data, file_path);
+}
+
+
+static gpointer
+queue_consumer(gpointer data)
+{
+    ConsumerData *consumer_data = (ConsumerData *)data;
+    while (TRUE) {
+        gchar *file_path = g_async_queue_try_pop (consumer_data->file_queue_data->queue);
+        if (file_path == NULL) {
+            if (consumer_data->file_queue_data->scanning_done) {
+                // Drain any remaining items
+                while ((file_path = g_async_queue_try_pop (consumer_data->file_queue_data->queue)) != NULL) {
+                    dispatch_file (consumer_data, file_path);
+                }
+                break;
+            }
+            g_usleep (1000);
+        }
+        if (file_path != NULL) dispatch_file (consumer_data, file_path);
+    }
+    return NULL;
+}
+
+
+static gpointer
+progress_reporter (gpointer data)
+{
+    ConsumerData *consumer_data = (ConsumerData *)data;
+    // Periodically report progress until work is done
+    while (TRUE) {
+        g_usleep (2 * 1000 * 1000);
+        guint qlen = (guint)g_async_queue_length (consumer_data->file_queue_data->queue);
+        gboolean done = consumer_data->file_queue_data->scanning_done;
+        guint pending = (guint)g_atomic_int_get (&consumer_data->pending);
+        guint64 capacity, in_use, peak, waits;
+        memory_budget_stats (consumer_data->memory_budget, &capacity, &in_use, &peak, &waits);
+        gchar *in_flight = g_format_size (in_use);
+        g_message ("Progress: processed=%u, queue=%u, pending=%u, in_flight=%s, scanning_done=%s",
+                   summary_get_processed (consumer_data->summary_data),
+                   qlen,
+                   pending,
+                   in_flight,
+                   done ? "yes" : "no");
+        g_free (in_flight);
+        if (done && qlen == 0 && pending == 0) break;
+    }
+    return NULL;
+}
+
+
+// Measures the throughput of the workers over one window. Returns FALSE when the run is over, and sets
+// *valid to FALSE when the workers were starved (fewer queued files than threads): threads were not the limit then.
+static gboolean
+measure_throughput (ThreadTuner *tuner,
+                    guint        n_threads,
+                    gdouble     *score,
+                    gboolean    *valid)
+{
+    ConsumerData *consumer_data = tuner->consumer_data;
+    gint files_start = g_atomic_int_get (&consumer_data->files_done);
+    gsize bytes_start = (gsize)g_atomic_pointer_get (&consumer_data->bytes_read);
+    gint64 start_us = g_get_monotonic_time ();
+    gboolean starved = FALSE;
+
+    g_mutex_lock (&tuner->lock);
+    for (gint64 tick = start_us; !tuner->stop && tick < start_us + TUNER_WINDOW_US; tick += G_USEC_PER_SEC / 4) {
+        g_cond_wait_until (&tuner->cond, &tuner->lock, tick + G_USEC_PER_SEC / 4);
+        if ((guint)g_atomic_int_get (&consumer_data->pending) < n_threads) starved = TRUE;
+    }
+    gboolean stop = tuner->stop;
+    g_mutex_unlock (&tuner->lock);
+    if (stop) return FALSE;
+
+    gdouble seconds = (gdouble)(g_get_monotonic_time () - start_us) / G_USEC_PER_SEC;
+    gdouble files = g_atomic_int_get (&consumer_data->files_done) - files_start;
+    gdouble bytes = (gsize)g_atomic_pointer_get (&consumer_data->bytes_read) - bytes_start;
+    *score = (bytes + files * TUNER_BYTES_PER_FILE) / seconds;
+    *valid = !starved;
+
+    g_debug ("Thread tuner: %u threads, %.1f MiB/s, %.0f files/s%s",
+             n_threads, bytes / seconds / (1024 * 1024), files / seconds, starved ? " (starved)" : "");
+    return TRUE;
+}
+
+
+// Hill climbing on the number of pool threads: probe one thread more (or less), keep the probe if the throughput
+// improved, otherwise go back and probe the other direction next. Re-measuring the current setting after every
+// rejected probe lets the controller follow changes in the file mix and the background load.
+static gpointer
+thread_tuner (gpointer data)
+{
+    ThreadTuner *tuner = (ThreadTuner *)data;
+    ConsumerData *consumer_data = tuner->consumer_data;
+    ConfigData *config_data = consumer_data->config_data;
+
+    guint current = (guint)g_thread_pool_get_max_threads (consumer_data->thread_pool) - io_watchdog_stuck (consumer_data->io_watchdog);
+    gint direction = current < config_data->max_threads ? 1 : -1;
+    gdouble current_score, score;
+    gboolean valid;
+
+    if (!measure_throughput (tuner, current, &current_score, &valid)) return NULL;
+    while (TRUE) {
+        if (!valid) {
+            // The scanner (or the end of the run) limits the throughput: nothing to learn from this window
+            if (!measure_throughput (tuner, current, &current_score, &valid)) break;
+            continue;
+        }
+
+        guint probe = (guint)CLAMP((gint)current + direction, (gint)config_data->min_threads, (gint)config_data->max_threads);
+        if (probe == current) {
+            direction = -direction;
+            probe = (guint)CLAMP((gint)current + direction, (gint)config_data->min_threads, (gint)config_data->max_threads);
+            if (probe == current) break;
+        }
+
+        set_pool_threads (consumer_data, probe);
+        if (!measure_throughput (tuner, probe, &score, &valid)) break;
+
+        if (valid && score > current_score * (1 + TUNER_MIN_GAIN)) {
+            g_message ("Thread tuner: %u -> %u threads (%.1f -> %.1f MiB/s equivalent)",
+                       current, probe, current_score / (1024 * 1024), score / (1024 * 1024));
+            current = probe;
+            current_score = score;
+        } else {
+            set_pool_threads (consumer_data, current);
+            direction = -direction;
+            if (!measure_throughput (tuner, current, &current_score, &valid)) break;
+        }
+    }
+
+    // Later runs of the same context start from the setting that was found
+    set_pool_threads (consumer_data, current);
+    g_message ("Thread tuner: settled on %u threads", current);
+    return NULL;
+}
+
+
+// Runs one producer/consumer pass: feed() fills the file queue while the pool processes it
+static void
+run_workers (ConsumerData *consumer_data,
+             FeedFunc      feed,
+             gpointer      feed_data)
+{
+    consumer_data->file_queue_data->scanning_done = FALSE;
+    if (consumer_data->mode != MODE_CHECK) db_expect_begin (consumer_data->db_data);
+
+    GThread *consumer_thread = g_thread_new ("queue-consumer", queue_consumer, consumer_data);
+    GThread *progress_thread = NULL;
+    if (consumer_data->config_data->verbose) {
+        progress_thread = g_thread_new ("progress-reporter", progress_reporter, consumer_data);
+    }
+
+    ThreadTuner tuner = { .consumer_data = consumer_data };
+    GThread *tuner_thread = NULL;
+    if (consumer_data->config_data->adaptive_threads && g_atomic_int_compare_and_exchange (&tuner_running, 0, 1)) {
+        g_mutex_init (&tuner.lock);
+        g_cond_init (&tuner.cond);
+        tuner_thread = g_thread_new ("thread-tuner", thread_tuner, &tuner);
+    }
+
+    feed (consumer_data, feed_data);
+
+    g_thread_join (consumer_thread);
+    wait_for_jobs (consumer_data);
+    flush_verified (consumer_data);
+    if (progress_thread) g_thread_join (progress_thread);
+    if (tuner_thread) {
+        g_mutex_lock (&tuner.lock);
+        tuner.stop = TRUE;
+        g_cond_signal (&tuner.cond);
+        g_mutex_unlock (&tuner.lock);
+        g_thread_join (tuner_thread);
+        g_mutex_clear (&tuner.lock);
+        g_cond_clear (&tuner.cond);
+        g_atomic_int_set (&tuner_running, 0);
+    }
+}
+
+
+// feed_data: NULL-terminated array of directories, or NULL for the configured ones
+static void
+feed_directories (ConsumerData *consumer_data,
+                  gpointer      feed_data)
+{
+    ConfigData *config_data = consumer_data->config_data;
+    if (feed_data) {
+        process_directories ((gchar **)feed_data, config_data->max_recursion_depth, consumer_data->file_queue_data, config_data);
+        return;
+    }
+    gchar **dirs = g_strsplit (config_data->directories, ",", -1);
+    process_directories (dirs, config_data->max_recursion_depth, consumer_data->file_queue_data, config_data);
+    g_strfreev (dirs);
+}
+
+
+static void
+feed_file_list (ConsumerData *consumer_data,
+                gpointer      feed_data)
+{
+    const FfcRunOptions *options = (const FfcRunOptions *)feed_data;
+    process_file_list (options->file_list, options->null_separated, consumer_data->file_queue_data);
+}
+
+
+static void
+feed_verification_plan (ConsumerData *consumer_data,
+                        gpointer      feed_data)
+{
+    GPtrArray *plan = (GPtrArray *)feed_data;
+    file_queue_push_buffer (consumer_data->file_queue_data, plan);
+    consumer_data->file_queue_data->scanning_done = TRUE;
+}
+
+
+static ConsumerData *
+consumer_data_new (FfcContext *ctx,
+                   Mode        mode)
+{
+    ConsumerData *consumer_data = g_try_new0 (ConsumerData, 1);
+    if (!consumer_data) {
+        g_log (NULL, G_LOG_LEVEL_ERROR, "Failed to allocate memory for consumer_data");
+        return NULL;
+    }
+    consumer_data->thread_pool = ctx->thread_pool;
+    consumer_data->config_data = ctx->config_data;
+    consumer_data->db_data = ctx->db_data;
+    consumer_data->memory_budget = ctx->memory_budget;
+    consumer_data->calibration = ctx->calibration;
+    consumer_data->io_watchdog = ctx->io_watchdog;
+    consumer_data->mode = mode;
+    consumer_data->check_scope = CHECK_METADATA | CHECK_CONTENT;
+    // Every full-content match is stored: budgeted and sampled checks pick the files whose last one is the oldest
+    consumer_data->record_verified = mode == MODE_CHECK;
+    g_mutex_init (&consumer_data->on_result_lock);
+    g_mutex_init (&consumer_data->moved_lock);
+    consumer_data->moved_paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    g_mutex_init (&consumer_data->pending_lock);
+    g_cond_init (&consumer_data->pending_cond);
+
+    // One summary shard per worker, plus the calling thread (missing-files pass)
+    consumer_data->summary_data = summary_new (ctx->config_data->threads_count + 1);
+    if (consumer_data->summary_data == NULL) {
+        g_free (consumer_data);
+        return NULL;
+    }
+    g_mutex_init (&consumer_data->verified_lock);
+    consumer_data->verified = g_new (GPtrArray *, ctx->db_data->n_shards);
+    for (guint i = 0; i < ctx->db_data->n_shards; i++) {
+        consumer_data->verified[i] = g_ptr_array_new_with_free_func (g_free);
+    }
+    if (ctx->config_data->prefetch_window > 0) {
+        consumer_data->prefetcher = prefetcher_new (ctx->config_data->prefetch_window);
+    }
+    return consumer_data;
+}
+
+
+static void
+consumer_data_free (ConsumerData *consumer_data)
+{
+    prefetcher_free (consumer_data->prefetcher);
+    for (guint i = 0; i < consumer_data->db_data->n_shards; i++) {
+        g_ptr_array_free (consumer_data->verified[i], TRUE);
+    }
+    g_free (consumer_data->verified);
+    g_mutex_clear (&consumer_data->verified_lock);
+    g_mutex_clear (&consumer_data->on_result_lock);
+    g_mutex_clear (&consumer_data->moved_lock);
+    g_hash_table_destroy (consumer_data->moved_paths);
+    g_mutex_clear (&consumer_data->pending_lock);
+    g_cond_clear (&consumer_data->pending_cond);
+    g_free (consumer_data);
+}
+
+
+FfcContext *
+ffc_context_new (ConfigData *config_data)
+{
+    FfcContext *ctx = g_try_new0 (FfcContext, 1);
+    if (!ctx) {
+        g_log (NULL, G_LOG_LEVEL_ERROR, "Failed to allocate memory for FfcContext");
+        free_config (config_data);
+        return NULL;
+    }
+    ctx->config_data = config_data;
+    ctx->memory_budget = memory_budget_new (config_data->io_memory_budget);
+
+    ctx->db_data = init_db (config_data);
+    if (ctx->db_data == NULL) {
+        memory_budget_free (ctx->memory_budget);
+        free_config (config_data);
+        g_free (ctx);
+        return NULL;
+    }
+
+    GError *error = NULL;
+    ctx->thread_pool = g_thread_pool_new (worker_thread, ctx, (gint)config_data->threads_count, TRUE, &error);
+    if (error != NULL) {
+        g_log (NULL, G_LOG_LEVEL_ERROR, "Error creating the thread pool: %s", error->message);
+        g_error_free (error);
+        memory_budget_free (ctx->memory_budget);
+        free_db (ctx->db_data);
+        free_config (config_data);
+        g_free (ctx);
+        return NULL;
+    }
+
+    // Probed once the database directory exists: the results are cached there
+    if (config_data->calibrate_hashing) {
+        ctx->calibration = calibration_load (config_data);
+    }
+    if (config_data->read_timeout_us > 0) {
+        ctx->io_watchdog = io_watchdog_new (config_data->read_timeout_us, abandon_job, ctx);
+    }
+
+    return ctx;
+}
+
+
+FfcContext *
+ffc_context_open (const gchar *config_path)
+{
+    ConfigData *config_data = load_config (config_path);
+    if (config_data == NULL) return NULL;
+    return ffc_context_new (config_data);
+}
+
+
+ConfigData *
+ffc_context_get_config (FfcContext *ctx)
+{
+    return ctx->config_data;
+}
+
+
+void
+ffc_context_free (FfcContext *ctx)
+{
+    if (!ctx) return;
+
+    guint stuck = io_watchdog_stuck (ctx->io_watchdog);
+    if (stuck > 0) {
+        // Their reads may never return: the pool, the watchdog and the memory budget they use on return are left behind
+        g_log (NULL, G_LOG_LEVEL_WARNING, "%u workers are still blocked reading files that were given up", stuck);
+        calibration_free (ctx->calibration);
+        free_db (ctx->db_data);
+        free_config (ctx->config_data);
+        return;
+    }
+
+    g_thread_pool_free (ctx->thread_pool, FALSE, TRUE);
+    io_watchdog_free (ctx->io_watchdog);
+    memory_budget_free (ctx->memory_budget);
+    calibration_free (ctx->calibration);
+    free_db (ctx->db_data);
+    free_config (ctx->config_data);
+    g_free (ctx);
+}
+
+
+static gboolean
+run_batch (FfcContext          *ctx,
+           Mode                 mode,
+           const gchar * const *paths,
+           gsize                n_paths,
+           FfcResultFunc        callback,
+           gpointer             user_data)
+{
+    ConsumerData *consumer_data = consumer_data_new (ctx, mode);
+    if (consumer_data == NULL) return FALSE;
+    // Missing files are looked up one by one, like with --files-from
+    consumer_data->listed_paths = TRUE;
+    consumer_data->on_result = callback;
+    consumer_data->on_result_data = user_data;
+
+    for (gsize i = 0; i < n_paths; i++) {
+        submit_job (consumer_data, g_strdup (paths[i]));
+    }
+    wait_for_jobs (consumer_data);
+    flush_verified (consumer_data);
+
+    free_summary (consumer_data->summary_data);
+    consumer_data_free (consumer_data);
+
+    return TRUE;
+}
+
+
+gboolean
+ffc_verify (FfcContext          *ctx,
+            const gchar * const *paths,
+            gsize                n_paths,
+            FfcResultFunc        callback,
+            gpointer             user_data)
+{
+    return run_batch (ctx, MODE_CHECK, paths, n_paths, callback, user_data);
+}
+
+
+gboolean
+ffc_add (FfcContext          *ctx,
+         const gchar * const *paths,
+         gsize                n_paths,
+         FfcResultFunc        callback,
+         gpointer             user_data)
+{
+    return run_batch (ctx, MODE_ADD, paths, n_paths, callback, user_data);
+}
+
+
+gboolean
+ffc_update (FfcContext          *ctx,
+            const gchar * const *paths,
+            gsize                n_paths,
+            FfcResultFunc        callback,
+            gpointer             user_data)
+{
+    return run_batch (ctx, MODE_UPDATE, paths, n_paths, callback, user_data);
+}
+
+
+gboolean
+ffc_process_tree (FfcContext    *ctx,
+                  Mode           mode,
+                  const gchar   *dir_path,
+                  FfcResultFunc  callback,
+                  gpointer       user_data)
+{
+    FileQueueData *file_queue_data = init_file_queue (ctx->config_data->usable_ram);
+    if (!file_queue_data) return FALSE;
+
+    ConsumerData *consumer_data = consumer_data_new (ctx, mode);
+    if (consumer_data == NULL) {
+        free_file_queue (file_queue_data);
+        return FALSE;
+    }
+    consumer_data->file_queue_data = file_queue_data;
+    consumer_data->on_result = callback;
+    consumer_data->on_result_data = user_data;
+
+    gchar *dirs[] = { (gchar *)dir_path, NULL };
+    run_workers (consumer_data, feed_directories, dirs);
+    if (mode != MODE_ADD) {
+        handle_missing_files_under (consumer_data, dir_path);
+    }
+
+    free_summary (consumer_data->summary_data);
+    consumer_data_free (consumer_data);
+    free_file_queue (file_queue_data);
+
+    return TRUE;
+}
+
+
+SummaryData *
+ffc_run (FfcContext          *ctx,
+         Mode                 mode,
+         const FfcRunOptions *options)
+{
+    ConfigData *config_data = ctx->config_data;
+    DatabaseData *db_data = ctx->db_data;
+
+    FileQueueData *file_queue_data = init_file_queue (config_data->usable_ram);
+    if (!file_queue_data) return NULL;
+
+    ConsumerData *consumer_data = consumer_data_new (ctx, mode);
+    if (consumer_data == NULL) {
+        free_file_queue (file_queue_data);
+        return NULL;
+    }
+    consumer_data->file_queue_data = file_queue_data;
+    SummaryData *summary_data = consumer_data->summary_data;
+
+    if (options->report_path && mode == MODE_CHECK) {
+        summary_data->report = report_open (options->report_path);
+        if (summary_data->report == NULL) {
+            free_summary (summary_data);
+            consumer_data_free (consumer_data);
+            free_file_queue (file_queue_data);
+            return NULL;
+        }
+    }
+
+    guint64 time_budget_us = config_data->time_budget_us;
+    guint64 byte_budget = config_data->byte_budget;
+    if (options->file_list) {
+        consumer_data->listed_paths = TRUE;
+        if (time_budget_us > 0 || byte_budget > 0) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "--time-budget and --byte-budget are ignored with --files-from: every listed file is fully checked");
+            time_budget_us = byte_budget = 0;
+        }
+    }
+
+    gboolean budgeted = mode == MODE_CHECK && (time_budget_us > 0 || byte_budget > 0);
+    summary_data->budgeted = budgeted;
+    // A budgeted check compares metadata of every file first and hashes only the files that are due afterwards
+    consumer_data->check_scope = budgeted ? CHECK_METADATA : CHECK_METADATA | CHECK_CONTENT;
+
+    // A first add into empty databases is written sorted with MDB_APPEND once all files have been hashed
+    if (mode == MODE_ADD && db_is_empty (db_data)) {
+        consumer_data->bulk_loader = bulk_loader_new (db_data, config_data);
+    }
+
+    if (options->file_list) {
+        run_workers (consumer_data, feed_file_list, (gpointer)options);
+    } else {
+        run_workers (consumer_data, feed_directories, NULL);
+    }
+
+    if (consumer_data->bulk_loader) {
+        guint64 loaded;
+        gboolean loaded_all = bulk_loader_finish (consumer_data->bulk_loader, &loaded);
+        bulk_loader_free (consumer_data->bulk_loader);
+        consumer_data->bulk_loader = NULL;
+        summary_increment_processed (summary_data, (guint)MIN (loaded, (guint64)G_MAXUINT));
+        if (!loaded_all) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "Bulk load failed after %" G_GUINT64_FORMAT " records: run add again to store the rest", loaded);
+            free_summary (summary_data);
+            consumer_data_free (consumer_data);
+            free_file_queue (file_queue_data);
+            return NULL;
+        }
+        g_message ("Bulk-loaded %" G_GUINT64_FORMAT " records", loaded);
+    }
+
+    // Listed paths that are gone have already been handled one by one: the full database walk is skipped
+    if (!consumer_data->listed_paths && mode != MODE_ADD) {
+        handle_missing_files_from_fs (db_data, summary_data, mode == MODE_UPDATE, consumer_data->moved_paths, config_data->threads_count);
+    }
+
+    if (budgeted) {
+        consumer_data->check_scope = CHECK_CONTENT;
+        if (time_budget_us > 0) {
+            consumer_data->verify_deadline_us = g_get_monotonic_time () + (gint64)time_budget_us;
+        }
+        // Rounds go on while the time budget lasts; the files verified meanwhile are planned again only after the others
+        VerifyPlan *plan = NULL;
+        do {
+            VerifyPlan *next = build_verification_plan (db_data, config_data, summary_data, plan);
+            verify_plan_free (plan);
+            plan = next;
+            consumer_data->verify_floor_files = (gint)MIN (plan->floor_files, (guint)G_MAXINT);
+            run_workers (consumer_data, feed_verification_plan, plan->paths);
+        } while (!plan->last_round && g_get_monotonic_time () < consumer_data->verify_deadline_us);
+        verify_plan_free (plan);
+    }
+
+    guint64 in_use;
+    memory_budget_stats (ctx->memory_budget, &summary_data->memory_budget, &in_use,
+                         &summary_data->memory_peak, &summary_data->memory_waits);
+
+    consumer_data_free (consumer_data);
+    free_file_queue (file_queue_data);
+
+    return summary_data;
+}
+
+
+gboolean
+ffc_merge (FfcContext *ctx)
+{
+    return db_merge_shards (ctx->db_data, ctx->config_data);
+}
+
+
+gboolean
+ffc_merge_databases (FfcContext          *ctx,
+                     const gchar * const *db_paths,
+                     gsize                n_paths)
+{
+    DatabaseData **sources = g_new0 (DatabaseData *, n_paths);
+    gboolean ok = TRUE;
+    for (gsize i = 0; i < n_paths && ok; i++) {
+        sources[i] = db_open_at (ctx->config_data, db_paths[i]);
+        ok = sources[i] != NULL;
+    }
+
+    RecordMerger *merger = ok ? record_merger_new (sources, (guint)n_paths) : NULL;
+    if (merger) {
+        RecordWriter *writer = record_writer_new (ctx->db_data);
+        MDB_val key;
+        FileEntryData entry;
+        while (ok && record_merger_next (merger, &key, &entry)) {
+            ok = record_writer_add (writer, key.mv_data, key.mv_size, &entry);
+        }
+        ok = ok && record_writer_finish (writer);
+        g_message ("Merged %" G_GUINT64_FORMAT " records from %" G_GSIZE_FORMAT " databases into %s",
+                   record_writer_written (writer), n_paths, ctx->config_data->db_path);
+        record_writer_free (writer);
+        record_merger_free (merger);
+    } else {
+        ok = FALSE;
+    }
+
+    for (gsize i = 0; i < n_paths; i++) free_db (sources[i]);
+    g_free (sources);
+    return ok;
+}
+
+
+gint64
+ffc_diff (FfcContext  *ctx,
+          const gchar *other_db_path,
+          FfcDiffFunc  callback,
+          gpointer     user_data)
+{
+    DatabaseData *other = db_open_at (ctx->config_data, other_db_path);
+    if (other == NULL) return -1;
+
+    gint64 differences = db_diff (ctx->db_data, other, callback, user_data);
+    free_db (other);
+    return differences;
+}
+
+
+gboolean
+ffc_compact (FfcContext *ctx)
+{
+    return db_compact (ctx->db_data, ctx->config_data);
+}
+
+
+gint64
+ffc_export (FfcContext *ctx,
+            FILE       *out)
+{
+    return dump_export (ctx->db_data, out);
+}
+
+
+gint64
+ffc_import (FfcContext *ctx,
+            FILE       *in)
+{
+    return dump_import (ctx->db_data, in);
+}
+
+
+guint64
+ffc_find_duplicates (FfcContext       *ctx,
+                     FfcDuplicateFunc  callback,
+                     gpointer          user_data)
+{
+    return db_find_duplicates (ctx->db_data, callback, user_data);
+}
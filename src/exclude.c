@@ -0,0 +1,466 @@
+#include <glib.h>
+#include <fnmatch.h>
+#include <string.h>
+#include "exclude.h"
+
+#define MATCH_FILE        (1 << 0)
+#define MATCH_DIR         (1 << 1)
+#define GLOB_BUCKET_ANY   256       // globs ending with a wildcard are tried for every name
+#define NODE_SET_INLINE   16
+
+typedef struct exclude_node_t ExcludeNode;
+
+// Byte trie used for '*literal' (walked backwards from the end of the name) and 'literal*' components
+typedef struct char_trie_t {
+    guchar ch;
+    ExcludeNode *target;
+    struct char_trie_t *child;
+    struct char_trie_t *sibling;
+} CharTrie;
+
+typedef struct glob_entry_t {
+    gchar *pattern;
+    ExcludeNode *target;
+} GlobEntry;
+
+// One position inside the compiled patterns: its children are the possible next path components
+struct exclude_node_t {
+    guint terminal;             // MATCH_FILE/MATCH_DIR: a pattern ends here
+    gboolean globstar;          // '**': matches any number of components, the node stays active
+    ExcludeNode *star_child;    // '**' following this node, active as soon as this node is
+    GHashTable *literals;       // exact name -> node
+    CharTrie *suffixes;
+    CharTrie *prefixes;
+    GPtrArray **glob_buckets;   // other globs, bucketed by their last byte (GLOB_BUCKET_ANY + 1 buckets)
+    GHashTable *by_component;   // component text -> node, used while compiling to share common prefixes
+};
+
+struct exclude_rules_t {
+    gboolean exclude_hidden;
+    ExcludeNode *root;
+    GPtrArray *nodes;           // owns every node
+    guint pattern_count;
+};
+
+struct exclude_state_t {
+    guint n_nodes;
+    ExcludeNode *nodes[];
+};
+
+// Small set of active nodes, kept on the stack unless many globstars are live at once
+typedef struct node_set_t {
+    guint len;
+    guint cap;
+    ExcludeNode **nodes;
+    ExcludeNode *inline_nodes[NODE_SET_INLINE];
+} NodeSet;
+
+
+static void
+node_set_init (NodeSet *set)
+{
+    set->len = 0;
+    set->cap = NODE_SET_INLINE;
+    set->nodes = set->inline_nodes;
+}
+
+
+static void
+node_set_clear (NodeSet *set)
+{
+    if (set->nodes != set->inline_nodes) g_free (set->nodes);
+}
+
+
+static void
+node_set_add (NodeSet     *set,
+              ExcludeNode *node)
+{
+    // Add the node and everything reachable through '**' without consuming a component
+    while (node) {
+        for (guint i = 0; i < set->len; i++) {
+            if (set->nodes[i] == node) return;
+        }
+        if (set->len == set->cap) {
+            ExcludeNode **grown = g_new (ExcludeNode *, set->cap * 2);
+            memcpy (grown, set->nodes, set->len * sizeof(ExcludeNode *));
+            node_set_clear (set);
+            set->nodes = grown;
+            set->cap *= 2;
+        }
+        set->nodes[set->len++] = node;
+        node = node->star_child;
+    }
+}
+
+
+static ExcludeState *
+node_set_to_state (const NodeSet *set)
+{
+    ExcludeState *state = g_malloc (sizeof(ExcludeState) + set->len * sizeof(ExcludeNode *));
+    state->n_nodes = set->len;
+    memcpy (state->nodes, set->nodes, set->len * sizeof(ExcludeNode *));
+    return state;
+}
+
+
+static void
+char_trie_free (CharTrie *trie)
+{
+    while (trie) {
+        CharTrie *next = trie->sibling;
+        char_trie_free (trie->child);
+        g_free (trie);
+        trie = next;
+    }
+}
+
+
+static CharTrie *
+char_trie_step (CharTrie *trie,
+                guchar    ch,
+                gboolean  create)
+{
+    for (CharTrie *c = trie->child; c; c = c->sibling) {
+        if (c->ch == ch) return c;
+    }
+    if (!create) return NULL;
+
+    CharTrie *c = g_new0 (CharTrie, 1);
+    c->ch = ch;
+    c->sibling = trie->child;
+    trie->child = c;
+    return c;
+}
+
+
+static void
+exclude_node_free (gpointer data)
+{
+    ExcludeNode *node = data;
+    if (node->literals) g_hash_table_destroy (node->literals);
+    if (node->by_component) g_hash_table_destroy (node->by_component);
+    char_trie_free (node->suffixes);
+    char_trie_free (node->prefixes);
+    if (node->glob_buckets) {
+        for (guint i = 0; i <= GLOB_BUCKET_ANY; i++) {
+            if (node->glob_buckets[i]) g_ptr_array_free (node->glob_buckets[i], TRUE);
+        }
+        g_free (node->glob_buckets);
+    }
+    g_free (node);
+}
+
+
+static void
+glob_entry_free (gpointer data)
+{
+    GlobEntry *entry = data;
+    g_free (entry->pattern);
+    g_free (entry);
+}
+
+
+static ExcludeNode *
+new_node (ExcludeRules *rules)
+{
+    ExcludeNode *node = g_new0 (ExcludeNode, 1);
+    g_ptr_array_add (rules->nodes, node);
+    return node;
+}
+
+
+static gboolean
+has_wildcard (const gchar *s,
+              gsize        len)
+{
+    for (gsize i = 0; i < len; i++) {
+        if (s[i] == '*' || s[i] == '?' || s[i] == '[') return TRUE;
+    }
+    return FALSE;
+}
+
+
+// Returns the child of parent for one pattern component, creating it in the right index on first use
+static ExcludeNode *
+add_component (ExcludeRules *rules,
+               ExcludeNode  *parent,
+               const gchar  *component)
+{
+    if (g_strcmp0 (component, "**") == 0) {
+        if (!parent->star_child) {
+            parent->star_child = new_node (rules);
+            parent->star_child->globstar = TRUE;
+        }
+        return parent->star_child;
+    }
+
+    if (!parent->by_component) parent->by_component = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    ExcludeNode *node = g_hash_table_lookup (parent->by_component, component);
+    if (node) return node;
+
+    node = new_node (rules);
+    g_hash_table_insert (parent->by_component, g_strdup (component), node);
+
+    gsize len = strlen (component);
+    if (!has_wildcard (component, len)) {
+        if (!parent->literals) parent->literals = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        g_hash_table_insert (parent->literals, g_strdup (component), node);
+    } else if (component[0] == '*' && !has_wildcard (component + 1, len - 1)) {
+        if (!parent->suffixes) parent->suffixes = g_new0 (CharTrie, 1);
+        CharTrie *t = parent->suffixes;
+        for (gsize i = len; i > 1; i--) t = char_trie_step (t, (guchar)component[i - 1], TRUE);
+        t->target = node;
+    } else if (component[len - 1] == '*' && !has_wildcard (component, len - 1)) {
+        if (!parent->prefixes) parent->prefixes = g_new0 (CharTrie, 1);
+        CharTrie *t = parent->prefixes;
+        for (gsize i = 0; i + 1 < len; i++) t = char_trie_step (t, (guchar)component[i], TRUE);
+        t->target = node;
+    } else {
+        guchar last = (guchar)component[len - 1];
+        guint bucket = (last == '*' || last == '?' || last == ']') ? GLOB_BUCKET_ANY : last;
+        if (!parent->glob_buckets) parent->glob_buckets = g_new0 (GPtrArray *, GLOB_BUCKET_ANY + 1);
+        if (!parent->glob_buckets[bucket]) parent->glob_buckets[bucket] = g_ptr_array_new_with_free_func (glob_entry_free);
+        GlobEntry *entry = g_new0 (GlobEntry, 1);
+        entry->pattern = g_strdup (component);
+        entry->target = node;
+        g_ptr_array_add (parent->glob_buckets[bucket], entry);
+    }
+
+    return node;
+}
+
+
+// Pattern syntax:
+//   /abs/path      anchored at the filesystem root, components may be globs ('*', '?', '[...]') or '**'
+//   name, *.ext    no '/': matches the entry name at any depth (a leading '*/' or '**/' means the same)
+//   a/b            relative with '/': matches that sequence of components at any depth
+//   trailing '/'   only matches directories
+static void
+add_pattern (ExcludeRules *rules,
+             const gchar  *pattern)
+{
+    gchar *p = g_strstrip (g_strdup (pattern));
+    gsize len = strlen (p);
+    guint terminal = MATCH_FILE | MATCH_DIR;
+
+    while (len > 1 && p[len - 1] == '/') {
+        p[--len] = '\0';
+        terminal = MATCH_DIR;
+    }
+    if (len == 0 || g_strcmp0 (p, "/") == 0) {
+        g_free (p);
+        return;
+    }
+
+    ExcludeNode *node = rules->root;
+    const gchar *rest = p;
+    if (rest[0] == '/') {
+        rest++;
+    } else {
+        if (g_str_has_prefix (rest, "*/")) rest += 2;
+        node = add_component (rules, node, "**");
+    }
+
+    gchar **components = g_strsplit (rest, "/", -1);
+    for (gsize i = 0; components[i]; i++) {
+        if (components[i][0] == '\0' || g_strcmp0 (components[i], ".") == 0) continue;
+        node = add_component (rules, node, components[i]);
+    }
+    g_strfreev (components);
+
+    node->terminal |= terminal;
+    rules->pattern_count++;
+    g_free (p);
+}
+
+
+static void
+add_pattern_list (ExcludeRules *rules,
+                  const gchar  *list,
+                  const gchar  *prefix)
+{
+    if (!list) return;
+
+    gchar **items = g_strsplit_set (list, ",;", -1);
+    for (gsize i = 0; items[i]; i++) {
+        gchar *item = g_strstrip (items[i]);
+        if (item[0] == '\0') continue;
+        if (prefix) {
+            gchar *pattern = g_strconcat (prefix, item, NULL);
+            add_pattern (rules, pattern);
+            g_free (pattern);
+        } else {
+            add_pattern (rules, item);
+        }
+    }
+    g_strfreev (items);
+}
+
+
+ExcludeRules *
+exclude_rules_new (ConfigData *config_data)
+{
+    ExcludeRules *rules = g_try_new0 (ExcludeRules, 1);
+    if (!rules) {
+        g_log (NULL, G_LOG_LEVEL_ERROR, "Failed to allocate memory for ExcludeRules");
+        return NULL;
+    }
+    rules->exclude_hidden = config_data->exclude_hidden;
+    rules->nodes = g_ptr_array_new_with_free_func (exclude_node_free);
+    rules->root = new_node (rules);
+
+    // exclude_directories are full paths, exclude_extensions are name suffixes
+    add_pattern_list (rules, config_data->exclude_directories, NULL);
+    add_pattern_list (rules, config_data->exclude_extensions, "*");
+    add_pattern_list (rules, config_data->exclude_patterns, NULL);
+
+    // The component maps are only needed to share prefixes while compiling
+    for (guint i = 0; i < rules->nodes->len; i++) {
+        ExcludeNode *node = g_ptr_array_index (rules->nodes, i);
+        if (node->by_component) {
+            g_hash_table_destroy (node->by_component);
+            node->by_component = NULL;
+        }
+    }
+
+    g_debug ("Compiled %u exclusion patterns into %u nodes", rules->pattern_count, rules->nodes->len);
+
+    return rules;
+}
+
+
+void
+exclude_rules_free (ExcludeRules *rules)
+{
+    if (!rules) return;
+    g_ptr_array_free (rules->nodes, TRUE);
+    g_free (rules);
+}
+
+
+// Adds to next the children of node matching name; returns TRUE as soon as a pattern ends on a match of this kind
+static gboolean
+match_children (const ExcludeNode *node,
+                const gchar       *name,
+                gsize              len,
+                guint              kind,
+                NodeSet           *next)
+{
+#define VISIT(target) do {                                      \
+        ExcludeNode *t_ = (target);                             \
+        if (t_->terminal & kind) return TRUE;                   \
+        if (next) node_set_add (next, t_);                      \
+    } while (0)
+
+    if (node->literals) {
+        ExcludeNode *target = g_hash_table_lookup (node->literals, name);
+        if (target) VISIT (target);
+    }
+
+    if (node->suffixes) {
+        const CharTrie *t = node->suffixes;
+        if (t->target) VISIT (t->target);
+        for (gsize i = len; i > 0 && (t = char_trie_step ((CharTrie *)t, (guchar)name[i - 1], FALSE)); i--) {
+            if (t->target) VISIT (t->target);
+        }
+    }
+
+    if (node->prefixes) {
+        const CharTrie *t = node->prefixes;
+        for (gsize i = 0; i < len && (t = char_trie_step ((CharTrie *)t, (guchar)name[i], FALSE)); i++) {
+            if (t->target) VISIT (t->target);
+        }
+    }
+
+    if (node->glob_buckets && len > 0) {
+        guint buckets[2] = { (guchar)name[len - 1], GLOB_BUCKET_ANY };
+        for (guint b = 0; b < 2; b++) {
+            GPtrArray *globs = node->glob_buckets[buckets[b]];
+            if (!globs) continue;
+            for (guint i = 0; i < globs->len; i++) {
+                GlobEntry *entry = g_ptr_array_index (globs, i);
+                if (fnmatch (entry->pattern, name, 0) == 0) VISIT (entry->target);
+            }
+        }
+    }
+
+#undef VISIT
+    return FALSE;
+}
+
+
+ExcludeState *
+exclude_state_for_path (ExcludeRules *rules,
+                        const gchar  *dir_path)
+{
+    NodeSet current, next;
+    node_set_init (&current);
+    node_set_add (&current, rules->root);
+
+    gchar **components = g_strsplit (dir_path, "/", -1);
+    for (gsize c = 0; components[c]; c++) {
+        const gchar *name = components[c];
+        if (name[0] == '\0' || g_strcmp0 (name, ".") == 0) continue;
+
+        node_set_init (&next);
+        for (guint i = 0; i < current.len; i++) {
+            ExcludeNode *node = current.nodes[i];
+            if (node->globstar) node_set_add (&next, node);
+            // Terminals are ignored here: a directory that was asked for explicitly is always scanned
+            match_children (node, name, strlen (name), 0, &next);
+        }
+        node_set_clear (&current);
+        current = next;
+        if (current.nodes == next.inline_nodes) current.nodes = current.inline_nodes;
+    }
+    g_strfreev (components);
+
+    ExcludeState *state = node_set_to_state (&current);
+    node_set_clear (&current);
+    return state;
+}
+
+
+gboolean
+exclude_rules_match (ExcludeRules       *rules,
+                     const ExcludeState *state,
+                     const gchar        *name,
+                     gboolean            is_dir,
+                     ExcludeState      **child_state)
+{
+    if (rules->exclude_hidden && name[0] == '.') return TRUE;
+
+    guint kind = is_dir ? MATCH_DIR : MATCH_FILE;
+    gsize len = strlen (name);
+    gboolean want_state = is_dir && child_state != NULL;
+
+    NodeSet next;
+    node_set_init (&next);
+
+    gboolean excluded = FALSE;
+    for (guint i = 0; i < state->n_nodes && !excluded; i++) {
+        const ExcludeNode *node = state->nodes[i];
+        if (node->globstar) {
+            // A pattern ending in '**' matches everything below it
+            if (node->terminal & kind) {
+                excluded = TRUE;
+                break;
+            }
+            if (want_state) node_set_add (&next, (ExcludeNode *)node);
+        }
+        excluded = match_children (node, name, len, kind, want_state ? &next : NULL);
+    }
+
+    if (want_state && !excluded) *child_state = node_set_to_state (&next);
+    node_set_clear (&next);
+
+    return excluded;
+}
+
+
+void
+exclude_state_free (ExcludeState *state)
+{
+    g_free (state);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <glib.h>
+#include "config.h"
+
+// Exclusion rules compiled once from exclude_hidden, exclude_directories, exclude_extensions and exclude_patterns.
+// Patterns are matched one path component at a time: the scanner keeps an ExcludeState per directory and checks
+// each entry name against it, so the cost per entry does not depend on how many patterns are configured.
+typedef struct exclude_rules_t ExcludeRules;
+typedef struct exclude_state_t ExcludeState;
+
+ExcludeRules *exclude_rules_new      (ConfigData         *config_data);
+
+void          exclude_rules_free     (ExcludeRules       *rules);
+
+// Returns the state for an absolute directory path (e.g. a scan root). The path itself is never excluded.
+ExcludeState *exclude_state_for_path (ExcludeRules       *rules,
+                                      const gchar        *dir_path);
+
+// Returns TRUE when the entry name inside the directory described by state is excluded.
+// For a directory that is not excluded, *child_state (when not NULL) receives the state to scan it with.
+gboolean      exclude_rules_match    (ExcludeRules       *rules,
+                                      const ExcludeState *state,
+                                      const gchar        *name,
+                                      gboolean            is_dir,
+                                      ExcludeState      **child_state);
+
+void          exclude_state_free     (ExcludeState       *state);
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stdio.h>
+#include <glib.h>
+#include "config.h"
+#include "database.h"
+#include "db_diff.h"
+#include "summary.h"
+
+// libffc: the FastFileCheck engine. A context keeps the databases open and the hashing workers running,
+// so that any number of runs and batches can be served without paying for start-up each time.
+typedef struct ffc_context_t FfcContext;
+
+// Per-path outcome passed to FfcResultFunc: CHANGE_BIT() flags of the detected changes
+// (0 when the file matches the database, or was stored), or one of these
+#define FFC_RESULT_SKIPPED (1u << 30)
+#define FFC_RESULT_FAILED  (1u << 31)
+
+// Called from the worker threads once per path (from the read watchdog for a file given up after read_timeout,
+// with CHANGE_BIT(CHANGE_TIMEOUT)); calls for the same batch never overlap
+typedef void (*FfcResultFunc) (const gchar *path,
+                               guint        changes,
+                               gpointer     user_data);
+
+// Called once per group of files with the same content; paths holds the (NUL terminated) paths of the group
+typedef DbDuplicateFunc FfcDuplicateFunc;
+
+// Called once per record that differs between two databases (see DbDiffKind)
+typedef DbDiffFunc FfcDiffFunc;
+
+typedef struct ffc_run_options_t {
+    const gchar *report_path;   // check: stream changes as NDJSON to this path ("-" for stdout), NULL for none
+    FILE *file_list;            // process the paths read from this stream instead of scanning the configured directories
+    gboolean null_separated;    // file_list entries are NUL separated instead of newline separated
+} FfcRunOptions;
+
+// Takes ownership of config_data; returns NULL when the databases cannot be opened
+FfcContext  *ffc_context_new        (ConfigData          *config_data);
+
+FfcContext  *ffc_context_open       (const gchar         *config_path);
+
+ConfigData  *ffc_context_get_config (FfcContext          *ctx);
+
+// Workers still blocked in files given up after read_timeout can't be stopped: what they use is then left allocated
+void         ffc_context_free       (FfcContext          *ctx);
+
+// Batch calls: process the given paths on the shared workers and return once all of them are done.
+// Files that don't exist are reported as missing (verify) or removed from the database (update).
+// Several batches may run at the same time from different threads.
+gboolean     ffc_verify             (FfcContext          *ctx,
+                                     const gchar * const *paths,
+                                     gsize                n_paths,
+                                     FfcResultFunc        callback,
+                                     gpointer             user_data);
+
+gboolean     ffc_add                (FfcContext          *ctx,
+                                     const gchar * const *paths,
+                                     gsize                n_paths,
+                                     FfcResultFunc        callback,
+                                     gpointer             user_data);
+
+gboolean     ffc_update             (FfcContext          *ctx,
+                                     const gchar * const *paths,
+                                     gsize                n_paths,
+                                     FfcResultFunc        callback,
+                                     gpointer             user_data);
+
+// Scans the directory tree like the configured directories (exclusions apply) and processes every file found.
+// Database records below dir_path whose file is gone are reported as missing (check) or removed (update).
+gboolean     ffc_process_tree       (FfcContext          *ctx,
+                                     Mode                 mode,
+                                     const gchar         *dir_path,
+                                     FfcResultFunc        callback,
+                                     gpointer             user_data);
+
+// Full add/check/update pass as done by the command line tool. Returns the summary, whose change report
+// (if any) is still open: print it, then report_close() and free_summary(). NULL on error.
+SummaryData *ffc_run                (FfcContext          *ctx,
+                                     Mode                 mode,
+                                     const FfcRunOptions *options);
+
+// Copies all shards into the single database at db_path
+gboolean     ffc_merge              (FfcContext          *ctx);
+
+// Merges the databases at db_paths (written with the same configuration, e.g. the slices of a --shard run)
+// into the configured database: the records are read in key order across all sources and loaded with
+// MDB_APPEND when the configured database is empty
+gboolean     ffc_merge_databases    (FfcContext          *ctx,
+                                     const gchar * const *db_paths,
+                                     gsize                n_paths);
+
+// Rewrites the databases without their free pages (see db_compact)
+gboolean     ffc_compact            (FfcContext          *ctx);
+
+// Streams all records as a portable, sorted and checksummed dump (see dump.h); -1 on error, else the record count
+gint64       ffc_export             (FfcContext          *ctx,
+                                     FILE                *out);
+
+// Loads a dump written by ffc_export() into empty databases; -1 on error, else the record count
+gint64       ffc_import             (FfcContext          *ctx,
+                                     FILE                *in);
+
+// Compares the configured database with the one at other_db_path (same configuration, e.g. a replica) through
+// the directory rollups; returns the number of differing records, -1 on error
+gint64       ffc_diff               (FfcContext          *ctx,
+                                     const gchar         *other_db_path,
+                                     FfcDiffFunc          callback,
+                                     gpointer             user_data);
+
+// Calls callback for every group of two or more files stored with the same content hash, found by a cursor scan
+// of the hash indexes (no file is read). Returns the number of groups.
+guint64      ffc_find_duplicates    (FfcContext          *ctx,
+                                     FfcDuplicateFunc     callback,
+                                     gpointer             user_data);
@@ -0,0 +1,234 @@
+#include <glib.h>
+#include "io_watchdog.h"
+
+#define WATCHDOG_MIN_PERIOD_US (10 * 1000)      // deadlines are checked four times per timeout, within these bounds
+#define WATCHDOG_MAX_PERIOD_US G_USEC_PER_SEC
+
+typedef enum watch_state_t {
+    WATCH_IDLE,             // no file, or between the read sections of a file
+    WATCH_READING,          // in a read section: the deadline runs
+    WATCH_ABANDONED,        // given up while reading, on_timeout not done yet
+    WATCH_REPORTED          // given up and reported, until the worker is done with the file
+} WatchState;
+
+// One per thread that worked on a file; kept until the watchdog is freed
+typedef struct io_watch_t {
+    IoWatchdog *watchdog;
+    gint state;             // atomic WatchState
+    gsize last_progress;    // atomic: monotonic time (us) of the start of the read section or of the last block
+    const gchar *path;      // current file, set while idle
+    gpointer data;
+} IoWatch;
+
+struct io_watchdog_t {
+    guint64 id;             // threads cache their watch by id, addresses get reused
+    gint64 timeout_us;
+    IoTimeoutFunc on_timeout;
+    gpointer user_data;
+    GPtrArray *watches;     // protected by lock
+    gint stuck;             // atomic
+    gboolean stop;          // protected by lock
+    GMutex lock;
+    GCond cond;
+    GCond reported_cond;    // a watch went from WATCH_ABANDONED to WATCH_REPORTED
+    GThread *thread;
+};
+
+static __thread IoWatch *thread_watch = NULL;           // watch of the current file, NULL without a deadline
+static __thread IoWatch *thread_cached_watch = NULL;
+static __thread guint64 thread_cached_owner = 0;
+static guint64 next_watchdog_id = 0;    // protected by watchdog_id_lock
+G_LOCK_DEFINE_STATIC (watchdog_id_lock);
+
+
+static gpointer
+watchdog_thread (gpointer data)
+{
+    IoWatchdog *watchdog = (IoWatchdog *)data;
+    gint64 period = CLAMP(watchdog->timeout_us / 4, WATCHDOG_MIN_PERIOD_US, WATCHDOG_MAX_PERIOD_US);
+    GPtrArray *expired = g_ptr_array_new ();
+
+    g_mutex_lock (&watchdog->lock);
+    while (!watchdog->stop) {
+        g_cond_wait_until (&watchdog->cond, &watchdog->lock, g_get_monotonic_time () + period);
+        gint64 now = g_get_monotonic_time ();
+        for (guint i = 0; i < watchdog->watches->len; i++) {
+            IoWatch *watch = g_ptr_array_index (watchdog->watches, i);
+            // The time is read after the state: a section that started since then has a later one
+            if (g_atomic_int_get (&watch->state) != WATCH_READING) continue;
+            gint64 last_progress = (gint64)g_atomic_pointer_get (&watch->last_progress);
+            if (now - last_progress < watchdog->timeout_us) continue;
+            if (!g_atomic_int_compare_and_exchange (&watch->state, WATCH_READING, WATCH_ABANDONED)) continue;
+
+            g_atomic_int_inc (&watchdog->stuck);
+            g_ptr_array_add (expired, watch);
+        }
+        if (expired->len == 0) continue;
+
+        // Outside of the lock: on_timeout may wait for a slow consumer (report, socket client), and neither the
+        // workers nor the other deadlines must wait for it. The worker of an abandoned watch waits in
+        // io_watch_file_end() until the watch is reported, so path and data stay valid.
+        g_mutex_unlock (&watchdog->lock);
+        for (guint i = 0; i < expired->len; i++) {
+            IoWatch *watch = g_ptr_array_index (expired, i);
+            watchdog->on_timeout (watch->path, watch->data, watchdog->user_data);
+        }
+        g_mutex_lock (&watchdog->lock);
+        for (guint i = 0; i < expired->len; i++) {
+            IoWatch *watch = g_ptr_array_index (expired, i);
+            g_atomic_int_set (&watch->state, WATCH_REPORTED);
+        }
+        g_cond_broadcast (&watchdog->reported_cond);
+        g_ptr_array_set_size (expired, 0);
+    }
+    g_mutex_unlock (&watchdog->lock);
+    g_ptr_array_free (expired, TRUE);
+
+    return NULL;
+}
+
+
+IoWatchdog *
+io_watchdog_new (guint64        timeout_us,
+                 IoTimeoutFunc  on_timeout,
+                 gpointer       user_data)
+{
+    IoWatchdog *watchdog = g_new0 (IoWatchdog, 1);
+    G_LOCK (watchdog_id_lock);
+    watchdog->id = ++next_watchdog_id;
+    G_UNLOCK (watchdog_id_lock);
+
+    watchdog->timeout_us = (gint64)timeout_us;
+    watchdog->on_timeout = on_timeout;
+    watchdog->user_data = user_data;
+    watchdog->watches = g_ptr_array_new_with_free_func (g_free);
+    g_mutex_init (&watchdog->lock);
+    g_cond_init (&watchdog->cond);
+    g_cond_init (&watchdog->reported_cond);
+    watchdog->thread = g_thread_new ("io-watchdog", watchdog_thread, watchdog);
+
+    return watchdog;
+}
+
+
+guint
+io_watchdog_stuck (IoWatchdog *watchdog)
+{
+    return watchdog ? (guint)g_atomic_int_get (&watchdog->stuck) : 0;
+}
+
+
+void
+io_watchdog_free (IoWatchdog *watchdog)
+{
+    if (!watchdog) return;
+
+    g_mutex_lock (&watchdog->lock);
+    watchdog->stop = TRUE;
+    g_cond_signal (&watchdog->cond);
+    g_mutex_unlock (&watchdog->lock);
+    g_thread_join (watchdog->thread);
+
+    g_ptr_array_free (watchdog->watches, TRUE);
+    g_mutex_clear (&watchdog->lock);
+    g_cond_clear (&watchdog->cond);
+    g_cond_clear (&watchdog->reported_cond);
+    g_free (watchdog);
+}
+
+
+void
+io_watch_file_begin (IoWatchdog  *watchdog,
+                     const gchar *path,
+                     gpointer     data)
+{
+    if (watchdog == NULL) {
+        thread_watch = NULL;
+        return;
+    }
+
+    if (G_UNLIKELY (thread_cached_owner != watchdog->id)) {
+        IoWatch *watch = g_new0 (IoWatch, 1);
+        watch->watchdog = watchdog;
+        g_mutex_lock (&watchdog->lock);
+        g_ptr_array_add (watchdog->watches, watch);
+        g_mutex_unlock (&watchdog->lock);
+        thread_cached_watch = watch;
+        thread_cached_owner = watchdog->id;
+    }
+
+    // Idle: the watchdog doesn't look at them
+    thread_watch = thread_cached_watch;
+    thread_watch->path = path;
+    thread_watch->data = data;
+}
+
+
+gboolean
+io_watch_file_end (void)
+{
+    IoWatch *watch = thread_watch;
+    if (watch == NULL) return TRUE;
+    thread_watch = NULL;
+
+    // A section left open is closed here; only a reading watch can be given up
+    if (g_atomic_int_compare_and_exchange (&watch->state, WATCH_READING, WATCH_IDLE) ||
+        g_atomic_int_get (&watch->state) == WATCH_IDLE) {
+        return TRUE;
+    }
+
+    // Given up: wait for on_timeout to return before the caller frees the data it was given
+    IoWatchdog *watchdog = watch->watchdog;
+    g_mutex_lock (&watchdog->lock);
+    while (g_atomic_int_get (&watch->state) == WATCH_ABANDONED) {
+        g_cond_wait (&watchdog->reported_cond, &watchdog->lock);
+    }
+    g_atomic_int_set (&watch->state, WATCH_IDLE);
+    g_mutex_unlock (&watchdog->lock);
+    g_atomic_int_add (&watchdog->stuck, -1);
+
+    return FALSE;
+}
+
+
+void
+io_watch_read_begin (void)
+{
+    IoWatch *watch = thread_watch;
+    if (watch == NULL) return;
+
+    // The time first: the watchdog reads it once it sees the section
+    g_atomic_pointer_set (&watch->last_progress, (gsize)g_get_monotonic_time ());
+    // A file that was given up stays so
+    g_atomic_int_compare_and_exchange (&watch->state, WATCH_IDLE, WATCH_READING);
+}
+
+
+gboolean
+io_watch_progress (void)
+{
+    IoWatch *watch = thread_watch;
+    if (watch == NULL) return TRUE;
+
+    g_atomic_pointer_set (&watch->last_progress, (gsize)g_get_monotonic_time ());
+    return g_atomic_int_get (&watch->state) < WATCH_ABANDONED;
+}
+
+
+gboolean
+io_watch_read_end (void)
+{
+    IoWatch *watch = thread_watch;
+    if (watch == NULL) return TRUE;
+
+    g_atomic_int_compare_and_exchange (&watch->state, WATCH_READING, WATCH_IDLE);
+    return g_atomic_int_get (&watch->state) < WATCH_ABANDONED;
+}
+
+
+gboolean
+io_watch_abandoned (void)
+{
+    IoWatch *watch = thread_watch;
+    return watch != NULL && g_atomic_int_get (&watch->state) >= WATCH_ABANDONED;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <glib.h>
+
+// Per-file read deadlines. A worker announces the file it works on and wraps the reads of it (open, stat, hashing)
+// in read sections, reporting progress after every block. A watchdog thread gives up on a file whose read section
+// made no progress within the timeout and reports it through on_timeout while the worker is still blocked; the
+// worker drops the file once its read returns. Blocked reads can't be cancelled (page faults of mapped files, reads
+// from a hung network mount), so the worker thread itself stays lost until the kernel lets it go.
+typedef struct io_watchdog_t IoWatchdog;
+
+// Called on the watchdog thread, without holding any lock of the watchdog, with the path and data given to
+// io_watch_file_begin(). The worker can't finish the file during the call, so both stay valid.
+typedef void (*IoTimeoutFunc) (const gchar *path,
+                               gpointer     data,
+                               gpointer     user_data);
+
+IoWatchdog *io_watchdog_new     (guint64        timeout_us,
+                                 IoTimeoutFunc  on_timeout,
+                                 gpointer       user_data);
+
+// Workers still blocked in a file that was given up (0 for a NULL watchdog)
+guint       io_watchdog_stuck   (IoWatchdog    *watchdog);
+
+// Only once no worker is stuck: they still use the watchdog when their read returns
+void        io_watchdog_free    (IoWatchdog    *watchdog);
+
+// The calling thread starts on a file. watchdog may be NULL (no deadline): the calls below do nothing then.
+void        io_watch_file_begin (IoWatchdog    *watchdog,
+                                 const gchar   *path,
+                                 gpointer       data);
+
+// FALSE when the file was given up: on_timeout has reported it, nothing else must be
+gboolean    io_watch_file_end   (void);
+
+// Starts the deadline of the current file
+void        io_watch_read_begin (void);
+
+// Called after every block read; FALSE once the file was given up: stop reading it
+gboolean    io_watch_progress   (void);
+
+// Stops the deadline. FALSE when the file was given up: the caller must not record anything about it, nor
+// touch the state of its run (which may be over)
+gboolean    io_watch_read_end   (void);
+
+gboolean    io_watch_abandoned  (void);
@@ -1,10 +1,46 @@
 #include <glib.h>
 #include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "config.h"
+#include "logging.h"
 
+#define LOG_INLINE_MESSAGE_SIZE 224         // longer messages are copied to the heap
+#define LOG_FILE_BUFFER_SIZE    (256 * 1024)
+#define LOG_IDLE_SLEEP_MAX_US   5000
+#define LOG_PRODUCER_WAIT_US    G_USEC_PER_SEC  // cleanup_logger() waits this long for handlers still pushing
 
-static GMutex log_mutex;
+typedef struct log_slot_t {
+    gsize sequence;                 // atomic: slot is free for position p when == p, readable when == p + 1
+    gint64 time_us;
+    GLogLevelFlags level;
+    gchar *long_message;
+    gchar message[LOG_INLINE_MESSAGE_SIZE];
+} LogSlot;
+
+// Bounded multi-producer/single-consumer ring: producers claim a position with a CAS and never block each other
+typedef struct log_ring_t {
+    LogSlot *slots;
+    gsize mask;
+    gsize enqueue_pos;              // atomic
+    gsize dequeue_pos;              // atomic: only advanced by the writer thread
+    gint dropped;                   // atomic
+    gboolean drop_on_overflow;
+    gboolean stop;                  // atomic
+    GThread *writer;
+    ConfigData config;              // private copy of the logging settings, the caller may free its config first
+} LogRing;
+
+static GMutex log_mutex;            // held by the writer per batch and by the synchronous paths, never by producers
 static FILE *cached_log_file = NULL;
+static LogRing *log_ring = NULL;
+static gint log_producers = 0;      // atomic: handlers that may be using log_ring
+static gint log_closed = FALSE;     // atomic: set by cleanup_logger(), the config given to log_handler() may be gone
+
+// Protected by log_mutex
+static gint64 cached_second = -1;
+static gchar cached_timestamp[32];
 
 
 static void
@@ -13,76 +49,273 @@ ensure_log_file_open (const char *log_path)
     if (cached_log_file == NULL) {
         cached_log_file = g_fopen (log_path, "a");
         if (cached_log_file) {
-            setvbuf (cached_log_file, NULL, _IOLBF, 0);
+            setvbuf (cached_log_file, NULL, _IOFBF, LOG_FILE_BUFFER_SIZE);
         }
     }
 }
 
 
-void
-cleanup_logger (void)
+static const gchar *
+format_timestamp (gint64 time_us)
 {
-    if (cached_log_file) {
-        fclose (cached_log_file);
-        cached_log_file = NULL;
+    gint64 second = time_us / G_USEC_PER_SEC;
+    if (second != cached_second) {
+        time_t t = (time_t)second;
+        struct tm tm;
+        localtime_r (&t, &tm);
+        strftime (cached_timestamp, sizeof(cached_timestamp), "%Y-%m-%d %H:%M:%S", &tm);
+        cached_second = second;
     }
+    return cached_timestamp;
 }
 
 
-void
-log_handler (const gchar    *log_domain __attribute__((unused)),
-             GLogLevelFlags  log_level,
-             const gchar    *message,
-             gpointer        user_data)
+static const gchar *
+level_to_string (GLogLevelFlags log_level)
+{
+    switch (log_level & G_LOG_LEVEL_MASK) {
+        case G_LOG_LEVEL_ERROR:    return "ERROR";
+        case G_LOG_LEVEL_CRITICAL: return "CRITICAL";
+        case G_LOG_LEVEL_WARNING:  return "WARNING";
+        case G_LOG_LEVEL_MESSAGE:  return "MESSAGE";
+        case G_LOG_LEVEL_INFO:     return "INFO";
+        case G_LOG_LEVEL_DEBUG:    return "DEBUG";
+        default:                   return "UNKNOWN";
+    }
+}
+
+
+static void
+write_message (ConfigData     *config,
+               GLogLevelFlags  log_level,
+               gint64          time_us,
+               const gchar    *message)
 {
     // Always print ERROR and WARNING messages to stderr
     if (log_level & (G_LOG_LEVEL_ERROR | G_LOG_LEVEL_WARNING)) {
         g_printerr ("[%s] %s\n", log_level & G_LOG_LEVEL_ERROR ? "ERROR" : "WARNING", message);
     }
 
+    if (!config) return;
+
     // In verbose mode, also echo INFO/DEBUG/MESSAGE to stdout for live feedback
-    if (user_data) {
-        ConfigData *cfg = (ConfigData *)user_data;
-        if (cfg->verbose) {
-            GLogLevelFlags level = (log_level & G_LOG_LEVEL_MASK);
-            if (level == G_LOG_LEVEL_INFO || level == G_LOG_LEVEL_DEBUG || level == G_LOG_LEVEL_MESSAGE) {
-                g_print ("%s\n", message);
-            }
+    if (config->verbose) {
+        GLogLevelFlags level = (log_level & G_LOG_LEVEL_MASK);
+        if (level == G_LOG_LEVEL_INFO || level == G_LOG_LEVEL_DEBUG || level == G_LOG_LEVEL_MESSAGE) {
+            g_print ("%s\n", message);
         }
     }
 
-    if (!user_data) return;
-
-    ConfigData *config = (ConfigData *)user_data;
     if (!config->logging_enabled || !config->log_path) return;
 
+    ensure_log_file_open (config->log_path);
+    if (!cached_log_file) return;
+
+    fprintf (cached_log_file, "[%s] %s: %s\n", format_timestamp (time_us), level_to_string (log_level), message);
+}
+
+
+static gboolean
+ring_try_push (LogRing        *ring,
+               GLogLevelFlags  log_level,
+               const gchar    *message)
+{
+    gsize pos = g_atomic_pointer_get (&ring->enqueue_pos);
+    LogSlot *slot;
+
+    while (TRUE) {
+        slot = &ring->slots[pos & ring->mask];
+        gssize diff = (gssize)g_atomic_pointer_get (&slot->sequence) - (gssize)pos;
+        if (diff == 0) {
+            if (g_atomic_pointer_compare_and_exchange (&ring->enqueue_pos, pos, pos + 1)) break;
+            pos = g_atomic_pointer_get (&ring->enqueue_pos);
+        } else if (diff < 0) {
+            return FALSE;   // full: the writer has not released this slot yet
+        } else {
+            pos = g_atomic_pointer_get (&ring->enqueue_pos);
+        }
+    }
+
+    slot->time_us = g_get_real_time ();
+    slot->level = log_level;
+    gsize len = strlen (message);
+    if (len < LOG_INLINE_MESSAGE_SIZE) {
+        memcpy (slot->message, message, len + 1);
+        slot->long_message = NULL;
+    } else {
+        slot->long_message = g_strndup (message, len);
+    }
+    g_atomic_pointer_set (&slot->sequence, pos + 1);
+
+    return TRUE;
+}
+
+
+// Writes out everything that is currently readable; returns the number of messages written
+static guint
+ring_drain (LogRing *ring)
+{
+    guint written = 0;
+
     g_mutex_lock (&log_mutex);
+    while (TRUE) {
+        LogSlot *slot = &ring->slots[ring->dequeue_pos & ring->mask];
+        if (g_atomic_pointer_get (&slot->sequence) != ring->dequeue_pos + 1) break;
 
-    ensure_log_file_open (config->log_path);
-    if (!cached_log_file) {
-        g_mutex_unlock (&log_mutex);
+        write_message (&ring->config, slot->level, slot->time_us, slot->long_message ? slot->long_message : slot->message);
+        g_free (slot->long_message);
+        slot->long_message = NULL;
+
+        g_atomic_pointer_set (&slot->sequence, ring->dequeue_pos + ring->mask + 1);
+        g_atomic_pointer_set (&ring->dequeue_pos, ring->dequeue_pos + 1);
+        written++;
+    }
+
+    gint dropped = g_atomic_int_get (&ring->dropped);
+    if (dropped > 0) {
+        g_atomic_int_add (&ring->dropped, -dropped);
+        gchar *notice = g_strdup_printf ("%d log messages dropped: the log buffer was full", dropped);
+        write_message (&ring->config, G_LOG_LEVEL_WARNING, g_get_real_time (), notice);
+        g_free (notice);
+        written++;
+    }
+
+    if (written > 0 && cached_log_file) fflush (cached_log_file);
+    g_mutex_unlock (&log_mutex);
+
+    return written;
+}
+
+
+static gpointer
+log_writer (gpointer data)
+{
+    LogRing *ring = (LogRing *)data;
+    gulong sleep_us = 100;
+
+    while (TRUE) {
+        if (ring_drain (ring) > 0) {
+            sleep_us = 100;
+            continue;
+        }
+        if (g_atomic_int_get (&ring->stop)) {
+            ring_drain (ring);
+            break;
+        }
+        g_usleep (sleep_us);
+        if (sleep_us < LOG_IDLE_SLEEP_MAX_US) sleep_us = MIN (sleep_us * 2, LOG_IDLE_SLEEP_MAX_US);
+    }
+
+    return NULL;
+}
+
+
+void
+init_logger (ConfigData *config_data)
+{
+    if (log_ring) return;
+
+    LogRing *ring = g_try_new0 (LogRing, 1);
+    if (!ring) return;
+
+    // Round up to a power of two so that positions map to slots with a mask
+    gsize capacity = 1;
+    while (capacity < config_data->log_buffer_entries) capacity <<= 1;
+    ring->slots = g_try_malloc0_n (capacity, sizeof(LogSlot));
+    if (!ring->slots) {
+        g_free (ring);
         return;
     }
+    for (gsize i = 0; i < capacity; i++) {
+        ring->slots[i].sequence = i;
+    }
+    ring->mask = capacity - 1;
+    ring->drop_on_overflow = config_data->log_drop_on_overflow;
+    ring->config.verbose = config_data->verbose;
+    ring->config.logging_enabled = config_data->logging_enabled;
+    ring->config.log_path = g_strdup (config_data->log_path);
 
-    GDateTime *now = g_date_time_new_now_local ();
-    gchar *timestamp = g_date_time_format (now, "%Y-%m-%d %H:%M:%S");
+    g_mutex_lock (&log_mutex);
+    ring->writer = g_thread_new ("log-writer", log_writer, ring);
+    log_ring = ring;
+    g_mutex_unlock (&log_mutex);
 
-    const gchar *level_str;
-    switch (log_level & G_LOG_LEVEL_MASK) {
-        case G_LOG_LEVEL_ERROR:    level_str = "ERROR"; break;
-        case G_LOG_LEVEL_CRITICAL: level_str = "CRITICAL"; break;
-        case G_LOG_LEVEL_WARNING:  level_str = "WARNING"; break;
-        case G_LOG_LEVEL_MESSAGE:  level_str = "MESSAGE"; break;
-        case G_LOG_LEVEL_INFO:     level_str = "INFO"; break;
-        case G_LOG_LEVEL_DEBUG:    level_str = "DEBUG"; break;
-        default:                   level_str = "UNKNOWN";
+    // Early returns from main() must not lose queued messages
+    atexit (cleanup_logger);
+}
+
+
+void
+cleanup_logger (void)
+{
+    g_mutex_lock (&log_mutex);
+    LogRing *ring = log_ring;
+    g_atomic_pointer_set (&log_ring, NULL);
+    g_atomic_int_set (&log_closed, TRUE);
+    g_mutex_unlock (&log_mutex);
+
+    if (ring) {
+        // Handlers that loaded the ring count themselves first: once the count drops to 0 no one can touch it.
+        // The writer keeps draining meanwhile, so that handlers waiting for a free slot get one.
+        gint64 deadline = g_get_monotonic_time () + LOG_PRODUCER_WAIT_US;
+        while (g_atomic_int_get (&log_producers) > 0 && g_get_monotonic_time () < deadline) {
+            g_usleep (100);
+        }
+        g_atomic_int_set (&ring->stop, TRUE);
+        g_thread_join (ring->writer);
+        // A handler still inside (a worker thread that was left behind) may write to the ring: keep it
+        if (g_atomic_int_get (&log_producers) == 0) {
+            g_free (ring->config.log_path);
+            g_free (ring->slots);
+            g_free (ring);
+        }
     }
 
-    fprintf (cached_log_file, "[%s] %s: %s\n", timestamp, level_str, message);
-    fflush (cached_log_file);
+    g_mutex_lock (&log_mutex);
+    if (cached_log_file) {
+        fclose (cached_log_file);
+        cached_log_file = NULL;
+    }
+    g_mutex_unlock (&log_mutex);
+}
 
-    g_date_time_unref (now);
-    g_free (timestamp);
 
+void
+log_handler (const gchar    *log_domain __attribute__((unused)),
+             GLogLevelFlags  log_level,
+             const gchar    *message,
+             gpointer        user_data)
+{
+    // Counted before loading the ring, so that cleanup_logger() either sees the count or this handler sees no ring
+    g_atomic_int_inc (&log_producers);
+    LogRing *ring = g_atomic_pointer_get (&log_ring);
+    gboolean fatal = (log_level & (G_LOG_FLAG_FATAL | G_LOG_LEVEL_ERROR)) != 0;
+
+    if (ring && !fatal) {
+        while (!ring_try_push (ring, log_level, message)) {
+            if (ring->drop_on_overflow || g_atomic_int_get (&ring->stop)) {
+                g_atomic_int_inc (&ring->dropped);
+                break;
+            }
+            g_usleep (50);
+        }
+        g_atomic_int_add (&log_producers, -1);
+        return;
+    }
+
+    // GLib aborts right after a fatal message: let the writer catch up, then write it synchronously
+    if (ring) {
+        gint64 deadline = g_get_monotonic_time () + G_USEC_PER_SEC;
+        while (g_atomic_pointer_get (&ring->enqueue_pos) != g_atomic_pointer_get (&ring->dequeue_pos) && g_get_monotonic_time () < deadline) {
+            g_usleep (100);
+        }
+    }
+    g_atomic_int_add (&log_producers, -1);
+
+    // After cleanup_logger() only stderr is left: the file is closed and the config may have been freed
+    g_mutex_lock (&log_mutex);
+    ConfigData *config = g_atomic_int_get (&log_closed) ? NULL : (ConfigData *)user_data;
+    write_message (config, log_level, g_get_real_time (), message);
+    if (cached_log_file) fflush (cached_log_file);
     g_mutex_unlock (&log_mutex);
-}
\ No newline at end of file
+}
@@ -1,10 +1,15 @@
 #pragma once
 
 #include <glib.h>
+#include "config.h"
+
+// Starts the background log writer; log_handler() falls back to writing synchronously until then
+void init_logger    (ConfigData     *config_data);
 
 void log_handler    (const gchar    *log_domain,
                      GLogLevelFlags  log_level,
                      const gchar    *message,
                      gpointer        user_data);
 
-void cleanup_logger (void);
\ No newline at end of file
+// Drains all pending messages and stops the writer; later messages only go to stderr
+void cleanup_logger (void);
@@ -1,12 +1,12 @@
 #include <glib.h>
+#include <glib/gstdio.h>
 #include "config.h"
-#include "database.h"
-#include "process_directories.h"
-#include "queue.h"
-#include "process_file.h"
-#include "version.h"
+#include "ffc.h"
 #include "logging.h"
+#include "report.h"
+#include "server.h"
 #include "summary.h"
+#include "version.h"
 
 
 void
@@ -14,68 +14,137 @@ show_help(const gchar *prog_name)
 {
     g_print ("Project URL: https://github.com/paolostivanin/FastFileCheck\n\n");
     g_print ("Usage:\n");
-    g_print ("  %s [OPTIONS] COMMAND\n\n", prog_name);
+    g_print ("  %s [OPTIONS] COMMAND [FILE]\n\n", prog_name);
     g_print ("Commands:\n");
     g_print ("  add     Add files to the database\n");
     g_print ("  check   Check files against the database\n");
-    g_print ("  update  Remove/update files in the database\n\n");
+    g_print ("  update  Remove/update files in the database\n");
+    g_print ("  merge   Merge a sharded database into a single database at db_path; with FILE..., merge the databases\n");
+    g_print ("          (directories) and change reports (files) written by --shard runs into db_path and --report\n");
+    g_print ("  duplicates  List the files stored with identical content (no file is read)\n");
+    g_print ("  compact Rewrite the database without its free pages (nothing else may use it meanwhile)\n");
+    g_print ("  export  Write a portable, sorted and checksummed dump of the database to FILE ('-' or none for stdout)\n");
+    g_print ("  import  Load a dump from FILE ('-' or none for stdin) into an empty database\n");
+    g_print ("  diff    Compare the database with the one at FILE (e.g. a replica): '-' only here, '+' only in FILE, '~' changed\n");
+    g_print ("  serve   Keep the database and workers open and serve requests on a Unix socket\n\n");
     g_print ("Options:\n");
     g_print ("  -h, --help      Show this help message and exit\n");
     g_print ("  -v, --version   Show version information and exit\n");
     g_print ("  -c, --config    Path to config file (default: /etc/ffc.conf)\n");
     g_print ("  -V, --verbose   Verbose output with heartbeat/progress\n");
+    g_print ("  --time-budget DURATION  check: limit full-content hashing to DURATION (e.g. 90m, 2h), oldest-verified files first\n");
+    g_print ("  --byte-budget SIZE      check: limit full-content hashing to SIZE bytes (e.g. 500G), oldest-verified files first\n");
+    g_print ("  --report PATH           check: stream every change as NDJSON to PATH ('-' for stdout) as soon as it is detected\n");
+    g_print ("  --files-from FILE       add/check/update only the paths listed in FILE ('-' for stdin), one per line, instead of scanning directories\n");
+    g_print ("  -0, --null              --files-from: paths are separated by NUL characters (e.g. find -print0)\n");
+    g_print ("  --socket PATH           serve: listen on PATH instead of the configured socket_path\n");
+    g_print ("  --shard I/N             split the top-level entries of the directories between N hosts and only process\n");
+    g_print ("                          slice I (0 <= I < N), into the database db_path.slice-I-of-N\n");
 }
 
 
 static void
-worker_thread (gpointer data,
-               gpointer user_data)
+print_to_stderr (const gchar *string)
 {
-    gchar *file_path = (gchar *)data;
-    ConsumerData *consumer_data = (ConsumerData *)user_data;
-    process_file (file_path, consumer_data);
+    fputs (string, stderr);
 }
 
 
-static gpointer
-queue_consumer(gpointer data)
+static void
+print_difference (const gchar *path,
+                  DbDiffKind   kind,
+                  gpointer     user_data __attribute__((unused)))
 {
-    ConsumerData *consumer_data = (ConsumerData *)data;
-    while (TRUE) {
-        gchar *file_path = g_async_queue_try_pop (consumer_data->file_queue_data->queue);
-        if (file_path == NULL) {
-            if (consumer_data->file_queue_data->scanning_done) {
-                // Drain any remaining items
-                while ((file_path = g_async_queue_try_pop (consumer_data->file_queue_data->queue)) != NULL) {
-                    g_thread_pool_push (consumer_data->thread_pool, file_path, NULL);
-                }
-                break;
-            }
-            g_usleep (1000);
-        }
-        if (file_path != NULL) g_thread_pool_push (consumer_data->thread_pool, file_path, NULL);
+    static const gchar marks[] = { [DB_DIFF_ONLY_HERE] = '-', [DB_DIFF_ONLY_OTHER] = '+', [DB_DIFF_CHANGED] = '~' };
+    g_print ("%c %s\n", marks[kind], path);
+}
+
+
+typedef struct duplicates_total_t {
+    guint64 copies;
+    guint64 reclaimable;
+} DuplicatesTotal;
+
+
+static void
+print_duplicates (guint64          hash,
+                  goffset          size,
+                  const GPtrArray *paths,
+                  gpointer         user_data)
+{
+    DuplicatesTotal *total = user_data;
+    gchar *size_str = g_format_size ((guint64)size);
+    g_print ("%s, hash %016" G_GINT64_MODIFIER "x, %u files:\n", size_str, hash, paths->len);
+    for (guint i = 0; i < paths->len; i++) {
+        g_print ("  %s\n", (const gchar *)g_ptr_array_index (paths, i));
     }
-    return NULL;
+    g_free (size_str);
+
+    total->copies += paths->len - 1;
+    total->reclaimable += (guint64)size * (paths->len - 1);
 }
 
-static gpointer
-progress_reporter (gpointer data)
+
+static gboolean
+parse_scaled_value (const gchar   *value,
+                    const gchar   *units,
+                    const guint64 *factors,
+                    guint64        default_factor,
+                    guint64       *out)
 {
-    ConsumerData *consumer_data = (ConsumerData *)data;
-    // Periodically report progress until work is done
-    while (TRUE) {
-        g_usleep (2 * 1000 * 1000);
-        guint qlen = (guint)g_async_queue_length (consumer_data->file_queue_data->queue);
-        gboolean done = consumer_data->file_queue_data->scanning_done;
-        guint unprocessed = g_thread_pool_unprocessed (consumer_data->thread_pool);
-        g_message ("Progress: processed=%u, queue=%u, pending=%u, scanning_done=%s",
-                   summary_get_processed (consumer_data->summary_data),
-                   qlen,
-                   unprocessed,
-                   done ? "yes" : "no");
-        if (done && qlen == 0 && unprocessed == 0) break;
+    gchar *end = NULL;
+    guint64 number = g_ascii_strtoull (value, &end, 10);
+    if (end == value) return FALSE;
+
+    guint64 factor = default_factor;
+    if (*end != '\0') {
+        const gchar *unit = strchr (units, g_ascii_tolower (*end));
+        if (unit == NULL || end[1] != '\0') return FALSE;
+        factor = factors[unit - units];
     }
-    return NULL;
+    if (number > G_MAXUINT64 / factor) return FALSE;
+
+    *out = number * factor;
+    return TRUE;
+}
+
+
+static gboolean
+parse_duration_us (const gchar *value,
+                   guint64     *out)
+{
+    static const guint64 factors[] = { G_USEC_PER_SEC, 60ULL * G_USEC_PER_SEC, 3600ULL * G_USEC_PER_SEC, 86400ULL * G_USEC_PER_SEC };
+    // Plain numbers are seconds
+    return parse_scaled_value (value, "smhd", factors, G_USEC_PER_SEC, out);
+}
+
+
+// "I/N" with 0 <= I < N
+static gboolean
+parse_slice (const gchar *value,
+             guint       *index,
+             guint       *count)
+{
+    gchar *end = NULL;
+    guint64 i = g_ascii_strtoull (value, &end, 10);
+    if (end == value || *end != '/') return FALSE;
+
+    const gchar *n_str = end + 1;
+    guint64 n = g_ascii_strtoull (n_str, &end, 10);
+    if (end == n_str || *end != '\0' || n == 0 || n > G_MAXUINT || i >= n) return FALSE;
+
+    *index = (guint)i;
+    *count = (guint)n;
+    return TRUE;
+}
+
+
+static gboolean
+parse_size_bytes (const gchar *value,
+                  guint64     *out)
+{
+    static const guint64 factors[] = { 1ULL << 10, 1ULL << 20, 1ULL << 30, 1ULL << 40 };
+    return parse_scaled_value (value, "kmgt", factors, 1, out);
 }
 
 
@@ -85,6 +154,13 @@ main (int argc, char *argv[])
     // Basic option parsing: allow --help/--version/--config PATH/--verbose before COMMAND
     const char *config_path = NULL;
     gboolean verbose_flag = FALSE;
+    guint64 time_budget_us = 0;
+    guint64 byte_budget = 0;
+    const char *report_path = NULL;
+    const char *files_from = NULL;
+    gboolean null_separated = FALSE;
+    const char *socket_path = NULL;
+    guint slice_index = 0, slice_count = 0;
 
     int i = 1;
     while (i < argc && argv[i][0] == '-') {
@@ -106,6 +182,55 @@ main (int argc, char *argv[])
             verbose_flag = TRUE;
             i++;
             continue;
+        } else if (g_strcmp0 (argv[i], "--time-budget") == 0) {
+            if (i + 1 >= argc || !parse_duration_us (argv[i + 1], &time_budget_us) || time_budget_us == 0) {
+                show_help (argv[0]);
+                return -1;
+            }
+            i += 2;
+            continue;
+        } else if (g_strcmp0 (argv[i], "--byte-budget") == 0) {
+            if (i + 1 >= argc || !parse_size_bytes (argv[i + 1], &byte_budget) || byte_budget == 0) {
+                show_help (argv[0]);
+                return -1;
+            }
+            i += 2;
+            continue;
+        } else if (g_strcmp0 (argv[i], "--report") == 0) {
+            if (i + 1 >= argc) {
+                show_help (argv[0]);
+                return -1;
+            }
+            report_path = argv[i + 1];
+            i += 2;
+            continue;
+        } else if (g_strcmp0 (argv[i], "--files-from") == 0) {
+            if (i + 1 >= argc) {
+                show_help (argv[0]);
+                return -1;
+            }
+            files_from = argv[i + 1];
+            i += 2;
+            continue;
+        } else if (g_strcmp0 (argv[i], "--socket") == 0) {
+            if (i + 1 >= argc) {
+                show_help (argv[0]);
+                return -1;
+            }
+            socket_path = argv[i + 1];
+            i += 2;
+            continue;
+        } else if (g_strcmp0 (argv[i], "--shard") == 0) {
+            if (i + 1 >= argc || !parse_slice (argv[i + 1], &slice_index, &slice_count)) {
+                show_help (argv[0]);
+                return -1;
+            }
+            i += 2;
+            continue;
+        } else if (g_strcmp0 (argv[i], "-0") == 0 || g_strcmp0 (argv[i], "--null") == 0) {
+            null_separated = TRUE;
+            i++;
+            continue;
         } else {
             break;
         }
@@ -117,19 +242,43 @@ main (int argc, char *argv[])
     }
 
     const char *command = argv[i];
+    const char *dump_path = i + 1 < argc ? argv[i + 1] : "-";
+
+    // merge FILE...: databases (directories) and change reports
+    GPtrArray *merge_dbs = g_ptr_array_new ();
+    GPtrArray *merge_reports = g_ptr_array_new ();
+    if (g_strcmp0 (command, "merge") == 0) {
+        for (int j = i + 1; j < argc; j++) {
+            g_ptr_array_add (g_file_test (argv[j], G_FILE_TEST_IS_DIR) ? merge_dbs : merge_reports, argv[j]);
+        }
+        if (merge_reports->len > 0 && report_path == NULL) report_path = "-";
+    }
 
     ConfigData *config_data = load_config (config_path);
     if (config_data == NULL) return -1;
 
-    // Apply CLI verbose preference
+    // Apply CLI preferences
     config_data->verbose = verbose_flag;
+    config_data->time_budget_us = time_budget_us;
+    config_data->byte_budget = byte_budget;
+    if (slice_count > 0) config_set_slice (config_data, slice_index, slice_count);
+    if (socket_path) {
+        g_free (config_data->socket_path);
+        config_data->socket_path = g_strdup (socket_path);
+    }
     if (config_data->verbose) {
         if (!g_setenv ("G_MESSAGES_DEBUG", "all", TRUE)) {
             g_log (NULL, G_LOG_LEVEL_WARNING, "Failed to set G_MESSAGES_DEBUG environment variable; continuing without verbose GLib messages");
         }
     }
 
+    // Keep stdout clean for the NDJSON report or the dump: everything else goes to stderr
+    if (g_strcmp0 (report_path, "-") == 0 || (g_strcmp0 (command, "export") == 0 && g_strcmp0 (dump_path, "-") == 0)) {
+        g_set_print_handler (print_to_stderr);
+    }
+
     // Install logger now that config is loaded
+    init_logger (config_data);
     g_log_set_handler (NULL, G_LOG_LEVEL_MASK | G_LOG_FLAG_FATAL | G_LOG_FLAG_RECURSION, log_handler, config_data);
 
     // Start time and diagnostics
@@ -141,103 +290,124 @@ main (int argc, char *argv[])
     g_debug ("Threads: %u (worker threads)", config_data->threads_count);
     g_debug ("Usable RAM: %" G_GUINT64_FORMAT " bytes", config_data->usable_ram);
     g_debug ("Max RAM per thread: %" G_GUINT64_FORMAT " bytes", config_data->max_ram_per_thread);
-    g_debug ("DB path: %s (size: %u bytes)", config_data->db_path, config_data->db_size_bytes);
+    g_debug ("DB path: %s (size: %" G_GUINT64_FORMAT " bytes)", config_data->db_path, config_data->db_size_bytes);
     g_debug ("Directories: %s", config_data->directories);
     g_debug ("Max recursion depth: %u", config_data->max_recursion_depth);
     g_debug ("Exclude hidden: %s", config_data->exclude_hidden ? "yes" : "no");
 
+    Mode mode = 0;
+    gboolean serve = FALSE;
     if (g_strcmp0 (command, "add") == 0) {
-        config_data->mode = MODE_ADD;
+        mode = MODE_ADD;
     } else if (g_strcmp0 (command, "check") == 0) {
-        config_data->mode = MODE_CHECK;
+        mode = MODE_CHECK;
     } else if (g_strcmp0 (command, "update") == 0) {
-        config_data->mode = MODE_UPDATE;
+        mode = MODE_UPDATE;
+    } else if (g_strcmp0 (command, "merge") == 0) {
+        mode = MODE_MERGE;
+    } else if (g_strcmp0 (command, "duplicates") == 0) {
+        mode = MODE_DUPLICATES;
+    } else if (g_strcmp0 (command, "compact") == 0) {
+        mode = MODE_COMPACT;
+    } else if (g_strcmp0 (command, "export") == 0) {
+        mode = MODE_EXPORT;
+    } else if (g_strcmp0 (command, "import") == 0) {
+        mode = MODE_IMPORT;
+    } else if (g_strcmp0 (command, "diff") == 0 && i + 1 < argc) {
+        mode = MODE_DIFF;
+    } else if (g_strcmp0 (command, "serve") == 0) {
+        serve = TRUE;
     } else {
         show_help (argv[0]);
         return -1;
     }
+    config_data->mode = mode;
 
-    g_message ("Started %s at %s", config_data->mode == MODE_ADD ? "add" : config_data->mode == MODE_CHECK ? "check" : "update", start_ts);
+    g_message ("Started %s at %s", command, start_ts);
 
-    DatabaseData *db_data = init_db (config_data);
-    if (db_data == NULL) return -1;
-
-    FileQueueData *file_queue_data = init_file_queue (config_data->usable_ram);
-    if (!file_queue_data) {
-        free_db (db_data);
-        free_config (config_data);
-        return -1;
-    }
-    file_queue_data->scanning_done = FALSE;
-
-    ConsumerData *consumer_data = g_try_new0 (ConsumerData, 1);
-    if (!consumer_data) {
-        free_db (db_data);
-        free_config (config_data);
-        g_log (NULL, G_LOG_LEVEL_ERROR, "Failed to allocate memory for consumer_data");
-        return -1;
-    }
-    consumer_data->file_queue_data = file_queue_data;
-    consumer_data->config_data = config_data;
-    consumer_data->db_data = db_data;
-    consumer_data->summary_data = summary_new ();
-    if (consumer_data->summary_data == NULL) {
-        free_db (db_data);
-        free_config (config_data);
-        return -1;
-    }
-
-    GError *error = NULL;
-    GThreadPool *thread_pool = g_thread_pool_new (worker_thread, consumer_data, (gint32)config_data->threads_count, FALSE, &error);
-    if (error != NULL) {
-        g_log (NULL, G_LOG_LEVEL_ERROR, "Error creating the thread pool: %s", error->message);
-        g_error_free (error);
-        return -1;
+    FfcRunOptions options = { .report_path = report_path, .file_list = NULL, .null_separated = null_separated };
+    if (files_from) {
+        options.file_list = g_strcmp0 (files_from, "-") == 0 ? stdin : g_fopen (files_from, "r");
+        if (options.file_list == NULL) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "Failed to open the file list: %s", files_from);
+            return -1;
+        }
     }
-    consumer_data->thread_pool = thread_pool;
 
-    GThread *consumer_thread = g_thread_new ("queue-consumer", queue_consumer, consumer_data);
-    GThread *progress_thread = NULL;
-    if (config_data->verbose) {
-        progress_thread = g_thread_new ("progress-reporter", progress_reporter, consumer_data);
+    FILE *dump = NULL;
+    if (mode == MODE_EXPORT || mode == MODE_IMPORT) {
+        gboolean std_stream = g_strcmp0 (dump_path, "-") == 0;
+        if (mode == MODE_EXPORT) {
+            dump = std_stream ? stdout : g_fopen (dump_path, "wb");
+        } else {
+            dump = std_stream ? stdin : g_fopen (dump_path, "rb");
+        }
+        if (dump == NULL) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "Failed to open the dump: %s", dump_path);
+            return -1;
+        }
     }
 
-    gchar **dirs = g_strsplit (config_data->directories, ",", -1);
-    process_directories (dirs, config_data->max_recursion_depth, file_queue_data, config_data);
-    g_strfreev (dirs);
-
-    g_thread_join (consumer_thread);
-    if (progress_thread) g_thread_join (progress_thread);
-    g_thread_pool_free (thread_pool, FALSE, TRUE);
-
-    if (config_data->mode == MODE_CHECK) {
-        handle_missing_files_from_fs (db_data, consumer_data->summary_data, FALSE);
-    } else if (config_data->mode == MODE_UPDATE) {
-        handle_missing_files_from_fs (db_data, consumer_data->summary_data, TRUE);
+    FfcContext *ctx = ffc_context_new (config_data);
+    if (ctx == NULL) return -1;
+
+    int ret = 0;
+    if (serve) {
+        ret = server_run (ctx, config_data) ? 0 : -1;
+    } else if (mode == MODE_MERGE && (merge_dbs->len > 0 || merge_reports->len > 0)) {
+        if (merge_dbs->len > 0 && !ffc_merge_databases (ctx, (const gchar * const *)merge_dbs->pdata, merge_dbs->len)) ret = -1;
+        if (merge_reports->len > 0 && !report_merge ((const gchar * const *)merge_reports->pdata, merge_reports->len, report_path)) ret = -1;
+    } else if (mode == MODE_MERGE) {
+        ret = ffc_merge (ctx) ? 0 : -1;
+    } else if (mode == MODE_COMPACT) {
+        ret = ffc_compact (ctx) ? 0 : -1;
+    } else if (mode == MODE_EXPORT) {
+        ret = ffc_export (ctx, dump) >= 0 ? 0 : -1;
+    } else if (mode == MODE_IMPORT) {
+        ret = ffc_import (ctx, dump) >= 0 ? 0 : -1;
+    } else if (mode == MODE_DIFF) {
+        gint64 differences = ffc_diff (ctx, argv[i + 1], print_difference, NULL);
+        if (differences < 0) {
+            ret = -1;
+        } else {
+            g_print ("%" G_GINT64_FORMAT " differing records\n", differences);
+        }
+    } else if (mode == MODE_DUPLICATES) {
+        DuplicatesTotal total = { 0 };
+        guint64 groups = ffc_find_duplicates (ctx, print_duplicates, &total);
+        gchar *reclaimable = g_format_size (total.reclaimable);
+        g_print ("\n%" G_GUINT64_FORMAT " groups of identical files, %" G_GUINT64_FORMAT " redundant copies, %s reclaimable\n",
+                 groups, total.copies, reclaimable);
+        g_free (reclaimable);
+    } else {
+        SummaryData *summary_data = ffc_run (ctx, mode, &options);
+        if (summary_data == NULL) {
+            ret = -1;
+        } else {
+            // End time and duration
+            GDateTime *end_wall = g_date_time_new_now_local ();
+            gchar *end_ts = g_date_time_format (end_wall, "%Y-%m-%d %H:%M:%S %Z");
+            gint64 end_mono_us = g_get_monotonic_time ();
+            gdouble elapsed_sec = (end_mono_us - start_mono_us) / 1000000.0;
+            g_message ("Completed at %s (duration: %.2f s)", end_ts, elapsed_sec);
+            g_free (end_ts);
+            g_date_time_unref (end_wall);
+
+            print_summary (summary_data, mode);
+            report_close (summary_data->report);
+            free_summary (summary_data);
+        }
     }
+    if (options.file_list && options.file_list != stdin) fclose (options.file_list);
+    if (dump && dump != stdin && dump != stdout && fclose (dump) != 0) ret = -1;
+    g_ptr_array_free (merge_dbs, TRUE);
+    g_ptr_array_free (merge_reports, TRUE);
 
-    // End time and duration
-    GDateTime *end_wall = g_date_time_new_now_local ();
-    gchar *end_ts = g_date_time_format (end_wall, "%Y-%m-%d %H:%M:%S %Z");
-    gint64 end_mono_us = g_get_monotonic_time ();
-    gdouble elapsed_sec = (end_mono_us - start_mono_us) / 1000000.0;
-    g_message ("Completed at %s (duration: %.2f s)", end_ts, elapsed_sec);
-
-    print_summary (consumer_data->summary_data, config_data->mode);
-    free_summary (consumer_data->summary_data);
-
+    ffc_context_free (ctx);
     cleanup_logger ();
 
     g_free (start_ts);
     g_date_time_unref (start_wall);
-    g_free (end_ts);
-    g_date_time_unref (end_wall);
-
-    free_file_queue (file_queue_data);
-    free_config (config_data);
-    free_db (db_data);
-
-    g_free (consumer_data);
 
-    return 0;
+    return ret;
 }
@@ -0,0 +1,93 @@
+#include <glib.h>
+#include "memory_budget.h"
+
+struct memory_budget_t {
+    guint64 capacity;
+    guint64 in_use;         // protected by lock, like the counters below
+    guint64 peak;
+    guint64 waits;
+    GMutex lock;
+    GCond released;
+};
+
+
+MemoryBudget *
+memory_budget_new (guint64 capacity)
+{
+    MemoryBudget *budget = g_try_new0 (MemoryBudget, 1);
+    if (!budget) {
+        g_log (NULL, G_LOG_LEVEL_ERROR, "Failed to allocate memory for MemoryBudget");
+        return NULL;
+    }
+
+    budget->capacity = MAX (capacity, 1);
+    g_mutex_init (&budget->lock);
+    g_cond_init (&budget->released);
+
+    return budget;
+}
+
+
+guint64
+memory_budget_acquire (MemoryBudget *budget,
+                       guint64       want_bytes,
+                       guint64       min_bytes)
+{
+    // A single reservation never exceeds the capacity, otherwise it would wait forever
+    want_bytes = MIN (want_bytes, budget->capacity);
+    min_bytes = MIN (min_bytes, want_bytes);
+
+    g_mutex_lock (&budget->lock);
+    if (budget->capacity - budget->in_use < min_bytes) {
+        budget->waits++;
+        while (budget->capacity - budget->in_use < min_bytes) {
+            g_cond_wait (&budget->released, &budget->lock);
+        }
+    }
+    guint64 granted = MIN (want_bytes, budget->capacity - budget->in_use);
+    budget->in_use += granted;
+    budget->peak = MAX (budget->peak, budget->in_use);
+    g_mutex_unlock (&budget->lock);
+
+    return granted;
+}
+
+
+void
+memory_budget_release (MemoryBudget *budget,
+                       guint64       bytes)
+{
+    if (bytes == 0) return;
+
+    g_mutex_lock (&budget->lock);
+    budget->in_use -= bytes;
+    g_cond_broadcast (&budget->released);
+    g_mutex_unlock (&budget->lock);
+}
+
+
+void
+memory_budget_stats (MemoryBudget *budget,
+                     guint64      *capacity,
+                     guint64      *in_use,
+                     guint64      *peak,
+                     guint64      *waits)
+{
+    g_mutex_lock (&budget->lock);
+    *capacity = budget->capacity;
+    *in_use = budget->in_use;
+    *peak = budget->peak;
+    *waits = budget->waits;
+    g_mutex_unlock (&budget->lock);
+}
+
+
+void
+memory_budget_free (MemoryBudget *budget)
+{
+    if (!budget) return;
+
+    g_mutex_clear (&budget->lock);
+    g_cond_clear (&budget->released);
+    g_free (budget);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <glib.h>
+
+// Global budget for the file data held in memory by the workers at the same time (read buffers and the touched
+// windows of mapped files). Workers reserve bytes before reading and release them when done, waiting while the
+// budget is exhausted, so the footprint stays bounded whatever the file-size mix.
+typedef struct memory_budget_t MemoryBudget;
+
+MemoryBudget *memory_budget_new     (guint64       capacity);
+
+// Reserves between min_bytes and want_bytes (both capped to the capacity), waiting until at least min_bytes
+// are free. Returns the number of bytes reserved, to be passed to memory_budget_release().
+guint64       memory_budget_acquire (MemoryBudget *budget,
+                                     guint64       want_bytes,
+                                     guint64       min_bytes);
+
+void          memory_budget_release (MemoryBudget *budget,
+                                     guint64       bytes);
+
+// capacity, bytes reserved right now, highest reservation seen, and the number of reservations that had to wait
+void          memory_budget_stats   (MemoryBudget *budget,
+                                     guint64      *capacity,
+                                     guint64      *in_use,
+                                     guint64      *peak,
+                                     guint64      *waits);
+
+void          memory_budget_free    (MemoryBudget *budget);
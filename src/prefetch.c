@@ -0,0 +1,160 @@
+#include <glib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "prefetch.h"
+
+#define PREFETCH_FILE_BYTES (4 * 1024 * 1024)  // only the head of large files: the workers read ahead within the file themselves
+#define PREFETCH_STOP_WAIT_US G_USEC_PER_SEC    // prefetcher_free() leaves the thread behind when it takes longer to stop
+
+typedef struct prefetch_item_t {
+    guint64 seq;
+    gchar path[];
+} PrefetchItem;
+
+struct prefetcher_t {
+    guint window;
+    GAsyncQueue *queue;
+    GThread *thread;
+    PrefetchItem *stop;     // sentinel pushed by prefetcher_free()
+    guint64 pushed;         // only touched by the thread handing out the files
+    guint64 done;           // files finished by the workers, protected by lock
+    gboolean stopping;      // protected by lock: the files left are dropped
+    gboolean exited;        // protected by lock
+    gint ref_count;         // atomic: the owner and the thread, which may outlive prefetcher_free()
+    GMutex lock;
+    GCond cond;
+};
+
+
+static void
+prefetcher_unref (Prefetcher *prefetcher)
+{
+    if (!g_atomic_int_dec_and_test (&prefetcher->ref_count)) return;
+
+    PrefetchItem *item;
+    while ((item = g_async_queue_try_pop (prefetcher->queue)) != NULL) {
+        if (item != prefetcher->stop) g_free (item);
+    }
+    g_async_queue_unref (prefetcher->queue);
+    g_free (prefetcher->stop);
+    g_mutex_clear (&prefetcher->lock);
+    g_cond_clear (&prefetcher->cond);
+    g_free (prefetcher);
+}
+
+
+// Not under the read watchdog: a hung mount blocks this thread only, which prefetcher_free() leaves behind
+static void
+prefetch_file (const gchar *path)
+{
+    int fd = open (path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0) return;
+
+    struct stat st;
+    if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode) && st.st_size > 0) {
+        posix_fadvise (fd, 0, MIN(st.st_size, PREFETCH_FILE_BYTES), POSIX_FADV_WILLNEED);
+    }
+    close (fd);
+}
+
+
+static gpointer
+prefetch_thread (gpointer data)
+{
+    Prefetcher *prefetcher = (Prefetcher *)data;
+
+    PrefetchItem *item;
+    while ((item = g_async_queue_pop (prefetcher->queue)) != prefetcher->stop) {
+        // Stay at most window files ahead of the workers, and skip the files they have already reached
+        g_mutex_lock (&prefetcher->lock);
+        while (!prefetcher->stopping && item->seq >= prefetcher->done + prefetcher->window) {
+            g_cond_wait (&prefetcher->cond, &prefetcher->lock);
+        }
+        gboolean skip = prefetcher->stopping || item->seq < prefetcher->done;
+        g_mutex_unlock (&prefetcher->lock);
+
+        if (!skip) prefetch_file (item->path);
+        g_free (item);
+    }
+
+    g_mutex_lock (&prefetcher->lock);
+    prefetcher->exited = TRUE;
+    g_cond_broadcast (&prefetcher->cond);
+    g_mutex_unlock (&prefetcher->lock);
+    prefetcher_unref (prefetcher);
+
+    return NULL;
+}
+
+
+Prefetcher *
+prefetcher_new (guint window)
+{
+    Prefetcher *prefetcher = g_try_new0 (Prefetcher, 1);
+    if (!prefetcher) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Failed to allocate memory for Prefetcher: files will not be prefetched");
+        return NULL;
+    }
+
+    prefetcher->window = window;
+    prefetcher->queue = g_async_queue_new ();
+    prefetcher->stop = g_malloc0 (sizeof(PrefetchItem));
+    g_mutex_init (&prefetcher->lock);
+    g_cond_init (&prefetcher->cond);
+    prefetcher->ref_count = 2;
+    prefetcher->thread = g_thread_new ("prefetch", prefetch_thread, prefetcher);
+
+    return prefetcher;
+}
+
+
+void
+prefetcher_push (Prefetcher  *prefetcher,
+                 const gchar *path)
+{
+    gsize path_len = strlen (path);
+    PrefetchItem *item = g_malloc (sizeof(PrefetchItem) + path_len + 1);
+    item->seq = prefetcher->pushed++;
+    memcpy (item->path, path, path_len + 1);
+    g_async_queue_push (prefetcher->queue, item);
+}
+
+
+void
+prefetcher_done (Prefetcher *prefetcher)
+{
+    g_mutex_lock (&prefetcher->lock);
+    prefetcher->done++;
+    g_cond_signal (&prefetcher->cond);
+    g_mutex_unlock (&prefetcher->lock);
+}
+
+
+void
+prefetcher_free (Prefetcher *prefetcher)
+{
+    if (!prefetcher) return;
+
+    // Whatever is left is behind the workers by now: the thread drops it
+    g_async_queue_push (prefetcher->queue, prefetcher->stop);
+    g_mutex_lock (&prefetcher->lock);
+    prefetcher->stopping = TRUE;
+    g_cond_broadcast (&prefetcher->cond);
+    gint64 deadline = g_get_monotonic_time () + PREFETCH_STOP_WAIT_US;
+    while (!prefetcher->exited) {
+        if (!g_cond_wait_until (&prefetcher->cond, &prefetcher->lock, deadline)) break;
+    }
+    gboolean exited = prefetcher->exited;
+    g_mutex_unlock (&prefetcher->lock);
+
+    if (exited) {
+        g_thread_join (prefetcher->thread);
+    } else {
+        // Blocked in open() on a hung mount: like a stuck worker, the thread stays lost until the kernel lets it go,
+        // and frees the prefetcher when it finally exits
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Prefetch thread blocked in a file access: leaving it behind");
+        g_thread_unref (prefetcher->thread);
+    }
+    prefetcher_unref (prefetcher);
+}
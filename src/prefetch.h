@@ -0,0 +1,18 @@
+#pragma once
+
+#include <glib.h>
+
+// Read-ahead stage: a background thread asks the kernel (posix_fadvise WILLNEED) to start reading the files
+// queued for the workers, at most window files ahead of them, so that the disk is busy while the workers hash.
+typedef struct prefetcher_t Prefetcher;
+
+Prefetcher *prefetcher_new  (guint        window);
+
+// Called in the order the files are handed to the workers
+void        prefetcher_push (Prefetcher  *prefetcher,
+                             const gchar *path);
+
+// Called by the workers once a file is done: moves the window forward
+void        prefetcher_done (Prefetcher  *prefetcher);
+
+void        prefetcher_free (Prefetcher  *prefetcher);
@@ -1,86 +1,136 @@
 #include <glib.h>
 #include <gio/gio.h>
+#include <errno.h>
 #include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
 #include "process_directories.h"
+#include "exclude.h"
 
 #define QUEUE_BUFFER_SIZE 1000
 #define PATH_BUFFER_SIZE PATH_MAX
+#define VISITED_INITIAL_CAPACITY 1024   // power of two
 
 typedef struct {
-    GHashTable *excluded_dirs;
-    GHashTable *excluded_exts;
-    gboolean exclude_hidden;
+    ExcludeRules *exclude_rules;
     GPtrArray *queue_buffer;
+    const ConfigData *config_data;
 } ScanContext;
 
+typedef struct dir_id_t {
+    guint64 dev;
+    guint64 ino;
+} DirId;
+
+// Flat open-addressing set of directory identities (16 bytes per slot, linear probing)
+typedef struct visited_set_t {
+    DirId *slots;
+    gsize capacity;
+    gsize count;
+    gboolean has_zero;  // (0, 0) marks empty slots
+} VisitedSet;
+
 typedef struct process_context_t {
-    GHashTable *visited; // Tracks visited directories to prevent loops
-    guint depth;          // Current recursion depth
+    DirId chain[65];        // directories from the scan root down to the current one (max_recursion_depth <= 64)
+    VisitedSet visited;     // directories reachable by more than one path, see dir_needs_global_check()
+    gboolean track_all;     // several roots: any directory may be reached twice
+    guint depth;            // Current recursion depth
 } ProcessContext;
 
 
+static inline gsize
+dir_id_hash (const DirId *id)
+{
+    guint64 h = id->ino * G_GUINT64_CONSTANT (0x9E3779B97F4A7C15) ^ id->dev;
+    return (gsize)(h ^ (h >> 29));
+}
+
+
 static void
-flush_queue_buffer (GPtrArray   *buffer,
-                    GAsyncQueue *queue,
-                    guint        max_size)
+visited_set_resize (VisitedSet *set,
+                    gsize       capacity)
 {
-    guint sleep_us = 1000; // start with 1ms
-    for (guint i = 0; i < buffer->len; i++) {
-        while ((guint)g_async_queue_length (queue) >= max_size) {
-            // Exponential backoff up to 10ms to reduce CPU while waiting for consumers
-            g_usleep (sleep_us);
-            if (sleep_us < 10000) sleep_us = MIN (sleep_us * 2, 10000);
-        }
-        sleep_us = 1000; // reset after a successful push
-        if (buffer->pdata[i] != NULL) g_async_queue_push (queue, buffer->pdata[i]);
+    DirId *old = set->slots;
+    gsize old_capacity = set->capacity;
+
+    set->slots = g_new0 (DirId, capacity);
+    set->capacity = capacity;
+    for (gsize i = 0; i < old_capacity; i++) {
+        if (old[i].dev == 0 && old[i].ino == 0) continue;
+        gsize pos = dir_id_hash (&old[i]) & (capacity - 1);
+        while (set->slots[pos].dev != 0 || set->slots[pos].ino != 0) pos = (pos + 1) & (capacity - 1);
+        set->slots[pos] = old[i];
     }
-    g_ptr_array_set_size (buffer, 0);
+    g_free (old);
 }
 
+
+// Returns FALSE when the directory was already in the set
 static gboolean
-should_skip_entry(const gchar *entry_name,
-                  const gchar *full_path,
-                  ScanContext *scan_ctx)
+visited_set_add (VisitedSet  *set,
+                 const DirId *id)
 {
-    if (scan_ctx->exclude_hidden && entry_name[0] == '.') {
-        return TRUE;
+    if (id->dev == 0 && id->ino == 0) {
+        gboolean added = !set->has_zero;
+        set->has_zero = TRUE;
+        return added;
     }
-
-    if (scan_ctx->excluded_dirs && g_hash_table_contains (scan_ctx->excluded_dirs, full_path)) {
-        return TRUE;
+    if ((set->count + 1) * 2 > set->capacity) {
+        visited_set_resize (set, set->capacity ? set->capacity * 2 : VISITED_INITIAL_CAPACITY);
     }
 
-    if (scan_ctx->excluded_exts) {
-        const gchar *dot = strrchr (entry_name, '.');
-        if (dot && g_hash_table_contains (scan_ctx->excluded_exts, dot)) {
-            return TRUE;
-        }
+    gsize pos = dir_id_hash (id) & (set->capacity - 1);
+    while (set->slots[pos].dev != 0 || set->slots[pos].ino != 0) {
+        if (set->slots[pos].dev == id->dev && set->slots[pos].ino == id->ino) return FALSE;
+        pos = (pos + 1) & (set->capacity - 1);
     }
+    set->slots[pos] = *id;
+    set->count++;
+    return TRUE;
+}
+
 
-    return FALSE;
+// A plain tree reaches every directory once: only the ancestor chain is needed to catch loops.
+// Directories entered through a symlink or a mount point (bind mounts) may also be reached through another path.
+static gboolean
+dir_needs_global_check (const ProcessContext *ctx,
+                        const DirId          *id,
+                        gboolean              is_symlink)
+{
+    return ctx->track_all || is_symlink || (ctx->depth > 0 && ctx->chain[ctx->depth - 1].dev != id->dev);
 }
 
+
 static void
-scan_dir(const gchar    *dir_path,
-         guint           max_depth,
-         ProcessContext *ctx,
-         FileQueueData  *file_queue_data,
-         ScanContext    *scan_ctx)
+scan_dir(const gchar        *dir_path,
+         const DirId        *dir_id,
+         const ExcludeState *exclude_state,
+         guint               max_depth,
+         ProcessContext     *ctx,
+         FileQueueData      *file_queue_data,
+         ScanContext        *scan_ctx)
 {
     if (ctx->depth > max_depth) {
         g_log (NULL, G_LOG_LEVEL_WARNING, "Max recursion depth exceeded at: %s", dir_path);
         return;
     }
 
-    if (g_hash_table_contains (ctx->visited, dir_path)) {
-        return;
+    for (guint i = 0; i < ctx->depth; i++) {
+        if (ctx->chain[i].dev == dir_id->dev && ctx->chain[i].ino == dir_id->ino) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "Directory loop detected at: %s", dir_path);
+            return;
+        }
     }
-    g_hash_table_add (ctx->visited, g_strdup (dir_path));
+    ctx->chain[ctx->depth] = *dir_id;
 
     GFile *dir = g_file_new_for_path (dir_path);
     GFileEnumerator *enumerator = g_file_enumerate_children (dir,
                                                              G_FILE_ATTRIBUTE_STANDARD_NAME ","
-                                                             G_FILE_ATTRIBUTE_STANDARD_TYPE,
+                                                             G_FILE_ATTRIBUTE_STANDARD_TYPE ","
+                                                             G_FILE_ATTRIBUTE_STANDARD_IS_SYMLINK ","
+                                                             G_FILE_ATTRIBUTE_UNIX_DEVICE ","
+                                                             G_FILE_ATTRIBUTE_UNIX_INODE,
                                                              G_FILE_QUERY_INFO_NONE,
                                                              NULL,
                                                              NULL);
@@ -95,23 +145,49 @@ scan_dir(const gchar    *dir_path,
 
     while ((info = g_file_enumerator_next_file (enumerator, NULL, NULL))) {
         const gchar *entry = g_file_info_get_name (info);
+        GFileType ftype = g_file_info_get_file_type (info);
+        // Symlinked directories are entered, symlinks to files are skipped: the target is checked under its own path,
+        // and the workers open files without following symlinks
+        if ((ftype != G_FILE_TYPE_DIRECTORY && ftype != G_FILE_TYPE_REGULAR) ||
+            (ftype == G_FILE_TYPE_REGULAR && g_file_info_get_is_symlink (info))) {
+            g_object_unref (info);
+            continue;
+        }
+
+        // Match on the entry name alone: excluded subdirectories are never formatted nor opened
+        ExcludeState *child_state = NULL;
+        if (exclude_rules_match (scan_ctx->exclude_rules, exclude_state, entry, ftype == G_FILE_TYPE_DIRECTORY, &child_state)) {
+            g_object_unref (info);
+            continue;
+        }
+
         g_snprintf (path_buffer, PATH_BUFFER_SIZE, "%s/%s", dir_path, entry);
 
-        if (should_skip_entry (entry, path_buffer, scan_ctx)) {
+        // --shard: the entries right below a root are split between the hosts, everything below follows them
+        if (ctx->depth == 0 && !config_in_slice (scan_ctx->config_data, path_buffer)) {
+            exclude_state_free (child_state);
             g_object_unref (info);
             continue;
         }
 
-        GFileType ftype = g_file_info_get_file_type (info);
         if (ftype == G_FILE_TYPE_DIRECTORY) {
+            // Symlinks are followed, so these describe the target directory
+            DirId child_id = {
+                .dev = g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_DEVICE),
+                .ino = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_UNIX_INODE)
+            };
             ctx->depth++;
-            scan_dir (path_buffer, max_depth, ctx, file_queue_data, scan_ctx);
+            if (!dir_needs_global_check (ctx, &child_id, g_file_info_get_is_symlink (info)) ||
+                visited_set_add (&ctx->visited, &child_id)) {
+                scan_dir (path_buffer, &child_id, child_state, max_depth, ctx, file_queue_data, scan_ctx);
+            }
             ctx->depth--;
-        } else if (ftype == G_FILE_TYPE_REGULAR) {
+            exclude_state_free (child_state);
+        } else {
             g_ptr_array_add (scan_ctx->queue_buffer, g_strdup(path_buffer));
 
             if (scan_ctx->queue_buffer->len >= QUEUE_BUFFER_SIZE) {
-                flush_queue_buffer (scan_ctx->queue_buffer, file_queue_data->queue, file_queue_data->max_size);
+                file_queue_push_buffer (file_queue_data, scan_ctx->queue_buffer);
             }
         }
         g_object_unref (info);
@@ -132,8 +208,8 @@ process_directories (gchar         **dirs,
         g_log (NULL, G_LOG_LEVEL_ERROR, "Failed to allocate memory for ProcessContext");
         return;
     }
-    ctx->visited = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
     ctx->depth = 0;
+    ctx->track_all = g_strv_length (dirs) > 1;
 
     ScanContext *scan_ctx = g_try_new0 (ScanContext, 1);
     if (!scan_ctx) {
@@ -141,41 +217,79 @@ process_directories (gchar         **dirs,
         g_free (ctx);
         return;
     }
-    scan_ctx->exclude_hidden = config_data->exclude_hidden;
+    scan_ctx->exclude_rules = exclude_rules_new (config_data);
+    if (!scan_ctx->exclude_rules) {
+        g_free (ctx);
+        g_free (scan_ctx);
+        return;
+    }
     scan_ctx->queue_buffer = g_ptr_array_new ();
+    scan_ctx->config_data = config_data;
 
-    if (config_data->exclude_directories) {
-        scan_ctx->excluded_dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-        gchar **excluded = g_strsplit (config_data->exclude_directories, ";", -1);
-        for (gsize i = 0; excluded[i]; i++) {
-            g_hash_table_add (scan_ctx->excluded_dirs, g_strdup(excluded[i]));
-        }
-        g_strfreev (excluded);
-    }
-    if (config_data->exclude_extensions) {
-        scan_ctx->excluded_exts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-        gchar **excluded = g_strsplit (config_data->exclude_extensions, ";", -1);
-        for (gsize i = 0; excluded[i]; i++) {
-            g_hash_table_add (scan_ctx->excluded_exts, g_strdup(excluded[i]));
+    for (gsize i = 0; dirs[i] != NULL; i++) {
+        struct stat st;
+        if (stat (dirs[i], &st) != 0 || !S_ISDIR (st.st_mode)) {
+            g_log (NULL, G_LOG_LEVEL_ERROR, "Failed to open directory: %s", dirs[i]);
+            continue;
         }
-        g_strfreev (excluded);
-    }
+        DirId root_id = { .dev = st.st_dev, .ino = st.st_ino };
+        if (ctx->track_all && !visited_set_add (&ctx->visited, &root_id)) continue;
 
-    for (gsize i = 0; dirs[i] != NULL; i++) {
-        scan_dir (dirs[i], max_depth, ctx, file_queue_data, scan_ctx);
+        ExcludeState *root_state = exclude_state_for_path (scan_ctx->exclude_rules, dirs[i]);
+        scan_dir (dirs[i], &root_id, root_state, max_depth, ctx, file_queue_data, scan_ctx);
+        exclude_state_free (root_state);
     }
 
     // Flush any remaining files in the buffer
     if (scan_ctx->queue_buffer->len > 0) {
-        flush_queue_buffer (scan_ctx->queue_buffer, file_queue_data->queue, file_queue_data->max_size);
+        file_queue_push_buffer (file_queue_data, scan_ctx->queue_buffer);
     }
 
     file_queue_data->scanning_done = TRUE;
 
-    g_hash_table_destroy (ctx->visited);
+    g_free (ctx->visited.slots);
     g_free (ctx);
-    if (scan_ctx->excluded_dirs) g_hash_table_destroy (scan_ctx->excluded_dirs);
-    if (scan_ctx->excluded_exts) g_hash_table_destroy (scan_ctx->excluded_exts);
+    exclude_rules_free (scan_ctx->exclude_rules);
     g_ptr_array_free (scan_ctx->queue_buffer, TRUE);
     g_free (scan_ctx);
 }
+
+
+void
+process_file_list (FILE          *input,
+                   gboolean       null_separated,
+                   FileQueueData *file_queue_data)
+{
+    GPtrArray *queue_buffer = g_ptr_array_new ();
+    gchar *line = NULL;
+    gsize line_size = 0;
+    gssize len;
+    guint64 listed = 0;
+
+    while ((len = getdelim (&line, &line_size, null_separated ? '\0' : '\n', input)) > 0) {
+        if (line[len - 1] == (null_separated ? '\0' : '\n')) line[--len] = '\0';
+        if (!null_separated && len > 0 && line[len - 1] == '\r') line[--len] = '\0';
+        if (len == 0) continue;
+
+        gchar *path = g_path_is_absolute (line) ? g_strdup (line) : g_canonicalize_filename (line, NULL);
+        g_ptr_array_add (queue_buffer, path);
+        listed++;
+
+        if (queue_buffer->len >= QUEUE_BUFFER_SIZE) {
+            file_queue_push_buffer (file_queue_data, queue_buffer);
+        }
+    }
+    if (ferror (input)) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Error while reading the file list: %s", g_strerror (errno));
+    }
+
+    if (queue_buffer->len > 0) {
+        file_queue_push_buffer (file_queue_data, queue_buffer);
+    }
+    g_debug ("Queued %" G_GUINT64_FORMAT " listed files", listed);
+
+    file_queue_data->scanning_done = TRUE;
+
+    free (line);
+    g_ptr_array_free (queue_buffer, TRUE);
+}
@@ -1,8 +1,15 @@
 #pragma once
 
+#include <stdio.h>
 #include "queue.h"
 
 void process_directories (gchar         **dirs,
                           guint           max_depth,
                           FileQueueData  *file_queue_data,
-                          ConfigData     *config_data);
\ No newline at end of file
+                          ConfigData     *config_data);
+
+// Feeds the queue from a list of paths ('\n' or NUL separated) instead of walking the configured directories.
+// Relative paths are resolved against the current directory.
+void process_file_list   (FILE           *input,
+                          gboolean        null_separated,
+                          FileQueueData  *file_queue_data);
@@ -1,82 +1,356 @@
+#define _GNU_SOURCE     // SEEK_DATA/SEEK_HOLE, O_NOATIME, statx()
+
 #include <glib.h>
-#include <gio/gio.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <xxhash.h>
+#include "io_watchdog.h"
 #include "queue.h"
 #include "summary.h"
+#include "process_file.h"
 
 #define MMAP_THRESHOLD_RATIO 0.75
 #define MIN_BUFFER_SIZE (10 * 1024 * 1024)  // 10MB
 #define MAX_BUFFER_SIZE (128 * 1024 * 1024) // 128MB
-
-typedef struct file_entry_t {
-    gchar *filepath;
-    guint64 hash;
-    ino_t inode;
-    nlink_t link_count;
-    blkcnt_t block_count;
-} FileEntryData;
+#define MISSING_RANGES_PER_THREAD 4         // more ranges than threads evens out ranges with many missing files
+#define MISSING_MIN_RANGE_RECORDS 1024      // smaller databases are walked as a single range
+#define MISSING_DELETE_BATCH 1000
+#define VERIFIED_BATCH 256                  // verification times stamped per write transaction
+#define HASH_READ_AHEAD (8 * 1024 * 1024)    // mapped files are hashed in windows of this size, the next one paged in meanwhile
+#define HASH_MIN_WINDOW (1024 * 1024)       // smallest read buffer when the memory budget is tight
+#define SPARSE_GRANULE 4096                 // all-zero blocks of this size are folded into zero runs
+#define SAMPLE_BLOCK_SIZE (1024 * 1024)     // head, middle and tail blocks of the sample fingerprint
 
 typedef struct file_info_t {
+    int fd;                 // the file is opened once: metadata and content come from this descriptor
     struct stat st;
     guint64 hash;
+    guint64 sample_hash;
+    HashFormat hash_format;
 } FileInfo;
 
+typedef struct sparse_hasher_t {
+    XXH3_state_t *data;     // everything outside the zero runs
+    XXH3_state_t *runs;     // (offset, length) of every zero run
+    guint64 run_start;
+    guint64 run_length;
+} SparseHasher;
+
+typedef struct move_source_t {
+    gchar *path;            // record whose file is gone
+    DbShard *shard;
+    FileEntryData entry;
+} MoveSource;
 
+typedef enum content_check_t {
+    CONTENT_VERIFIED,           // the full hash matches
+    CONTENT_SAMPLED,            // the sample fingerprint matches and no full check is due
+    CONTENT_CHANGED,            // the full hash differs
+    CONTENT_SAMPLE_CHANGED,     // size or sample fingerprint differ: the whole file was not read
+    CONTENT_FAILED
+} ContentCheck;
+
+
+// The one path lookup of a file. O_NOATIME is refused for files of other users: open those without it.
+// Returns -1 with errno set (ENOENT when the file is gone, ELOOP for a symlink).
+static int
+open_file (const char *filepath)
+{
+    // O_NONBLOCK: a FIFO in a listed path must not block the worker (it is rejected as not regular afterwards)
+    int fd = open (filepath, O_RDONLY | O_NOATIME | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0 && errno == EPERM) {
+        fd = open (filepath, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    }
+    return fd;
+}
+
+
+// Whether a stored path still names a tracked file. Symlinks to files are not tracked (open_file() doesn't follow
+// them): the record of one, stored by versions that did, counts as missing.
 static gboolean
-validate_filepath (const char *filepath)
+path_is_tracked (const char *filepath)
 {
-    return filepath && *filepath && g_file_test(filepath, G_FILE_TEST_EXISTS);
+    struct stat st;
+    return lstat (filepath, &st) == 0 && !S_ISLNK (st.st_mode);
 }
 
 
+// statx() on the descriptor, asking only for the fields that are stored
+static int
+fd_stat (int          fd,
+         struct stat *st)
+{
+    struct statx stx;
+    if (statx (fd, "", AT_EMPTY_PATH | AT_STATX_SYNC_AS_STAT, STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_INO | STATX_SIZE | STATX_BLOCKS, &stx) != 0) {
+        return errno == ENOSYS ? fstat (fd, st) : -1;
+    }
+
+    memset (st, 0, sizeof(*st));
+    st->st_dev = makedev (stx.stx_dev_major, stx.stx_dev_minor);
+    st->st_mode = stx.stx_mode;
+    st->st_nlink = stx.stx_nlink;
+    st->st_ino = stx.stx_ino;
+    st->st_size = (off_t)stx.stx_size;
+    st->st_blocks = (blkcnt_t)stx.stx_blocks;
+    return 0;
+}
+
+
+// Fills buf unless the end of the file comes first; returns the bytes read, or -1 on error
+static gssize
+read_block (int     fd,
+            guchar *buf,
+            gsize   size,
+            goffset offset)
+{
+    gsize done = 0;
+    while (done < size) {
+        ssize_t n = pread (fd, buf + done, size - done, offset + (goffset)done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        done += n;
+    }
+    return (gssize)done;
+}
+
+
+static void
+sparse_flush_run (SparseHasher *hasher)
+{
+    if (hasher->run_length == 0) return;
+    guint64 run[2] = { GUINT64_TO_LE (hasher->run_start), GUINT64_TO_LE (hasher->run_length) };
+    XXH3_64bits_update (hasher->runs, run, sizeof(run));
+    hasher->run_length = 0;
+}
+
+
+static void
+sparse_add_zeros (SparseHasher *hasher,
+                  guint64       offset,
+                  guint64       length)
+{
+    if (hasher->run_length > 0 && hasher->run_start + hasher->run_length != offset) sparse_flush_run (hasher);
+    if (hasher->run_length == 0) hasher->run_start = offset;
+    hasher->run_length += length;
+}
+
+
+// Data read at offset (a multiple of SPARSE_GRANULE): full blocks of zeros join the zero runs like holes do
+static void
+sparse_add_data (SparseHasher *hasher,
+                 guint64       offset,
+                 const guchar *data,
+                 gsize         length)
+{
+    for (gsize done = 0; done < length; done += SPARSE_GRANULE) {
+        const guchar *block = data + done;
+        gsize n = MIN(SPARSE_GRANULE, length - done);
+        if (n == SPARSE_GRANULE && block[0] == 0 && memcmp (block, block + 1, n - 1) == 0) {
+            sparse_add_zeros (hasher, offset + done, n);
+        } else {
+            sparse_flush_run (hasher);
+            XXH3_64bits_update (hasher->data, block, n);
+        }
+    }
+}
+
+
+// HASH_FORMAT_SPARSE: the digest only depends on the logical content (a hole and written zeros hash the same),
+// but the holes reported by SEEK_DATA/SEEK_HOLE are skipped instead of read
 static guint64
-compute_hash (const char    *filepath,
-              const guint64  per_thread_ram)
-{
-    GError *error = NULL;
-    GFile *file = g_file_new_for_path (filepath);
-    GFileInfo *file_info = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_SIZE, G_FILE_QUERY_INFO_NONE, NULL, &error);
-    if (!file_info) {
-        g_log (NULL, G_LOG_LEVEL_ERROR, "Failed to query file info: %s\n", error->message);
-        g_clear_error (&error);
-        g_object_unref (file);
+compute_sparse_hash (int         fd,
+                     goffset     file_size,
+                     const char *filepath,
+                     gsize       buffer_size)
+{
+    buffer_size -= buffer_size % SPARSE_GRANULE;
+    guchar *buffer = g_try_malloc (buffer_size);
+    SparseHasher hasher = { .data = XXH3_createState (), .runs = XXH3_createState () };
+    if (!buffer || !hasher.data || !hasher.runs) {
+        g_log (NULL, G_LOG_LEVEL_ERROR, "Failed to set up sparse hashing for file %s\n", filepath);
+        g_free (buffer);
+        if (hasher.data) XXH3_freeState (hasher.data);
+        if (hasher.runs) XXH3_freeState (hasher.runs);
         return 0;
     }
+    XXH3_64bits_reset (hasher.data);
+    XXH3_64bits_reset (hasher.runs);
+
+    const off_t size = file_size;
+    off_t pos = 0;
+    gboolean ok = TRUE;
+    while (ok && pos < size) {
+        off_t data = lseek (fd, pos, SEEK_DATA);
+        if (data < 0) data = (errno == ENXIO) ? size : pos;     // ENXIO: only a hole is left; other errors: no hole support
+
+        // Whole blocks inside the hole are not read
+        off_t zeros_end = MIN(data, size) - MIN(data, size) % SPARSE_GRANULE;
+        if (zeros_end > pos) {
+            sparse_add_zeros (&hasher, pos, zeros_end - pos);
+            pos = zeros_end;
+        }
+        if (pos >= size) break;
 
-    const goffset file_size = g_file_info_get_size (file_info);
-    g_object_unref (file_info);
+        off_t hole = lseek (fd, MAX(data, pos), SEEK_HOLE);
+        if (hole < 0) hole = size;
+        off_t read_end = MIN(hole + (SPARSE_GRANULE - hole % SPARSE_GRANULE) % SPARSE_GRANULE, size);
+        if (read_end <= pos) read_end = MIN(pos + SPARSE_GRANULE, size);
 
-    // Use memory mapping if file size is less than 75% of per-thread RAM
-    if (file_size > 0 && (gdouble)file_size < ((gdouble)per_thread_ram * MMAP_THRESHOLD_RATIO)) {
-        GMappedFile *mapped = g_mapped_file_new (filepath, FALSE, NULL);
-        if (mapped) {
-            const gchar *contents = g_mapped_file_get_contents (mapped);
-            gsize length = g_mapped_file_get_length (mapped);
-            XXH64_hash_t hash = XXH3_64bits (contents, length);
-            g_mapped_file_unref (mapped);
-            g_object_unref (file);
-            return hash;
+        posix_fadvise (fd, pos, read_end - pos, POSIX_FADV_SEQUENTIAL);
+        while (pos < read_end) {
+            gsize chunk = (gsize)MIN((off_t)buffer_size, read_end - pos);
+            gsize done = 0;
+            while (done < chunk) {
+                ssize_t n = pread (fd, buffer + done, chunk - done, pos + (off_t)done);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                done += n;
+            }
+            if (done < chunk || !io_watch_progress ()) {
+                ok = FALSE;
+                break;
+            }
+            sparse_add_data (&hasher, pos, buffer, chunk);
+            pos += chunk;
         }
     }
+    sparse_flush_run (&hasher);
 
-    // Fall back to chunked reading
-    g_log (NULL, G_LOG_LEVEL_DEBUG, "Falling back to chunked reading for file %s\n", filepath);
-    GFileInputStream *input_stream = g_file_read (file, NULL, &error);
-    if (!input_stream) {
-        g_log (NULL, G_LOG_LEVEL_ERROR, "Failed to open file (%s) for reading: %s\n", filepath, error->message);
-        g_clear_error (&error);
-        g_object_unref (file);
-        return 0;
+    XXH64_hash_t hash = 0;
+    if (ok) {
+        guint64 parts[3] = { XXH3_64bits_digest (hasher.data), XXH3_64bits_digest (hasher.runs), (guint64)size };
+        hash = XXH3_64bits (parts, sizeof(parts));
+    }
+
+    g_free (buffer);
+    XXH3_freeState (hasher.data);
+    XXH3_freeState (hasher.runs);
+
+    return hash;
+}
+
+
+// The next window is paged in while the current one is hashed, and hashed windows are dropped from the process
+// so that at most two of them are resident. Returns FALSE as well when the file is given up (see io_watchdog.h).
+gboolean
+hash_mapped_file (int      fd,
+                  guint64 *hash)
+{
+    GMappedFile *mapped = g_mapped_file_new_from_fd (fd, FALSE, NULL);
+    if (!mapped) return FALSE;
+
+    const gchar *contents = g_mapped_file_get_contents (mapped);
+    gsize length = g_mapped_file_get_length (mapped);
+    XXH3_state_t *state = length > HASH_READ_AHEAD ? XXH3_createState () : NULL;
+    gboolean ok = TRUE;
+    if (state == NULL) {
+        *hash = XXH3_64bits (contents, length);
+    } else {
+        XXH3_64bits_reset (state);
+        madvise ((void *)contents, length, MADV_SEQUENTIAL);
+        for (gsize offset = 0; offset < length && ok; offset += HASH_READ_AHEAD) {
+            gsize chunk = MIN(HASH_READ_AHEAD, length - offset);
+            if (offset + chunk < length) {
+                madvise ((void *)(contents + offset + chunk), MIN(HASH_READ_AHEAD, length - offset - chunk), MADV_WILLNEED);
+            }
+            XXH3_64bits_update (state, contents + offset, chunk);
+            madvise ((void *)(contents + offset), chunk, MADV_DONTNEED);
+            ok = io_watch_progress ();
+        }
+        *hash = XXH3_64bits_digest (state);
+        XXH3_freeState (state);
     }
+    g_mapped_file_unref (mapped);
+
+    return ok;
+}
 
-    const gsize buffer_size = CLAMP(per_thread_ram / 4, MIN_BUFFER_SIZE, MAX_BUFFER_SIZE);
 
-    guchar *buffer = g_try_malloc0_n (buffer_size, sizeof(guchar));
+// A read of the next block, run by block_readers while the worker hashes the current one
+typedef struct block_read_t {
+    int fd;
+    guchar *buffer;
+    gsize size;
+    goffset offset;
+    gssize result;          // read_block() result, protected by lock
+    gboolean done;          // protected by lock
+    GMutex lock;
+    GCond cond;
+} BlockRead;
+
+static GThreadPool *block_readers = NULL;   // shared by all workers, each one has at most one read in flight
+G_LOCK_DEFINE_STATIC (block_readers);
+
+
+static void
+block_read_run (gpointer data,
+                gpointer user_data __attribute__((unused)))
+{
+    BlockRead *request = (BlockRead *)data;
+    gssize result = read_block (request->fd, request->buffer, request->size, request->offset);
+
+    g_mutex_lock (&request->lock);
+    request->result = result;
+    request->done = TRUE;
+    g_cond_signal (&request->cond);
+    g_mutex_unlock (&request->lock);
+}
+
+
+static void
+block_read_start (BlockRead *request,
+                  guchar    *buffer,
+                  goffset    offset)
+{
+    G_LOCK (block_readers);
+    if (block_readers == NULL) block_readers = g_thread_pool_new (block_read_run, NULL, -1, FALSE, NULL);
+    G_UNLOCK (block_readers);
+
+    request->buffer = buffer;
+    request->offset = offset;
+    request->done = FALSE;
+    if (block_readers == NULL) {
+        // No helper thread: read in place
+        request->result = read_block (request->fd, buffer, request->size, offset);
+        request->done = TRUE;
+        return;
+    }
+    g_thread_pool_push (block_readers, request, NULL);
+}
+
+
+// Always waited for: the buffer must outlive the read, even for a file that was given up
+static gssize
+block_read_wait (BlockRead *request)
+{
+    g_mutex_lock (&request->lock);
+    while (!request->done) {
+        g_cond_wait (&request->cond, &request->lock);
+    }
+    gssize result = request->result;
+    g_mutex_unlock (&request->lock);
+    return result;
+}
+
+
+// Double buffered: buffer_size is split into two blocks, and the next block is read on a helper thread while the
+// current one is hashed, so the device and the CPU work at the same time
+guint64
+hash_chunked_file (int         fd,
+                   const char *filepath,
+                   gsize       buffer_size)
+{
+    gsize block_size = MAX(buffer_size / 2, 1);
+    guchar *buffer = g_try_malloc (2 * block_size);
     if (!buffer) {
         g_log (NULL, G_LOG_LEVEL_ERROR, "Failed to allocate buffer for file %s\n", filepath);
-        g_object_unref (input_stream);
-        g_object_unref (file);
         return 0;
     }
 
@@ -84,16 +358,32 @@ compute_hash (const char    *filepath,
     if (!state) {
         g_log (NULL, G_LOG_LEVEL_ERROR, "Failed to create XXH3 state for file %s\n", filepath);
         g_free (buffer);
-        g_object_unref (input_stream);
-        g_object_unref (file);
         return 0;
     }
 
     XXH3_64bits_reset (state);
+    posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-    gssize bytes_read;
-    while ((bytes_read = g_input_stream_read (G_INPUT_STREAM(input_stream), buffer, buffer_size, NULL, NULL)) > 0) {
-        XXH3_64bits_update (state, buffer, bytes_read);
+    BlockRead next = { .fd = fd, .size = block_size };
+    g_mutex_init (&next.lock);
+    g_cond_init (&next.cond);
+
+    guchar *blocks[2] = { buffer, buffer + block_size };
+    guint current = 0;
+    goffset offset = 0;
+    gssize bytes_read = read_block (fd, blocks[current], block_size, offset);
+    while (bytes_read > 0) {
+        offset += bytes_read;
+        // read_block() only comes back short at the end of the file
+        gboolean more = (gsize)bytes_read == block_size;
+        if (more) block_read_start (&next, blocks[current ^ 1], offset);
+        XXH3_64bits_update (state, blocks[current], bytes_read);
+        bytes_read = more ? block_read_wait (&next) : 0;
+        current ^= 1;
+        if (!io_watch_progress ()) {
+            bytes_read = -1;
+            break;
+        }
     }
 
     XXH64_hash_t hash = 0;
@@ -101,27 +391,180 @@ compute_hash (const char    *filepath,
         hash = XXH3_64bits_digest (state);
     }
 
+    g_mutex_clear (&next.lock);
+    g_cond_clear (&next.cond);
     g_free (buffer);
     XXH3_freeState (state);
-    g_object_unref (input_stream);
-    g_object_unref (file);
-    g_clear_error (&error);
 
     return hash;
 }
 
 
+HashTuning
+hash_tuning_default (const ConfigData *config_data)
+{
+    // Files below 75% of the per-thread RAM are mapped
+    return (HashTuning) {
+        .mmap_threshold = (guint64)((gdouble)config_data->max_ram_per_thread * MMAP_THRESHOLD_RATIO),
+        .buffer_size = CLAMP(config_data->max_ram_per_thread / 4, MIN_BUFFER_SIZE, MAX_BUFFER_SIZE),
+    };
+}
+
+
+// The calibrated strategy of the device of the file when there is one. A calibrated threshold never maps more
+// than the per-thread RAM allows.
+static HashTuning
+hash_tuning_for (const ConsumerData *consumer_data,
+                 const struct stat  *st)
+{
+    HashTuning tuning = hash_tuning_default (consumer_data->config_data);
+    const HashTuning *calibrated = calibration_lookup (consumer_data->calibration, st->st_dev);
+    if (calibrated) {
+        tuning.mmap_threshold = MIN(calibrated->mmap_threshold, tuning.mmap_threshold);
+        tuning.buffer_size = calibrated->buffer_size;
+    }
+    return tuning;
+}
+
+
+// Every path reserves the file data it keeps in memory from the global budget first: read buffers shrink
+// (down to HASH_MIN_WINDOW) or wait when other workers hold most of it
+static guint64
+compute_hash (int               fd,
+              goffset           file_size,
+              const char       *filepath,
+              const HashTuning *tuning,
+              HashFormat        hash_format,
+              MemoryBudget     *budget)
+{
+    guint64 hash = 0;
+    guint64 reserved;
+
+    if (hash_format == HASH_FORMAT_SPARSE) {
+        reserved = memory_budget_acquire (budget, tuning->buffer_size, HASH_MIN_WINDOW);
+        hash = compute_sparse_hash (fd, file_size, filepath, reserved);
+        memory_budget_release (budget, reserved);
+        return hash;
+    }
+
+    if (file_size > 0 && (guint64)file_size < tuning->mmap_threshold) {
+        guint64 resident = MIN((guint64)file_size, 2 * HASH_READ_AHEAD);
+        reserved = memory_budget_acquire (budget, resident, resident);
+        gboolean mapped = hash_mapped_file (fd, &hash);
+        memory_budget_release (budget, reserved);
+        if (mapped) return hash;
+        if (io_watch_abandoned ()) return 0;
+    }
+
+    // Fall back to chunked reading
+    g_log (NULL, G_LOG_LEVEL_DEBUG, "Falling back to chunked reading for file %s\n", filepath);
+    // Small files don't need the whole buffer
+    reserved = memory_budget_acquire (budget, MIN(tuning->buffer_size, MAX((guint64)file_size, HASH_MIN_WINDOW)), HASH_MIN_WINDOW);
+    hash = hash_chunked_file (fd, filepath, reserved);
+    memory_budget_release (budget, reserved);
+
+    return hash;
+}
+
+
+static guint64
+compute_sample_hash (int           fd,
+                     goffset       file_size,
+                     const char   *filepath,
+                     MemoryBudget *budget)
+{
+    guint64 reserved = memory_budget_acquire (budget, SAMPLE_BLOCK_SIZE, SAMPLE_BLOCK_SIZE);
+    guchar *buffer = g_try_malloc (SAMPLE_BLOCK_SIZE);
+    XXH3_state_t *state = XXH3_createState ();
+    if (!buffer || !state) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Failed to allocate the sampling buffer for file %s\n", filepath);
+        g_free (buffer);
+        if (state) XXH3_freeState (state);
+        memory_budget_release (budget, reserved);
+        return 0;
+    }
+
+    XXH3_64bits_reset (state);
+    guint64 size = (guint64)file_size;
+    XXH3_64bits_update (state, &size, sizeof(size));
+
+    const goffset offsets[] = { 0, (file_size - SAMPLE_BLOCK_SIZE) / 2, file_size - SAMPLE_BLOCK_SIZE };
+    gboolean ok = TRUE;
+    for (gsize i = 0; i < G_N_ELEMENTS (offsets) && ok; i++) {
+        // Short read: shrunk while being sampled (or a read error), the size no longer matches anyway
+        ok = read_block (fd, buffer, SAMPLE_BLOCK_SIZE, offsets[i]) == SAMPLE_BLOCK_SIZE && io_watch_progress ();
+        if (ok) XXH3_64bits_update (state, buffer, SAMPLE_BLOCK_SIZE);
+    }
+
+    XXH64_hash_t hash = ok ? XXH3_64bits_digest (state) : 0;
+
+    g_free (buffer);
+    XXH3_freeState (state);
+    memory_budget_release (budget, reserved);
+
+    return hash;
+}
+
+
+static inline void
+account_read (ConsumerData *consumer_data,
+              goffset       bytes)
+{
+    g_atomic_pointer_add (&consumer_data->bytes_read, (gssize)bytes);
+}
+
+
+static gboolean
+is_sampled (const ConfigData *config_data,
+            goffset           file_size)
+{
+    return config_data->sample_fingerprint &&
+           file_size >= 3 * SAMPLE_BLOCK_SIZE &&
+           (guint64)file_size >= config_data->sample_min_size;
+}
+
+
+// Reads happen in read sections (see io_watchdog.h): a file given up while reading returns FALSE, and nothing
+// from consumer_data is used afterwards
 static gboolean
-get_file_info (const char    *filepath,
-               const guint64  per_thread_ram,
-               FileInfo      *info)
+get_file_info (const char         *filepath,
+               const ConsumerData *consumer_data,
+               gboolean            hash_content,
+               FileInfo           *info)
 {
-    if (stat (filepath, &info->st) != 0) {
+    const ConfigData *config_data = consumer_data->config_data;
+    MemoryBudget *budget = consumer_data->memory_budget;
+
+    io_watch_read_begin ();
+    int rc = fd_stat (info->fd, &info->st);
+    if (!io_watch_read_end ()) return FALSE;
+    if (rc != 0) {
         g_log (NULL, G_LOG_LEVEL_ERROR, "Could not stat file: %s\n", filepath);
         return FALSE;
     }
+    if (!S_ISREG (info->st.st_mode)) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Not a regular file: %s\n", filepath);
+        return FALSE;
+    }
+
+    info->hash = 0;
+    info->sample_hash = 0;
+    info->hash_format = HASH_FORMAT_PLAIN;
+    if (!hash_content) return TRUE;
+
+    if (is_sampled (config_data, info->st.st_size)) {
+        io_watch_read_begin ();
+        info->sample_hash = compute_sample_hash (info->fd, info->st.st_size, filepath, budget);
+        if (!io_watch_read_end ()) return FALSE;
+    }
 
-    info->hash = compute_hash (filepath, per_thread_ram);
+    // Files with fewer allocated blocks than their size have holes
+    gboolean sparse = (guint64)info->st.st_blocks * 512 < (guint64)info->st.st_size;
+    info->hash_format = (config_data->sparse_hashing && sparse) ? HASH_FORMAT_SPARSE : HASH_FORMAT_PLAIN;
+    HashTuning tuning = hash_tuning_for (consumer_data, &info->st);
+    io_watch_read_begin ();
+    info->hash = compute_hash (info->fd, info->st.st_size, filepath, &tuning, info->hash_format, budget);
+    if (!io_watch_read_end ()) return FALSE;
     if (info->hash == 0) {
         g_log (NULL, G_LOG_LEVEL_ERROR, "Could not compute hash for file: %s\n", filepath);
         return FALSE;
@@ -139,183 +582,1007 @@ create_entry_data (const char     *filepath,
         .hash = info->hash,
         .inode = info->st.st_ino,
         .link_count = info->st.st_nlink,
-        .block_count = info->st.st_blocks
+        .block_count = info->st.st_blocks,
+        .last_verified = g_get_real_time () / G_USEC_PER_SEC,
+        .size = info->st.st_size,
+        .sample_hash = info->sample_hash,
+        .hash_format = info->hash_format,
+        .device = (guint64)info->st.st_dev
     };
 }
 
+
+typedef struct verified_file_t {
+    gint64 time;            // when the content was found to match
+    guint64 hash;           // the matching hash: a record rewritten since then keeps its time
+    gchar path[];
+} VerifiedFile;
+
+
+// Stamps the verification time of a batch of files in one transaction.
+// Returns MDB_MAP_FULL (with the map size in use) when the caller should grow the map and retry.
+static int
+mark_verified (GPtrArray *batch,
+               DbShard   *shard,
+               guint64   *map_size)
+{
+    MDB_txn *txn;
+
+    int rc = db_txn_begin (shard, 0, &txn, map_size);
+    if (rc != 0) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "mdb_txn_begin failed: %s\n", mdb_strerror (rc));
+        return rc;
+    }
+
+    for (guint i = 0; i < batch->len && rc == 0; i++) {
+        VerifiedFile *file = g_ptr_array_index (batch, i);
+        MDB_val key = { .mv_size = strlen (file->path) + 1, .mv_data = file->path }, data;
+        rc = mdb_get (txn, shard->dbi, &key, &data);
+        if (rc == MDB_NOTFOUND) {
+            rc = 0;
+            continue;
+        }
+        if (rc != 0) break;
+
+        FileEntryData entry;
+        db_read_entry (&data, &entry);
+        if (entry.hash != file->hash) continue;
+        entry.last_verified = file->time;
+        data.mv_size = sizeof(FileEntryData);
+        data.mv_data = &entry;
+        rc = db_put_entry (shard, txn, &key, &data, 0);
+    }
+    if (rc != 0) {
+        if (rc != MDB_MAP_FULL) g_log (NULL, G_LOG_LEVEL_WARNING, "Storing verification times failed: %s\n", mdb_strerror (rc));
+        db_txn_abort (shard, txn);
+        return rc;
+    }
+    return db_txn_commit (shard, txn);
+}
+
+
+// Takes ownership of batch
+static void
+write_verified (GPtrArray *batch,
+                DbShard   *shard)
+{
+    guint64 map_size = 0;
+    while (mark_verified (batch, shard, &map_size) == MDB_MAP_FULL) {
+        if (!db_grow (shard, map_size)) break;
+    }
+    g_ptr_array_free (batch, TRUE);
+}
+
+
+// Checking workers share one write transaction per VERIFIED_BATCH files instead of taking the writer lock per file
+static void
+queue_verified (ConsumerData *consumer_data,
+                DbShard      *shard,
+                const gchar  *filepath,
+                guint64       hash)
+{
+    gsize path_len = strlen (filepath) + 1;
+    VerifiedFile *file = g_malloc (sizeof(VerifiedFile) + path_len);
+    file->time = g_get_real_time () / G_USEC_PER_SEC;
+    file->hash = hash;
+    memcpy (file->path, filepath, path_len);
+
+    guint s = (guint)(shard - consumer_data->db_data->shards);
+    GPtrArray *full = NULL;
+    g_mutex_lock (&consumer_data->verified_lock);
+    g_ptr_array_add (consumer_data->verified[s], file);
+    if (consumer_data->verified[s]->len >= VERIFIED_BATCH) {
+        full = consumer_data->verified[s];
+        consumer_data->verified[s] = g_ptr_array_new_with_free_func (g_free);
+    }
+    g_mutex_unlock (&consumer_data->verified_lock);
+
+    if (full) write_verified (full, shard);
+}
+
+
+void
+flush_verified (ConsumerData *consumer_data)
+{
+    DatabaseData *db_data = consumer_data->db_data;
+    for (guint s = 0; s < db_data->n_shards; s++) {
+        g_mutex_lock (&consumer_data->verified_lock);
+        GPtrArray *batch = consumer_data->verified[s];
+        consumer_data->verified[s] = g_ptr_array_new_with_free_func (g_free);
+        g_mutex_unlock (&consumer_data->verified_lock);
+
+        if (batch->len > 0) {
+            write_verified (batch, &db_data->shards[s]);
+        } else {
+            g_ptr_array_free (batch, TRUE);
+        }
+    }
+}
+
+
+// Returns MDB_MAP_FULL (with the map size in use) when the caller should grow the map and retry
+static int
+delete_entry (const char *filepath,
+              DbShard    *shard,
+              guint64    *map_size)
+{
+    MDB_txn *txn;
+    MDB_val key = { .mv_size = strlen (filepath) + 1, .mv_data = (void *)filepath };
+
+    int rc = db_txn_begin (shard, 0, &txn, map_size);
+    if (rc != 0) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "mdb_txn_begin failed: %s\n", mdb_strerror (rc));
+        return rc;
+    }
+    rc = db_del_entry (shard, txn, &key);
+    if (rc != 0) {
+        if (rc != MDB_NOTFOUND && rc != MDB_MAP_FULL) g_log (NULL, G_LOG_LEVEL_WARNING, "mdb_del failed: %s\n", mdb_strerror (rc));
+        db_txn_abort (shard, txn);
+        return rc == MDB_NOTFOUND ? 0 : rc;
+    }
+    return db_txn_commit (shard, txn);
+}
+
+
+static int
+put_entry (MDB_txn        *txn,
+           DbShard        *shard,
+           MDB_val        *key,
+           const char     *filepath,
+           const FileInfo *info)
+{
+    MDB_val data;
+    FileEntryData entry = create_entry_data (filepath, info);
+    data.mv_size = sizeof(FileEntryData);
+    data.mv_data = &entry;
+
+    int rc = db_put_entry (shard, txn, key, &data, 0);
+    if (rc != 0 && rc != MDB_MAP_FULL) {
+        g_log (NULL, G_LOG_LEVEL_ERROR, "mdb_put failed: %s\n", mdb_strerror (rc));
+    }
+    g_free (entry.filepath);
+    return rc;
+}
+
+
 static gboolean
-handle_db_operation (const char     *filepath,
-                     const FileInfo *info,
-                     DatabaseData   *db_data,
-                     SummaryData    *summary_data,
-                     Mode            op)
+is_move_of (const FileEntryData *entry,
+            const FileInfo      *info)
+{
+    if (entry->size != info->st.st_size) return FALSE;
+    // A hashed file is paired by content, wherever it comes from; otherwise only a rename, which keeps the device
+    // and the inode. Inodes are reused once a file is deleted: check_entry() confirms such a pairing by content.
+    return info->hash != 0 ? entry->hash == info->hash
+                           : entry->device == (guint64)info->st.st_dev && entry->inode == info->st.st_ino;
+}
+
+
+// A file without a record may be the file of a record whose path is gone: renamed within its filesystem (same inode)
+// or moved from another one (same content hash, when the file was hashed). The indexes of all shards are searched;
+// open_txn, when not NULL, is the transaction of open_shard held by the caller. The source found is claimed so that
+// no other file takes it, and the missing-files pass skips it.
+static gboolean
+find_move_source (ConsumerData   *consumer_data,
+                  const char     *filepath,
+                  const FileInfo *info,
+                  DbShard        *open_shard,
+                  MDB_txn        *open_txn,
+                  MoveSource     *source)
+{
+    DatabaseData *db_data = consumer_data->db_data;
+    GArray *candidates = g_array_new (FALSE, FALSE, sizeof(MoveSource));
+    GPtrArray *paths = g_ptr_array_new_with_free_func (g_free);
+
+    for (guint i = 0; i < db_data->n_shards; i++) {
+        DbShard *shard = &db_data->shards[i];
+        MDB_txn *txn = shard == open_shard ? open_txn : NULL;
+        if (txn == NULL && db_txn_begin (shard, MDB_RDONLY, &txn, NULL) != 0) continue;
+
+        db_find_paths (shard, txn, DB_INDEX_INODE, db_inode_key ((guint64)info->st.st_dev, (guint64)info->st.st_ino), paths);
+        db_find_paths (shard, txn, DB_INDEX_HASH, info->hash, paths);
+        for (guint j = 0; j < paths->len; j++) {
+            const gchar *path = g_ptr_array_index (paths, j);
+            MDB_val key = { .mv_size = strlen (path) + 1, .mv_data = (void *)path }, data;
+            if (strcmp (path, filepath) == 0 || mdb_get (txn, shard->dbi, &key, &data) != 0) continue;
+
+            MoveSource candidate = { .shard = shard };
+            db_read_entry (&data, &candidate.entry);
+            if (!is_move_of (&candidate.entry, info)) continue;
+            candidate.path = g_strdup (path);
+            g_array_append_val (candidates, candidate);
+        }
+        g_ptr_array_set_size (paths, 0);
+
+        if (txn != open_txn) db_txn_abort (shard, txn);
+    }
+    g_ptr_array_free (paths, TRUE);
+
+    gboolean found = FALSE;
+    for (guint i = 0; i < candidates->len; i++) {
+        MoveSource *candidate = &g_array_index (candidates, MoveSource, i);
+        if (!found && !path_is_tracked (candidate->path)) {
+            // A retry of the same file (e.g. after growing the map) finds its own claim
+            g_mutex_lock (&consumer_data->moved_lock);
+            const gchar *claimant = g_hash_table_lookup (consumer_data->moved_paths, candidate->path);
+            if (claimant == NULL) {
+                g_hash_table_insert (consumer_data->moved_paths, g_strdup (candidate->path), g_strdup (filepath));
+            }
+            found = claimant == NULL || strcmp (claimant, filepath) == 0;
+            g_mutex_unlock (&consumer_data->moved_lock);
+        }
+        if (found && source->path == NULL) {
+            *source = *candidate;
+        } else {
+            g_free (candidate->path);
+        }
+    }
+    g_array_free (candidates, TRUE);
+
+    return found;
+}
+
+
+// Gives back a source claimed by find_move_source() that turned out not to be the file's: the missing-files pass
+// reports it again
+static void
+release_move_source (ConsumerData *consumer_data,
+                     const gchar  *source_path,
+                     const char   *filepath)
 {
+    g_mutex_lock (&consumer_data->moved_lock);
+    const gchar *claimant = g_hash_table_lookup (consumer_data->moved_paths, source_path);
+    if (claimant != NULL && strcmp (claimant, filepath) == 0) {
+        g_hash_table_remove (consumer_data->moved_paths, source_path);
+    }
+    g_mutex_unlock (&consumer_data->moved_lock);
+}
+
+
+// A stored sample fingerprint is compared first: a mismatch is reported without
+// reading the whole file, and a match only leads to a full hash once the file is due (verify_cycle_days).
+// Files handed out by the verification plan are due by definition. A file given up while reading is CONTENT_FAILED.
+static ContentCheck
+compare_content (const char          *filepath,
+               const FileInfo      *info,
+               const FileEntryData *stored,
+               ConsumerData        *consumer_data)
+{
+    ConfigData *config_data = consumer_data->config_data;
+
+    if (stored->sample_hash != 0 && is_sampled (config_data, info->st.st_size)) {
+        if (info->st.st_size != stored->size) return CONTENT_SAMPLE_CHANGED;
+        io_watch_read_begin ();
+        guint64 sample_hash = compute_sample_hash (info->fd, info->st.st_size, filepath, consumer_data->memory_budget);
+        if (!io_watch_read_end () || sample_hash == 0) return CONTENT_FAILED;
+        account_read (consumer_data, 3 * SAMPLE_BLOCK_SIZE);
+        if (sample_hash != stored->sample_hash) return CONTENT_SAMPLE_CHANGED;
+
+        gint64 cycle = (gint64)config_data->verify_cycle_days * 24 * 3600;
+        gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+        if ((consumer_data->check_scope & CHECK_METADATA) && cycle > 0 && stored->last_verified + cycle > now) {
+            return CONTENT_SAMPLED;
+        }
+    }
+
+    // Hashed the way the stored hash was, whatever the allocation of the file is now
+    HashTuning tuning = hash_tuning_for (consumer_data, &info->st);
+    io_watch_read_begin ();
+    guint64 hash = compute_hash (info->fd, info->st.st_size, filepath, &tuning, stored->hash_format, consumer_data->memory_budget);
+    if (!io_watch_read_end ()) return CONTENT_FAILED;
+    if (hash == 0) {
+        g_log (NULL, G_LOG_LEVEL_ERROR, "Could not compute hash for file: %s\n", filepath);
+        return CONTENT_FAILED;
+    }
+    account_read (consumer_data, stored->hash_format == HASH_FORMAT_SPARSE
+                                 ? MIN(info->st.st_size, info->st.st_blocks * 512) : info->st.st_size);
+    return hash == stored->hash ? CONTENT_VERIFIED : CONTENT_CHANGED;
+}
+
+
+static guint
+check_entry (const char     *filepath,
+             const FileInfo *info,
+             DbShard        *shard,
+             ConsumerData   *consumer_data,
+             gboolean       *content_verified)
+{
+    SummaryData *summary_data = consumer_data->summary_data;
+    gboolean check_metadata = (consumer_data->check_scope & CHECK_METADATA) != 0;
+    gboolean check_content = (consumer_data->check_scope & CHECK_CONTENT) != 0;
     MDB_txn *txn;
     MDB_val key, data;
-    int flags = (op == MODE_CHECK) ? MDB_RDONLY : 0;
 
-    int rc = mdb_txn_begin (db_data->env, NULL, flags, &txn);
+    int rc = db_txn_begin (shard, MDB_RDONLY, &txn, NULL);
     if (rc != 0) {
         g_log (NULL, G_LOG_LEVEL_ERROR, "mdb_txn_begin failed: %s\n", mdb_strerror (rc));
-        return FALSE;
+        return PROCESS_FILE_FAILED;
     }
 
     // LMDB expects key size in bytes, not UTF-8 character count
     key.mv_size = strlen (filepath) + 1;
     key.mv_data = (void*)filepath;
-    // TODO: how to add verbosity? Currently nothing is shown (log file? print? what?)
-    if (op == MODE_ADD) {
-        FileEntryData entry = create_entry_data (filepath, info);
-        data.mv_size = sizeof(FileEntryData);
-        data.mv_data = &entry;
+    rc = mdb_get (txn, shard->dbi, &key, &data);
+    FileEntryData stored;
+    guint changes = 0;
+    MoveSource source = { 0 };
+    if (rc == MDB_NOTFOUND && check_metadata && consumer_data->config_data->detect_moves) {
+        db_txn_abort (shard, txn);
+        if (find_move_source (consumer_data, filepath, info, NULL, NULL, &source)) {
+            // Compared with the record it was moved from
+            stored = source.entry;
+            changes = CHANGE_BIT(CHANGE_MOVED);
+        } else {
+            record_change (summary_data, filepath, CHANGE_MISSING_IN_DB);
+            summary_increment_processed (summary_data, 1);
+            return CHANGE_BIT(CHANGE_MISSING_IN_DB);
+        }
+    } else if (rc != 0) {
+        guint result = rc == MDB_NOTFOUND ? PROCESS_FILE_SKIPPED : PROCESS_FILE_FAILED;
+        if (rc != MDB_NOTFOUND) {
+            // The only error we expect is MDB_NOTFOUND, which means the file is not in the database (e.g. created after add operation)
+            g_log (NULL, G_LOG_LEVEL_ERROR, "Database operation failed: %s\n", mdb_strerror (rc));
+        } else if (check_metadata) {
+            // A content-only pass over planned files skips this: the metadata pass already reported it
+            record_change (summary_data, filepath, CHANGE_MISSING_IN_DB);
+            summary_increment_processed (summary_data, 1);
+            result = CHANGE_BIT(CHANGE_MISSING_IN_DB);
+        }
+        db_txn_abort (shard, txn);
+        return result;
+    } else {
+        db_read_entry (&data, &stored);
+        db_txn_abort (shard, txn);
+    }
 
-        rc = mdb_put (txn, db_data->dbi, &key, &data, 0);
-        if (rc != 0) {
-            g_log (NULL, G_LOG_LEVEL_ERROR, "mdb_put failed: %s\n", mdb_strerror (rc));
-            mdb_txn_abort (txn);
-            g_free (entry.filepath);
-            return FALSE;
+    if (check_content) {
+        ContentCheck content = compare_content (filepath, info, &stored, consumer_data);
+        if (source.path && content != CONTENT_VERIFIED && content != CONTENT_SAMPLED) {
+            // Not the content of the record paired by inode: a new file that reuses the inode of one that is gone
+            release_move_source (consumer_data, source.path, filepath);
+            g_free (source.path);
+            if (content == CONTENT_FAILED) return PROCESS_FILE_FAILED;
+            record_change (summary_data, filepath, CHANGE_MISSING_IN_DB);
+            summary_increment_processed (summary_data, 1);
+            return CHANGE_BIT(CHANGE_MISSING_IN_DB);
+        }
+        switch (content) {
+            case CONTENT_VERIFIED:
+                *content_verified = TRUE;
+                summary_add_verified (summary_data, info->st.st_size);
+                break;
+            case CONTENT_CHANGED:
+                changes |= CHANGE_BIT(CHANGE_HASH);
+                summary_add_verified (summary_data, info->st.st_size);
+                break;
+            case CONTENT_SAMPLE_CHANGED:
+                changes |= CHANGE_BIT(CHANGE_HASH);
+                break;
+            case CONTENT_SAMPLED:
+                break;
+            case CONTENT_FAILED:
+                return PROCESS_FILE_FAILED;
         }
-        g_free(entry.filepath);
+    }
+    if (source.path) {
+        // Without a content check (the metadata pass of a budgeted run) the pairing rests on device, inode and size
+        g_message ("Moved: %s -> %s", source.path, filepath);
+        g_free (source.path);
+    }
+    if (check_metadata) {
+        if (info->st.st_ino != stored.inode) changes |= CHANGE_BIT(CHANGE_INODE);
+        if (info->st.st_nlink != stored.link_count) changes |= CHANGE_BIT(CHANGE_LINKS);
+        if (info->st.st_blocks != stored.block_count) changes |= CHANGE_BIT(CHANGE_BLOCKS);
+    }
+    record_changes (summary_data, filepath, changes);
+    if (check_metadata && changes == 0) {
         summary_increment_processed (summary_data, 1);
+    }
+    return changes;
+}
+
+
+// Add/update one record. Returns MDB_MAP_FULL (with the map size in use) when the caller should grow the map and retry.
+// A file found to be moved takes over the record of its old path in update mode: *changes is CHANGE_BIT(CHANGE_MOVED).
+static int
+write_entry (const char     *filepath,
+             const FileInfo *info,
+             DbShard        *shard,
+             ConsumerData   *consumer_data,
+             guint64        *map_size,
+             guint          *changes)
+{
+    MDB_txn *txn;
+    MDB_val key, data;
+    gboolean processed = FALSE;
+    Mode op = consumer_data->mode;
+    MoveSource source = { 0 };
+
+    int rc = db_txn_begin (shard, 0, &txn, map_size);
+    if (rc != 0) {
+        g_log (NULL, G_LOG_LEVEL_ERROR, "mdb_txn_begin failed: %s\n", mdb_strerror (rc));
+        return rc;
+    }
+
+    key.mv_size = strlen (filepath) + 1;
+    key.mv_data = (void*)filepath;
+    // TODO: how to add verbosity? Currently nothing is shown (log file? print? what?)
+    if (op == MODE_ADD) {
+        rc = put_entry (txn, shard, &key, filepath, info);
+        processed = TRUE;
     } else {
-        rc = mdb_get (txn, db_data->dbi, &key, &data);
-        if (rc != 0) {
-            if (rc != MDB_NOTFOUND) {
-                // The only error we expect is MDB_NOTFOUND, which means the file is not in the database (e.g. created after add operation)
-                g_log (NULL, G_LOG_LEVEL_ERROR, "Database operation failed: %s\n", mdb_strerror (rc));
-                mdb_txn_abort (txn);
-                return FALSE;
+        rc = mdb_get (txn, shard->dbi, &key, &data);
+        if (rc == MDB_NOTFOUND) {
+            // File not in the database (e.g. created after add operation, or moved): add it
+            rc = put_entry (txn, shard, &key, filepath, info);
+            processed = TRUE;
+            if (rc == 0 && consumer_data->config_data->detect_moves &&
+                find_move_source (consumer_data, filepath, info, shard, txn, &source) && source.shard == shard) {
+                MDB_val source_key = { .mv_size = strlen (source.path) + 1, .mv_data = source.path };
+                rc = db_del_entry (shard, txn, &source_key);
+                if (rc == MDB_NOTFOUND) rc = 0;
             }
-            // File not found, so in UPDATE mode we add it to the dabase, while in CHECK mode we record it as missing
-            if (op == MODE_UPDATE) {
-                // For update operation, add if not found
-                FileEntryData entry = create_entry_data (filepath, info);
-                data.mv_size = sizeof(FileEntryData);
-                data.mv_data = &entry;
-
-                rc = mdb_put (txn, db_data->dbi, &key, &data, 0);
-                if (rc != 0) {
-                    g_log (NULL, G_LOG_LEVEL_ERROR, "mdb_put failed: %s\n", mdb_strerror (rc));
-                    mdb_txn_abort (txn);
-                    g_free (entry.filepath);
-                    return FALSE;
-                }
-                g_free (entry.filepath);
+        } else if (rc != 0) {
+            g_log (NULL, G_LOG_LEVEL_ERROR, "Database operation failed: %s\n", mdb_strerror (rc));
+        } else {
+            FileEntryData stored;
+            db_read_entry (&data, &stored);
+            if (info->hash != stored.hash ||
+                info->sample_hash != stored.sample_hash ||
+                info->st.st_ino != stored.inode ||
+                (guint64)info->st.st_dev != stored.device ||
+                info->st.st_nlink != stored.link_count ||
+                info->st.st_blocks != stored.block_count) {
+                rc = put_entry (txn, shard, &key, filepath, info);
+                processed = TRUE;
             }
-            if (op == MODE_CHECK) {
-                record_change (summary_data, filepath, CHANGE_MISSING_IN_DB);
+        }
+    }
+
+    if (rc != 0) {
+        db_txn_abort (shard, txn);
+        g_free (source.path);
+        return rc;
+    }
+
+    rc = db_txn_commit (shard, txn);
+    if (rc == 0 && processed) {
+        summary_increment_processed (consumer_data->summary_data, 1);
+    }
+    if (rc == 0 && source.path) {
+        // Records of other shards are dropped once the new one is stored
+        if (source.shard != shard) {
+            guint64 source_map_size = 0;
+            while (delete_entry (source.path, source.shard, &source_map_size) == MDB_MAP_FULL) {
+                if (!db_grow (source.shard, source_map_size)) break;
             }
-            summary_increment_processed (summary_data, 1);
-        } else {
-            FileEntryData *stored = (FileEntryData *)data.mv_data;
-            if (op == MODE_CHECK) {
-                gboolean change_recorded = FALSE;
-                if (info->hash != stored->hash) {
-                    record_change (summary_data, filepath, CHANGE_HASH);
-                    change_recorded = TRUE;
-                }
-                if (info->st.st_ino != stored->inode) {
-                    record_change (summary_data, filepath, CHANGE_INODE);
-                    change_recorded = TRUE;
-                }
-                if (info->st.st_nlink != stored->link_count) {
-                    record_change (summary_data, filepath, CHANGE_LINKS);
-                    change_recorded = TRUE;
-                }
-                if (info->st.st_blocks != stored->block_count) {
-                    record_change (summary_data, filepath, CHANGE_BLOCKS);
-                    change_recorded = TRUE;
-                }
-                if (!change_recorded) {
-                    summary_increment_processed (summary_data, 1);
-                }
-            } else if (op == MODE_UPDATE &&
-                      (info->hash != stored->hash ||
-                       info->st.st_ino != stored->inode ||
-                       info->st.st_nlink != stored->link_count ||
-                       info->st.st_blocks != stored->block_count)) {
-
-                FileEntryData entry = create_entry_data (filepath, info);
-                data.mv_size = sizeof(FileEntryData);
-                data.mv_data = &entry;
-
-                rc = mdb_put (txn, db_data->dbi, &key, &data, 0);
-                if (rc != 0) {
-                    g_log (NULL, G_LOG_LEVEL_ERROR, "mdb_put failed: %s\n", mdb_strerror (rc));
-                    mdb_txn_abort (txn);
-                    g_free (entry.filepath);
-                    return FALSE;
+        }
+        g_message ("Moved: %s -> %s", source.path, filepath);
+        record_change (consumer_data->summary_data, filepath, CHANGE_MOVED);
+        *changes = CHANGE_BIT(CHANGE_MOVED);
+    }
+    g_free (source.path);
+    return rc;
+}
+
+
+static guint
+handle_db_operation (const char     *filepath,
+                     const FileInfo *info,
+                     ConsumerData   *consumer_data)
+{
+    DbShard *shard = db_route (consumer_data->db_data, filepath);
+    Mode op = consumer_data->mode;
+    guint64 map_size = 0;
+    int rc;
+
+    if (op == MODE_CHECK) {
+        gboolean content_verified = FALSE;
+        guint changes = check_entry (filepath, info, shard, consumer_data, &content_verified);
+        if (content_verified && consumer_data->record_verified) {
+            queue_verified (consumer_data, shard, filepath, info->hash);
+        }
+        return changes;
+    }
+
+    if (consumer_data->bulk_loader) {
+        FileEntryData entry = create_entry_data (filepath, info);
+        bulk_loader_add (consumer_data->bulk_loader, filepath, &entry);
+        g_free (entry.filepath);
+        // Counted as processed once written, by ffc_run()
+        return 0;
+    }
+
+    guint changes = 0;
+    while ((rc = write_entry (filepath, info, shard, consumer_data, &map_size, &changes)) == MDB_MAP_FULL) {
+        if (!db_grow (shard, map_size)) break;
+    }
+    if (rc == MDB_MAP_FULL) {
+        g_log (NULL, G_LOG_LEVEL_ERROR, "Database %s is full and cannot grow any further\n", shard->path);
+    }
+    return rc == 0 ? changes : PROCESS_FILE_FAILED;
+}
+
+
+typedef struct key_range_t {
+    DbShard *shard;
+    MDB_val start;          // mv_data NULL: from the first key
+    MDB_val end;            // mv_data NULL: up to the last key, otherwise exclusive
+} KeyRange;
+
+typedef struct delete_batch_t {
+    DbShard *shard;         // NULL marks the end of the pass
+    GPtrArray *keys;
+} DeleteBatch;
+
+typedef struct missing_pass_t {
+    SummaryData *summary_data;
+    gboolean delete_file_from_db;
+    GHashTable *moved_paths;    // records taken over by moved files: not missing
+    GPtrArray *ranges;
+    gint next_range;        // atomic
+    GAsyncQueue *deletions; // DeleteBatch for the writer, update mode only
+} MissingPass;
+
+
+static void
+key_range_free (gpointer data)
+{
+    KeyRange *range = data;
+    g_free (range->start.mv_data);
+    g_free (range->end.mv_data);
+    g_free (range);
+}
+
+
+static MDB_val *
+copy_key (const MDB_val *key)
+{
+    MDB_val *copy = g_new (MDB_val, 1);
+    copy->mv_size = key->mv_size;
+    copy->mv_data = g_memdup2 (key->mv_data, key->mv_size);
+    return copy;
+}
+
+
+static void
+free_key (gpointer data)
+{
+    MDB_val *key = data;
+    g_free (key->mv_data);
+    g_free (key);
+}
+
+
+static gint
+compare_key_ptrs (gconstpointer a,
+                  gconstpointer b)
+{
+    return db_compare_keys (*(MDB_val * const *)a, *(MDB_val * const *)b);
+}
+
+
+// Key halfway between a and b, reading both as base-256 fractions (the shorter one padded with zero bytes)
+static MDB_val
+middle_key (const MDB_val *a,
+            const MDB_val *b)
+{
+    const guint8 *x = a->mv_data, *y = b->mv_data;
+    gsize len = MAX (a->mv_size, b->mv_size) + 1;   // one more byte keeps the middle above a
+    guint8 *middle = g_malloc (len);
+
+    // Add from the last byte, then halve from the first one
+    guint carry = 0;
+    for (gsize i = len; i-- > 0;) {
+        guint sum = carry + (i < a->mv_size ? x[i] : 0) + (i < b->mv_size ? y[i] : 0);
+        middle[i] = (guint8)sum;
+        carry = sum >> 8;
+    }
+    for (gsize i = 0; i < len; i++) {
+        guint value = (carry << 8) | middle[i];
+        middle[i] = (guint8)(value >> 1);
+        carry = value & 1;
+    }
+    return (MDB_val){ .mv_size = len, .mv_data = middle };
+}
+
+
+// Splits a shard into at most n_ranges ranges. The split keys come from bisecting the key space: each probe is a
+// MDB_SET_RANGE lookup of the key halfway between two keys already found, so planning costs n_ranges B-tree descents
+// whatever the number of records. Ranges are even in key space rather than in records; the extra ranges per thread
+// absorb the difference.
+static void
+plan_key_ranges (DbShard   *shard,
+                 guint      n_ranges,
+                 GPtrArray *ranges)
+{
+    MDB_txn *txn;
+    MDB_cursor *cursor;
+    MDB_val key, data;
+    GPtrArray *splits = g_ptr_array_new ();
+
+    if (n_ranges > 1 && db_txn_begin (shard, MDB_RDONLY, &txn, NULL) == 0) {
+        if (db_record_count (shard, txn) >= (guint64)n_ranges * MISSING_MIN_RANGE_RECORDS &&
+            mdb_cursor_open (txn, shard->dbi, &cursor) == 0) {
+            // Breadth-first, so that the splits found before reaching n_ranges are spread over the whole shard
+            GQueue intervals = G_QUEUE_INIT;
+            GPtrArray *bounds = g_ptr_array_new_with_free_func (free_key);
+            if (db_cursor_first (cursor, &key, &data) == 0) {
+                g_ptr_array_add (bounds, copy_key (&key));
+                if (mdb_cursor_get (cursor, &key, &data, MDB_LAST) == 0) {
+                    g_ptr_array_add (bounds, copy_key (&key));
+                    g_queue_push_tail (&intervals, g_ptr_array_index (bounds, 0));
+                    g_queue_push_tail (&intervals, g_ptr_array_index (bounds, 1));
                 }
-                g_free (entry.filepath);
-                summary_increment_processed (summary_data, 1);
             }
+            while (!g_queue_is_empty (&intervals) && splits->len < n_ranges - 1) {
+                MDB_val *low = g_queue_pop_head (&intervals);
+                MDB_val *high = g_queue_pop_head (&intervals);
+                MDB_val middle = middle_key (low, high);
+                key = middle;
+                int rc = mdb_cursor_get (cursor, &key, &data, MDB_SET_RANGE);
+                g_free (middle.mv_data);
+                // No key strictly between the two: the interval cannot be split any further
+                if (rc != 0 || db_compare_keys (&key, high) >= 0) continue;
+
+                MDB_val *split = copy_key (&key);
+                g_ptr_array_add (splits, split);
+                g_queue_push_tail (&intervals, low);
+                g_queue_push_tail (&intervals, split);
+                g_queue_push_tail (&intervals, split);
+                g_queue_push_tail (&intervals, high);
+            }
+            g_queue_clear (&intervals);
+            g_ptr_array_free (bounds, TRUE);
+            g_ptr_array_sort (splits, compare_key_ptrs);
+            mdb_cursor_close (cursor);
         }
+        db_txn_abort (shard, txn);
     }
 
-    if (op == MODE_CHECK)
-        mdb_txn_abort (txn);
-    else
-        mdb_txn_commit (txn);
+    MDB_val previous = { 0, NULL };
+    for (guint i = 0; i <= splits->len; i++) {
+        KeyRange *range = g_new0 (KeyRange, 1);
+        range->shard = shard;
+        if (previous.mv_data) {
+            range->start.mv_size = previous.mv_size;
+            range->start.mv_data = g_memdup2 (previous.mv_data, previous.mv_size);
+        }
+        if (i < splits->len) {
+            MDB_val *split = g_ptr_array_index (splits, i);
+            range->end = *split;
+            previous = *split;
+            g_free (split);
+        }
+        g_ptr_array_add (ranges, range);
+    }
+    g_ptr_array_free (splits, TRUE);
+}
 
-    return TRUE;
+
+static void
+queue_deletions (MissingPass *pass,
+                 DbShard     *shard,
+                 GPtrArray   *keys)
+{
+    DeleteBatch *batch = g_new (DeleteBatch, 1);
+    batch->shard = shard;
+    batch->keys = keys;
+    g_async_queue_push (pass->deletions, batch);
 }
 
 
-void
-handle_missing_files_from_fs (DatabaseData *db_data,
-                              SummaryData  *summary_data,
-                              gboolean      delete_file_from_db)
+// Walks one range with its own read transaction
+static void
+check_key_range (MissingPass    *pass,
+                 const KeyRange *range)
 {
+    DbShard *shard = range->shard;
     MDB_txn *txn;
     MDB_cursor *cursor;
     MDB_val key, data;
 
-    int txn_flags = delete_file_from_db ? 0 : MDB_RDONLY;
-    int rc = mdb_txn_begin (db_data->env, NULL, txn_flags, &txn);
+    int rc = db_txn_begin (shard, MDB_RDONLY, &txn, NULL);
     if (rc != 0) {
-        g_log (NULL, G_LOG_LEVEL_ERROR, "mdb_txn_begin failed: %s\n", mdb_strerror (rc));
+        g_log (NULL, G_LOG_LEVEL_WARNING, "mdb_txn_begin failed: %s\n", mdb_strerror (rc));
+        return;
+    }
+    rc = mdb_cursor_open (txn, shard->dbi, &cursor);
+    if (rc != 0) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "mdb_cursor_open failed: %s\n", mdb_strerror (rc));
+        db_txn_abort (shard, txn);
         return;
     }
 
-    rc = mdb_cursor_open (txn, db_data->dbi, &cursor);
-    if (rc == 0) {
-        while (mdb_cursor_get (cursor, &key, &data, MDB_NEXT) == 0) {
-            gchar *db_filepath = g_strndup (key.mv_data, key.mv_size);
-            if (!g_file_test (db_filepath, G_FILE_TEST_EXISTS)) {
-                if (delete_file_from_db == FALSE) {
-                    record_change (summary_data, db_filepath, CHANGE_MISSING_IN_FS);
-                } else {
-                    rc = mdb_del (txn, db_data->dbi, &key, NULL);
-                    if (rc != 0) {
-                        g_log (NULL, G_LOG_LEVEL_ERROR, "mdb_del failed: %s\n", mdb_strerror (rc));
-                    }
+    GPtrArray *to_delete = NULL;
+    if (range->start.mv_data) {
+        key = range->start;
+        rc = mdb_cursor_get (cursor, &key, &data, MDB_SET_RANGE);
+    } else {
+        rc = db_cursor_first (cursor, &key, &data);
+    }
+    while (rc == 0) {
+        if (range->end.mv_data && mdb_cmp (txn, shard->dbi, &key, &range->end) >= 0) break;
+
+        gchar *db_filepath = g_strndup (key.mv_data, key.mv_size);
+        if (pass->moved_paths && g_hash_table_contains (pass->moved_paths, db_filepath)) {
+            g_free (db_filepath);
+        } else if (!path_is_tracked (db_filepath)) {
+            if (pass->delete_file_from_db == FALSE) {
+                record_change (pass->summary_data, db_filepath, CHANGE_MISSING_IN_FS);
+                g_free (db_filepath);
+            } else {
+                if (!to_delete) to_delete = g_ptr_array_new_with_free_func (g_free);
+                g_ptr_array_add (to_delete, db_filepath);
+                if (to_delete->len >= MISSING_DELETE_BATCH) {
+                    queue_deletions (pass, shard, to_delete);
+                    to_delete = NULL;
                 }
             }
+        } else {
             g_free (db_filepath);
         }
-        mdb_cursor_close (cursor);
+        rc = mdb_cursor_get (cursor, &key, &data, MDB_NEXT);
     }
 
+    mdb_cursor_close (cursor);
+    db_txn_abort (shard, txn);
+
+    if (to_delete) queue_deletions (pass, shard, to_delete);
+}
+
+
+static gpointer
+missing_files_worker (gpointer data)
+{
+    MissingPass *pass = data;
+    gint index;
+
+    while ((index = g_atomic_int_add (&pass->next_range, 1)) < (gint)pass->ranges->len) {
+        check_key_range (pass, g_ptr_array_index (pass->ranges, index));
+    }
+    return NULL;
+}
+
+
+// Deletes one batch in a single write transaction; returns MDB_MAP_FULL when it has to be retried on a larger map
+static int
+delete_batch (DeleteBatch *batch,
+              guint64     *map_size)
+{
+    MDB_txn *txn;
+    DbShard *shard = batch->shard;
+
+    int rc = db_txn_begin (shard, 0, &txn, map_size);
+    if (rc != 0) {
+        g_log (NULL, G_LOG_LEVEL_ERROR, "mdb_txn_begin failed: %s\n", mdb_strerror (rc));
+        return rc;
+    }
+
+    for (guint i = 0; i < batch->keys->len && rc == 0; i++) {
+        const gchar *filepath = g_ptr_array_index (batch->keys, i);
+        MDB_val key = { .mv_size = strlen (filepath) + 1, .mv_data = (void *)filepath };
+        rc = db_del_entry (shard, txn, &key);
+        if (rc == MDB_NOTFOUND) rc = 0;
+    }
+    if (rc != 0) {
+        if (rc != MDB_MAP_FULL) g_log (NULL, G_LOG_LEVEL_ERROR, "mdb_del failed: %s\n", mdb_strerror (rc));
+        db_txn_abort (shard, txn);
+        return rc;
+    }
+    return db_txn_commit (shard, txn);
+}
+
+
+// Single writer: LMDB allows one write transaction per environment, batching keeps their number low
+static gpointer
+missing_files_writer (gpointer data)
+{
+    MissingPass *pass = data;
+    DeleteBatch *batch;
+
+    while ((batch = g_async_queue_pop (pass->deletions))->shard != NULL) {
+        guint64 map_size = 0;
+        while (delete_batch (batch, &map_size) == MDB_MAP_FULL) {
+            if (!db_grow (batch->shard, map_size)) break;
+        }
+        g_ptr_array_free (batch->keys, TRUE);
+        g_free (batch);
+    }
+    g_free (batch);
+    return NULL;
+}
+
+
+void
+handle_missing_files_from_fs (DatabaseData *db_data,
+                              SummaryData  *summary_data,
+                              gboolean      delete_file_from_db,
+                              GHashTable   *moved_paths,
+                              guint         threads_count)
+{
+    MissingPass pass = {
+        .summary_data = summary_data,
+        .delete_file_from_db = delete_file_from_db,
+        .moved_paths = moved_paths,
+        .ranges = g_ptr_array_new_with_free_func (key_range_free),
+        .next_range = 0,
+        .deletions = NULL
+    };
+
+    threads_count = MAX (threads_count, 1);
+    for (guint i = 0; i < db_data->n_shards; i++) {
+        plan_key_ranges (&db_data->shards[i], threads_count * MISSING_RANGES_PER_THREAD, pass.ranges);
+    }
+    threads_count = MIN (threads_count, pass.ranges->len);
+    g_debug ("Checking for missing files in %u key ranges with %u threads", pass.ranges->len, threads_count);
+
+    GThread *writer = NULL;
     if (delete_file_from_db) {
-        mdb_txn_commit (txn);
-    } else {
-        mdb_txn_abort (txn);
+        pass.deletions = g_async_queue_new ();
+        writer = g_thread_new ("missing-writer", missing_files_writer, &pass);
+    }
+
+    GThread **workers = g_new (GThread *, threads_count);
+    for (guint i = 0; i < threads_count; i++) {
+        workers[i] = g_thread_new ("missing-files", missing_files_worker, &pass);
+    }
+    for (guint i = 0; i < threads_count; i++) {
+        g_thread_join (workers[i]);
+    }
+    g_free (workers);
+
+    if (writer) {
+        DeleteBatch *stop = g_new0 (DeleteBatch, 1);
+        g_async_queue_push (pass.deletions, stop);
+        g_thread_join (writer);
+        g_async_queue_unref (pass.deletions);
+    }
+
+    g_ptr_array_free (pass.ranges, TRUE);
+}
+
+
+static gboolean
+is_moved_away (ConsumerData *consumer_data,
+               const char   *filepath)
+{
+    g_mutex_lock (&consumer_data->moved_lock);
+    gboolean moved = g_hash_table_contains (consumer_data->moved_paths, filepath);
+    g_mutex_unlock (&consumer_data->moved_lock);
+    return moved;
+}
+
+
+// A listed file that does not exist: what the missing-files pass would have done, for this path only
+static guint
+handle_missing_listed_file (const char   *filepath,
+                            ConsumerData *consumer_data)
+{
+    DbShard *shard = db_route (consumer_data->db_data, filepath);
+    Mode op = consumer_data->mode;
+
+    // Its record went to the file that was moved here: that file was reported
+    if (is_moved_away (consumer_data, filepath)) return PROCESS_FILE_SKIPPED;
+
+    if (op == MODE_UPDATE) {
+        guint64 map_size = 0;
+        int rc;
+        while ((rc = delete_entry (filepath, shard, &map_size)) == MDB_MAP_FULL) {
+            if (!db_grow (shard, map_size)) break;
+        }
+        return rc == 0 ? CHANGE_BIT(CHANGE_MISSING_IN_FS) : PROCESS_FILE_FAILED;
     }
+
+    gboolean in_db = FALSE;
+    if (op == MODE_CHECK) {
+        MDB_txn *txn;
+        MDB_val key = { .mv_size = strlen (filepath) + 1, .mv_data = (void *)filepath }, data;
+        if (db_txn_begin (shard, MDB_RDONLY, &txn, NULL) == 0) {
+            in_db = mdb_get (txn, shard->dbi, &key, &data) == 0;
+            db_txn_abort (shard, txn);
+        }
+    }
+    if (in_db) {
+        record_change (consumer_data->summary_data, filepath, CHANGE_MISSING_IN_FS);
+        return CHANGE_BIT(CHANGE_MISSING_IN_FS);
+    }
+    g_log (NULL, G_LOG_LEVEL_WARNING, "Listed file not found: %s\n", filepath);
+    return PROCESS_FILE_FAILED;
 }
 
 
 void
+handle_missing_files_under (ConsumerData *consumer_data,
+                            const gchar  *dir_path)
+{
+    DatabaseData *db_data = consumer_data->db_data;
+    gchar *prefix = g_str_has_suffix (dir_path, "/") ? g_strdup (dir_path) : g_strconcat (dir_path, "/", NULL);
+    gsize prefix_len = strlen (prefix);
+    GPtrArray *missing = g_ptr_array_new_with_free_func (g_free);
+
+    // Keys are sorted: the records below dir_path are one contiguous range of every shard
+    for (guint i = 0; i < db_data->n_shards; i++) {
+        DbShard *shard = &db_data->shards[i];
+        MDB_txn *txn;
+        MDB_cursor *cursor;
+        MDB_val key = { .mv_size = prefix_len, .mv_data = prefix }, data;
+
+        if (db_txn_begin (shard, MDB_RDONLY, &txn, NULL) != 0) continue;
+        if (mdb_cursor_open (txn, shard->dbi, &cursor) == 0) {
+            int rc = mdb_cursor_get (cursor, &key, &data, MDB_SET_RANGE);
+            while (rc == 0 && key.mv_size > prefix_len && memcmp (key.mv_data, prefix, prefix_len) == 0) {
+                gchar *db_filepath = g_strndup (key.mv_data, key.mv_size);
+                if (!path_is_tracked (db_filepath) && !is_moved_away (consumer_data, db_filepath)) {
+                    g_ptr_array_add (missing, db_filepath);
+                } else {
+                    g_free (db_filepath);
+                }
+                rc = mdb_cursor_get (cursor, &key, &data, MDB_NEXT);
+            }
+            mdb_cursor_close (cursor);
+        }
+        db_txn_abort (shard, txn);
+    }
+
+    // Reported (or deleted) once the read transactions are closed
+    for (guint i = 0; i < missing->len; i++) {
+        const gchar *filepath = g_ptr_array_index (missing, i);
+        consumer_data_notify (consumer_data, filepath, handle_missing_listed_file (filepath, consumer_data));
+    }
+
+    g_ptr_array_free (missing, TRUE);
+    g_free (prefix);
+}
+
+
+guint
 process_file (const gchar  *file_path,
               ConsumerData *consumer_data)
 {
-    if (!validate_filepath (file_path)) {
+    // Checks hash the content only after looking up the record, which tells how (and whether) to hash it
+    gboolean hash_content = consumer_data->mode != MODE_CHECK;
+
+    if (consumer_data->verify_deadline_us > 0) {
+        // The plan starts with the files covering the share of the verification cycle: the time budget can't defer them
+        gboolean in_floor = g_atomic_int_get (&consumer_data->verify_floor_files) > 0 &&
+                            g_atomic_int_add (&consumer_data->verify_floor_files, -1) > 0;
+        if (!in_floor && g_get_monotonic_time () > consumer_data->verify_deadline_us) {
+            summary_add_deferred (consumer_data->summary_data);
+            return PROCESS_FILE_SKIPPED;
+        }
+    }
+
+    // Opened once: the metadata and the content that are checked come from the same file, with no further path lookup
+    io_watch_read_begin ();
+    FileInfo info = { .fd = (file_path && *file_path) ? open_file (file_path) : -1 };
+    if (!io_watch_read_end ()) {
+        // Given up while opening: the watchdog reported the file
+        if (info.fd >= 0) close (info.fd);
+        return PROCESS_FILE_FAILED;
+    }
+    if (info.fd < 0) {
+        // A symlink is handled like a file that is gone, see path_is_tracked()
+        if (errno != ENOENT && errno != ENOTDIR && errno != ELOOP) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "Could not open file %s: %s\n", file_path, g_strerror (errno));
+            return PROCESS_FILE_FAILED;
+        }
+        if (consumer_data->listed_paths) {
+            return handle_missing_listed_file (file_path, consumer_data);
+        }
+        // Planned files that vanished meanwhile are reported by the missing-files pass
+        if (consumer_data->mode == MODE_CHECK && !(consumer_data->check_scope & CHECK_METADATA)) return PROCESS_FILE_SKIPPED;
         g_log (NULL, G_LOG_LEVEL_ERROR, "Invalid file path: %s\n", file_path);
-        return;
+        return PROCESS_FILE_FAILED;
     }
 
-    FileInfo info;
-    if (get_file_info (file_path, consumer_data->config_data->max_ram_per_thread, &info)) {
-        handle_db_operation (file_path, &info, consumer_data->db_data, consumer_data->summary_data, consumer_data->config_data->mode);
+    guint result = PROCESS_FILE_FAILED;
+    if (get_file_info (file_path, consumer_data, hash_content, &info)) {
+        if (hash_content) {
+            account_read (consumer_data, info.hash_format == HASH_FORMAT_SPARSE
+                                         ? MIN(info.st.st_size, info.st.st_blocks * 512) : info.st.st_size);
+        }
+        result = handle_db_operation (file_path, &info, consumer_data);
     }
-}
\ No newline at end of file
+    close (info.fd);
+    return result;
+}
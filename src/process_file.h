@@ -1,11 +1,41 @@
 #pragma once
 
 #include <glib.h>
+#include "calibration.h"
 #include "queue.h"
 
-void process_file                 (const gchar  *file_path,
+// Outcome of process_file(): CHANGE_BIT() flags of the detected changes (0 when the file matches or was stored),
+// or one of these when the file could not be processed
+#define PROCESS_FILE_SKIPPED (1u << 30)     // not looked at (budget exhausted, or left to the missing-files pass)
+#define PROCESS_FILE_FAILED  (1u << 31)     // could not be read, hashed or stored
+
+guint process_file                (const gchar  *file_path,
                                    ConsumerData *consumer_data);
 
+// Writes the verification times still queued by the workers (record_verified); called once the workers are done
+void flush_verified               (ConsumerData *consumer_data);
+
+// The two ways a plain hash is computed, exposed for the calibration probe and the hash benchmark.
+// Both hash the whole file from its start; hash_mapped_file() returns FALSE if the file can't be mapped.
+gboolean hash_mapped_file         (int           fd,
+                                   guint64      *hash);
+
+guint64 hash_chunked_file         (int           fd,
+                                   const char   *filepath,
+                                   gsize         buffer_size);
+
+// Strategy for devices without a calibration, derived from the per-thread RAM
+HashTuning hash_tuning_default    (const ConfigData *config_data);
+
+// Looks for database records whose file is gone, walking key ranges of every shard on threads_count threads.
+// Missing files are reported, or deleted in batches by a single writer thread when delete_file_from_db is set.
+// Records in moved_paths (may be NULL) were taken over by moved files and are skipped.
 void handle_missing_files_from_fs (DatabaseData *db_data,
                                    SummaryData  *summary_data,
-                                   gboolean      delete_file_from_db);
\ No newline at end of file
+                                   gboolean      delete_file_from_db,
+                                   GHashTable   *moved_paths,
+                                   guint         threads_count);
+
+// Same as handle_missing_files_from_fs() for the records below dir_path only; outcomes also go to on_result
+void handle_missing_files_under   (ConsumerData *consumer_data,
+                                   const gchar  *dir_path);
@@ -23,6 +23,36 @@ get_max_queue_size (guint64 usable_ram)
 }
 
 
+void
+file_queue_push_buffer (FileQueueData *file_queue_data,
+                        GPtrArray     *buffer)
+{
+    guint sleep_us = 1000; // start with 1ms
+    for (guint i = 0; i < buffer->len; i++) {
+        while (g_async_queue_length (file_queue_data->queue) >= file_queue_data->max_size) {
+            // Exponential backoff up to 10ms to reduce CPU while waiting for consumers
+            g_usleep (sleep_us);
+            if (sleep_us < 10000) sleep_us = MIN (sleep_us * 2, 10000);
+        }
+        sleep_us = 1000; // reset after a successful push
+        if (buffer->pdata[i] != NULL) g_async_queue_push (file_queue_data->queue, buffer->pdata[i]);
+    }
+    g_ptr_array_set_size (buffer, 0);
+}
+
+
+void
+consumer_data_notify (ConsumerData *consumer_data,
+                      const gchar  *path,
+                      guint         result)
+{
+    if (consumer_data->on_result == NULL) return;
+    g_mutex_lock (&consumer_data->on_result_lock);
+    consumer_data->on_result (path, result, consumer_data->on_result_data);
+    g_mutex_unlock (&consumer_data->on_result_lock);
+}
+
+
 void
 free_file_queue (FileQueueData *file_queue_data)
 {
@@ -4,6 +4,11 @@
 #include "config.h"
 #include "database.h"
 #include "summary.h"
+#include "bulk_load.h"
+#include "prefetch.h"
+#include "calibration.h"
+#include "io_watchdog.h"
+#include "memory_budget.h"
 
 typedef struct file_queue_t {
     GAsyncQueue *queue;
@@ -11,14 +16,49 @@ typedef struct file_queue_t {
     gboolean scanning_done;
 } FileQueueData;
 
+typedef enum check_scope_t {
+    CHECK_METADATA = 1 << 0,    // compare inode, link and block counts (cheap, stat only)
+    CHECK_CONTENT  = 1 << 1     // hash the file and compare the content hash
+} CheckScope;
+
 typedef struct consumer_data_t {
     GThreadPool *thread_pool;
     FileQueueData *file_queue_data;
     ConfigData *config_data;
     DatabaseData *db_data;
     SummaryData *summary_data;
+    Mode mode;                    // operation of this run (batches of one context may run different ones)
+    guint check_scope;            // CheckScope flags used in MODE_CHECK
+    gboolean record_verified;     // store the verification time of files whose content matched
+    GPtrArray **verified;         // per shard: verification times not written yet, protected by verified_lock
+    GMutex verified_lock;
+    gint64 verify_deadline_us;    // monotonic time after which no more content checks are started (0 = none)
+    gint verify_floor_files;      // atomic: the next content checks still start past the deadline (verification cycle)
+    gboolean listed_paths;        // files come from --files-from: missing files are handled per listed path
+    MemoryBudget *memory_budget;  // shared by all runs of the context: file data held by the workers
+    const Calibration *calibration;     // NULL when hashing strategies are not calibrated
+    IoWatchdog *io_watchdog;            // shared by all runs of the context, NULL when read_timeout is 0
+    GHashTable *moved_paths;            // paths whose record was taken over by a moved file -> the new path
+    GMutex moved_lock;
+    Prefetcher *prefetcher;       // starts reading the files handed to the workers ahead of them (NULL when disabled)
+    BulkLoader *bulk_loader;      // MODE_ADD into empty databases: records are collected and written sorted at the end
+    void (*on_result) (const gchar *path, guint result, gpointer data);    // optional per-file outcome, see process_file()
+    gpointer on_result_data;
+    GMutex on_result_lock;        // on_result is never called concurrently
+    gint pending;                 // atomic: files handed to the workers and not finished yet
+    gint files_done;              // atomic: files finished by the workers (throughput measurement)
+    gsize bytes_read;             // atomic: file content read by the workers (throughput measurement)
+    GMutex pending_lock;
+    GCond pending_cond;
 } ConsumerData;
 
 FileQueueData *init_file_queue (guint64        usable_ram);
 
-void free_file_queue           (FileQueueData *file_queue_data);
\ No newline at end of file
+void file_queue_push_buffer    (FileQueueData *file_queue_data,
+                                GPtrArray     *buffer);
+
+void free_file_queue           (FileQueueData *file_queue_data);
+
+void consumer_data_notify      (ConsumerData  *consumer_data,
+                                const gchar   *path,
+                                guint          result);
\ No newline at end of file
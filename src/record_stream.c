@@ -0,0 +1,242 @@
+#include <glib.h>
+#include <lmdb.h>
+#include <string.h>
+#include "record_stream.h"
+
+#define RECORD_TXN_RECORDS 100000   // records written per transaction
+
+typedef struct record_source_t {
+    DbShard *shard;
+    MDB_txn *txn;
+    MDB_cursor *cursor;
+    MDB_val key;
+    MDB_val data;
+    gboolean active;
+} RecordSource;
+
+struct record_merger_t {
+    GArray *sources;        // RecordSource, one per shard of every database
+    gint current;           // source of the record returned last, advanced by the next call
+};
+
+struct record_writer_t {
+    DatabaseData *target;
+    GPtrArray **batches;    // RecordItem, one batch per target shard
+    unsigned int put_flags;
+    guint64 written;
+    gboolean failed;
+};
+
+
+RecordItem *
+record_item_new (const gchar         *key,
+                 gsize                key_len,
+                 const FileEntryData *entry)
+{
+    RecordItem *item = g_malloc (sizeof(RecordItem) + key_len);
+    item->entry = *entry;
+    item->entry.filepath = NULL;
+    item->key_len = key_len;
+    memcpy (item->key, key, key_len);
+    return item;
+}
+
+
+gint
+record_item_compare (const RecordItem *a,
+                     const RecordItem *b)
+{
+    MDB_val key_a = { .mv_size = a->key_len, .mv_data = (gpointer)a->key };
+    MDB_val key_b = { .mv_size = b->key_len, .mv_data = (gpointer)b->key };
+    return db_compare_keys (&key_a, &key_b);
+}
+
+
+RecordMerger *
+record_merger_new (DatabaseData **sources,
+                   guint          n_sources)
+{
+    RecordMerger *merger = g_new0 (RecordMerger, 1);
+    merger->sources = g_array_new (FALSE, TRUE, sizeof(RecordSource));
+    merger->current = -1;
+
+    for (guint d = 0; d < n_sources; d++) {
+        for (guint i = 0; i < sources[d]->n_shards; i++) {
+            RecordSource source = { .shard = &sources[d]->shards[i] };
+            int rc = db_txn_begin (source.shard, MDB_RDONLY, &source.txn, NULL);
+            if (rc == 0) {
+                rc = mdb_cursor_open (source.txn, source.shard->dbi, &source.cursor);
+                if (rc != 0) db_txn_abort (source.shard, source.txn);
+            }
+            if (rc != 0) {
+                g_log (NULL, G_LOG_LEVEL_WARNING, "Failed to read %s: %s", source.shard->path, mdb_strerror (rc));
+                record_merger_free (merger);
+                return NULL;
+            }
+            source.active = db_cursor_first (source.cursor, &source.key, &source.data) == 0;
+            g_array_append_val (merger->sources, source);
+        }
+    }
+
+    return merger;
+}
+
+
+gboolean
+record_merger_next (RecordMerger  *merger,
+                    MDB_val       *key,
+                    FileEntryData *entry)
+{
+    GArray *sources = merger->sources;
+
+    // Move past the record returned last, in every source holding the same path
+    if (merger->current >= 0) {
+        MDB_val previous = g_array_index (sources, RecordSource, merger->current).key;
+        for (guint i = 0; i < sources->len; i++) {
+            RecordSource *source = &g_array_index (sources, RecordSource, i);
+            if (source->active && db_compare_keys (&source->key, &previous) == 0) {
+                source->active = mdb_cursor_get (source->cursor, &source->key, &source->data, MDB_NEXT) == 0;
+            }
+        }
+    }
+
+    gint lowest = -1;
+    for (guint i = 0; i < sources->len; i++) {
+        RecordSource *source = &g_array_index (sources, RecordSource, i);
+        if (source->active &&
+            (lowest < 0 || db_compare_keys (&source->key, &g_array_index (sources, RecordSource, lowest).key) < 0)) {
+            lowest = (gint)i;
+        }
+    }
+    merger->current = lowest;
+    if (lowest < 0) return FALSE;
+
+    RecordSource *source = &g_array_index (sources, RecordSource, lowest);
+    *key = source->key;
+    db_read_entry (&source->data, entry);
+    return TRUE;
+}
+
+
+void
+record_merger_free (RecordMerger *merger)
+{
+    if (!merger) return;
+    for (guint i = 0; i < merger->sources->len; i++) {
+        RecordSource *source = &g_array_index (merger->sources, RecordSource, i);
+        mdb_cursor_close (source->cursor);
+        db_txn_abort (source->shard, source->txn);
+    }
+    g_array_free (merger->sources, TRUE);
+    g_free (merger);
+}
+
+
+RecordWriter *
+record_writer_new (DatabaseData *target)
+{
+    RecordWriter *writer = g_new0 (RecordWriter, 1);
+    writer->target = target;
+    writer->put_flags = db_is_empty (target) ? MDB_APPEND : 0;
+    writer->batches = g_new (GPtrArray *, target->n_shards);
+    for (guint s = 0; s < target->n_shards; s++) writer->batches[s] = g_ptr_array_new_with_free_func (g_free);
+
+    return writer;
+}
+
+
+// Writes one batch in a single transaction; grows the map and retries on MDB_MAP_FULL
+static gboolean
+flush_batch (RecordWriter *writer,
+             guint         s)
+{
+    DbShard *shard = &writer->target->shards[s];
+    GPtrArray *batch = writer->batches[s];
+    guint64 map_size = 0;
+    int rc;
+
+    if (batch->len == 0) return TRUE;
+
+    do {
+        MDB_txn *txn;
+        rc = db_txn_begin (shard, 0, &txn, &map_size);
+        if (rc != 0) break;
+
+        for (guint i = 0; i < batch->len && rc == 0; i++) {
+            RecordItem *item = g_ptr_array_index (batch, i);
+            MDB_val key = { .mv_size = item->key_len, .mv_data = item->key };
+            MDB_val data = { .mv_size = sizeof(FileEntryData), .mv_data = &item->entry };
+            rc = db_put_entry (shard, txn, &key, &data, writer->put_flags);
+        }
+        if (rc == 0) {
+            rc = db_txn_commit (shard, txn);
+        } else {
+            db_txn_abort (shard, txn);
+        }
+        if (rc == MDB_MAP_FULL && !db_grow (shard, map_size)) break;
+    } while (rc == MDB_MAP_FULL);
+
+    if (rc != 0) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Writing into %s failed: %s", shard->path, mdb_strerror (rc));
+    } else {
+        writer->written += batch->len;
+    }
+    g_ptr_array_set_size (batch, 0);
+    return rc == 0;
+}
+
+
+gboolean
+record_writer_add (RecordWriter        *writer,
+                   const gchar         *key,
+                   gsize                key_len,
+                   const FileEntryData *entry)
+{
+    if (writer->failed) return FALSE;
+    return record_writer_take (writer, record_item_new (key, key_len, entry));
+}
+
+
+gboolean
+record_writer_take (RecordWriter *writer,
+                    RecordItem   *item)
+{
+    if (writer->failed) {
+        g_free (item);
+        return FALSE;
+    }
+
+    // Keys arrive in ascending order, so every shard receives them in ascending order too
+    guint s = (guint)(db_route (writer->target, item->key) - writer->target->shards);
+    g_ptr_array_add (writer->batches[s], item);
+    if (writer->batches[s]->len >= RECORD_TXN_RECORDS && !flush_batch (writer, s)) writer->failed = TRUE;
+
+    return !writer->failed;
+}
+
+
+gboolean
+record_writer_finish (RecordWriter *writer)
+{
+    for (guint s = 0; s < writer->target->n_shards && !writer->failed; s++) {
+        if (!flush_batch (writer, s)) writer->failed = TRUE;
+    }
+    return !writer->failed;
+}
+
+
+guint64
+record_writer_written (const RecordWriter *writer)
+{
+    return writer->written;
+}
+
+
+void
+record_writer_free (RecordWriter *writer)
+{
+    if (!writer) return;
+    for (guint s = 0; s < writer->target->n_shards; s++) g_ptr_array_free (writer->batches[s], TRUE);
+    g_free (writer->batches);
+    g_free (writer);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <lmdb.h>
+#include <glib.h>
+#include "database.h"
+
+// Sorted record streams, used to move records between databases without random writes:
+// a merger yields the records of several databases in key order (the order of a single database),
+// a writer loads records given in that order into the shards of a database in large transactions.
+typedef struct record_merger_t RecordMerger;
+typedef struct record_writer_t RecordWriter;
+
+// A record held outside the database (sorted runs, decoded dumps, pending batches), in one allocation freed with g_free()
+typedef struct record_item_t {
+    FileEntryData entry;
+    gsize key_len;          // includes the terminating NUL, like every key in the database
+    gchar key[];
+} RecordItem;
+
+RecordItem   *record_item_new       (const gchar          *key,
+                                     gsize                 key_len,
+                                     const FileEntryData  *entry);
+
+// db_compare_keys() on the keys of two items
+gint          record_item_compare   (const RecordItem     *a,
+                                     const RecordItem     *b);
+
+// Reads every shard of the sources in one read transaction each; NULL when a shard cannot be read
+RecordMerger *record_merger_new     (DatabaseData        **sources,
+                                     guint                 n_sources);
+
+// Next record in key order; FALSE at the end. A path stored in several shards is returned once, from the
+// first source holding it. key points into the database and stays valid until the next call.
+gboolean      record_merger_next    (RecordMerger         *merger,
+                                     MDB_val              *key,
+                                     FileEntryData        *entry);
+
+void          record_merger_free    (RecordMerger         *merger);
+
+// Records are routed to the shards of target. When target is empty the batches are written with
+// MDB_APPEND, which packs the B-trees densely; otherwise records replace the stored ones.
+RecordWriter *record_writer_new     (DatabaseData         *target);
+
+// key_len includes the terminating NUL. Keys must be given in ascending order.
+gboolean      record_writer_add     (RecordWriter         *writer,
+                                     const gchar          *key,
+                                     gsize                 key_len,
+                                     const FileEntryData  *entry);
+
+// Same as record_writer_add() without copying: the writer owns item afterwards, also when FALSE is returned
+gboolean      record_writer_take    (RecordWriter         *writer,
+                                     RecordItem           *item);
+
+// Writes the pending batches; returns FALSE if any batch failed
+gboolean      record_writer_finish  (RecordWriter         *writer);
+
+// Records committed so far
+guint64       record_writer_written (const RecordWriter   *writer);
+
+void          record_writer_free    (RecordWriter         *writer);
@@ -0,0 +1,239 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "report.h"
+#include "summary.h"
+
+#define REPORT_BUFFER_SIZE (1024 * 1024)
+#define REPORT_MAX_PENDING 65536            // producers wait once this many records are queued
+#define REPORT_FLUSH_INTERVAL_US (G_USEC_PER_SEC / 2)
+
+typedef struct report_record_t {
+    gint64 time_us;
+    guint changes;
+    gchar filepath[];
+} ReportRecord;
+
+struct report_sink_t {
+    FILE *out;
+    gboolean owns_out;
+    GAsyncQueue *queue;
+    GThread *writer;
+    ReportRecord *stop;     // sentinel pushed by report_close()
+};
+
+
+void
+report_append_json_string (GString     *line,
+                           const gchar *str)
+{
+    // Paths are arbitrary bytes: bytes that are not valid UTF-8 are escaped one by one
+    const gchar *valid_end = NULL;
+    g_utf8_validate (str, -1, &valid_end);
+
+    g_string_append_c (line, '"');
+    for (const guchar *c = (const guchar *)str; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            g_string_append_c (line, '\\');
+            g_string_append_c (line, (gchar)*c);
+        } else if (*c < 0x20 || ((const gchar *)c >= valid_end && *c >= 0x80)) {
+            g_string_append_printf (line, "\\u%04x", *c);
+        } else {
+            g_string_append_c (line, (gchar)*c);
+        }
+    }
+    g_string_append_c (line, '"');
+}
+
+
+void
+report_append_changes (GString *line,
+                       guint    changes)
+{
+    g_string_append (line, "\"changes\":[");
+    gboolean first = TRUE;
+    for (ChangeType change = 0; change < CHANGE_TYPE_COUNT; change++) {
+        if (!(changes & CHANGE_BIT(change))) continue;
+        g_string_append_printf (line, "%s\"%s\"", first ? "" : ",", change_type_to_key (change));
+        first = FALSE;
+    }
+    g_string_append_c (line, ']');
+}
+
+
+static void
+write_record (ReportSink         *sink,
+              const ReportRecord *record,
+              GString            *line)
+{
+    GDateTime *time = g_date_time_new_from_unix_utc (record->time_us / G_USEC_PER_SEC);
+    gchar *timestamp = g_date_time_format (time, "%Y-%m-%dT%H:%M:%SZ");
+
+    g_string_truncate (line, 0);
+    g_string_append_printf (line, "{\"time\":\"%s\",\"path\":", timestamp);
+    report_append_json_string (line, record->filepath);
+    g_string_append_c (line, ',');
+    report_append_changes (line, record->changes);
+    g_string_append (line, "}\n");
+
+    fwrite (line->str, 1, line->len, sink->out);
+
+    g_free (timestamp);
+    g_date_time_unref (time);
+}
+
+
+static gpointer
+report_writer (gpointer data)
+{
+    ReportSink *sink = (ReportSink *)data;
+    GString *line = g_string_sized_new (512);
+
+    while (TRUE) {
+        ReportRecord *record = g_async_queue_timeout_pop (sink->queue, REPORT_FLUSH_INTERVAL_US);
+        if (record == NULL) continue;
+
+        // Write everything that is already queued as one batch, then make it visible
+        gboolean stop = FALSE;
+        do {
+            if (record == sink->stop) {
+                stop = TRUE;
+                continue;
+            }
+            write_record (sink, record, line);
+            g_free (record);
+        } while ((record = g_async_queue_try_pop (sink->queue)) != NULL);
+        fflush (sink->out);
+
+        if (stop) break;
+    }
+
+    g_string_free (line, TRUE);
+    return NULL;
+}
+
+
+ReportSink *
+report_open (const gchar *path)
+{
+    ReportSink *sink = g_try_new0 (ReportSink, 1);
+    if (!sink) {
+        g_log (NULL, G_LOG_LEVEL_ERROR, "Failed to allocate memory for ReportSink");
+        return NULL;
+    }
+
+    if (g_strcmp0 (path, "-") == 0) {
+        sink->out = stdout;
+    } else {
+        sink->out = g_fopen (path, "w");
+        sink->owns_out = TRUE;
+    }
+    if (sink->out == NULL) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Unable to open the report file: %s", path);
+        g_free (sink);
+        return NULL;
+    }
+    if (sink->owns_out) setvbuf (sink->out, NULL, _IOFBF, REPORT_BUFFER_SIZE);
+
+    sink->stop = g_malloc0 (sizeof(ReportRecord));
+    sink->queue = g_async_queue_new ();
+    sink->writer = g_thread_new ("report-writer", report_writer, sink);
+
+    return sink;
+}
+
+
+void
+report_emit (ReportSink  *sink,
+             const gchar *filepath,
+             guint        changes)
+{
+    gsize path_len = strlen (filepath);
+    ReportRecord *record = g_malloc (sizeof(ReportRecord) + path_len + 1);
+    record->time_us = g_get_real_time ();
+    record->changes = changes;
+    memcpy (record->filepath, filepath, path_len + 1);
+
+    // Bounded memory: wait for the writer when it falls behind (e.g. a slow pipe)
+    while (g_async_queue_length (sink->queue) >= REPORT_MAX_PENDING) {
+        g_usleep (1000);
+    }
+    g_async_queue_push (sink->queue, record);
+}
+
+
+void
+report_close (ReportSink *sink)
+{
+    if (!sink) return;
+
+    g_async_queue_push (sink->queue, sink->stop);
+    g_thread_join (sink->writer);
+
+    g_async_queue_unref (sink->queue);
+    g_free (sink->stop);
+    if (sink->owns_out) fclose (sink->out);
+    g_free (sink);
+}
+
+
+// Every report is written in time order and every line starts with {"time":"<UTC timestamp>",
+// so merging the lines in byte order merges the reports in time order
+gboolean
+report_merge (const gchar * const *inputs,
+              gsize                n_inputs,
+              const gchar         *output)
+{
+    gboolean to_stdout = g_strcmp0 (output, "-") == 0;
+    FILE *out = to_stdout ? stdout : g_fopen (output, "w");
+    if (out == NULL) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Unable to open the report file: %s", output);
+        return FALSE;
+    }
+    if (!to_stdout) setvbuf (out, NULL, _IOFBF, REPORT_BUFFER_SIZE);
+
+    FILE **files = g_new0 (FILE *, n_inputs);
+    gchar **lines = g_new0 (gchar *, n_inputs);
+    gsize *capacities = g_new0 (gsize, n_inputs);
+    gboolean *pending = g_new0 (gboolean, n_inputs);
+    gboolean ok = TRUE;
+
+    for (gsize i = 0; i < n_inputs && ok; i++) {
+        files[i] = g_fopen (inputs[i], "r");
+        if (files[i] == NULL) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "Unable to open the report file: %s", inputs[i]);
+            ok = FALSE;
+            break;
+        }
+        pending[i] = getline (&lines[i], &capacities[i], files[i]) > 0;
+    }
+
+    guint64 merged = 0;
+    while (ok) {
+        gssize lowest = -1;
+        for (gsize i = 0; i < n_inputs; i++) {
+            if (pending[i] && (lowest < 0 || strcmp (lines[i], lines[lowest]) < 0)) lowest = (gssize)i;
+        }
+        if (lowest < 0) break;
+
+        gsize len = strlen (lines[lowest]);
+        ok = fputs (lines[lowest], out) >= 0 && (lines[lowest][len - 1] == '\n' || fputc ('\n', out) != EOF);
+        merged++;
+        pending[lowest] = getline (&lines[lowest], &capacities[lowest], files[lowest]) > 0;
+    }
+    ok = fflush (out) == 0 && ok;
+
+    for (gsize i = 0; i < n_inputs; i++) {
+        if (files[i]) fclose (files[i]);
+        free (lines[i]);
+    }
+    g_free (pending);
+    g_free (capacities);
+    g_free (lines);
+    g_free (files);
+    if (!to_stdout && fclose (out) != 0) ok = FALSE;
+
+    if (ok) g_message ("Merged %" G_GUINT64_FORMAT " report records from %" G_GSIZE_FORMAT " reports", merged, n_inputs);
+    return ok;
+}
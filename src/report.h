@@ -0,0 +1,29 @@
+#pragma once
+
+#include <glib.h>
+
+typedef struct report_sink_t ReportSink;
+
+// Opens a change report streamed as NDJSON to path ("-" for stdout) by a background writer thread
+ReportSink *report_open  (const gchar *path);
+
+void        report_emit  (ReportSink  *sink,
+                          const gchar *filepath,
+                          guint        changes);
+
+// Appends str as a JSON string literal; bytes that are not valid UTF-8 are escaped
+void        report_append_json_string (GString     *line,
+                                       const gchar *str);
+
+// Appends the "changes":[...] member listing the change keys set in changes
+void        report_append_changes     (GString     *line,
+                                       guint        changes);
+
+// Flushes all pending records and closes the sink
+void        report_close (ReportSink  *sink);
+
+// Merges change reports (e.g. written by the hosts of a --shard run) into a single one at output ("-" for stdout),
+// in time order
+gboolean    report_merge (const gchar * const *inputs,
+                          gsize                n_inputs,
+                          const gchar         *output);
@@ -0,0 +1,452 @@
+#define _GNU_SOURCE     // struct ucred
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <glib-unix.h>
+#include <gio/gio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <grp.h>
+#include "server.h"
+#include "report.h"
+
+#define SERVER_MAX_CONNECTIONS  32
+#define SERVER_MAX_FRAME_SIZE   (64 * 1024 * 1024)
+#define SERVER_MAX_PENDING      65536   // workers wait once this many response lines are queued
+#define SERVER_SOCKET_UMASK     0117    // the socket is created with mode 0660
+
+typedef struct server_t {
+    FfcContext *ctx;
+    GCancellable *cancellable;  // cancelled on shutdown: idle connections stop waiting for requests
+    gint active;                // connections being served
+    GMutex active_lock;
+    GCond active_cond;
+    GArray *allowed_uids;       // uid_t of the clients that are served
+    GArray *allowed_gids;       // gid_t of their primary group
+} Server;
+
+typedef struct server_request_t {
+    GOutputStream *out;
+    GAsyncQueue *lines;         // GString response lines, in the order the results were produced
+    GThread *writer;
+    GString *stop;              // sentinel pushed once the request is done
+    gint write_failed;          // the client went away: remaining lines are dropped
+    guint pending;              // lines queued and not written yet, protected by pending_lock
+    GMutex pending_lock;
+    GCond pending_cond;         // signalled by the writer for every line it took
+    guint files;
+    guint changed;
+    guint failed;
+} ServerRequest;
+
+
+static gboolean
+write_frame (GOutputStream *out,
+             const gchar   *payload,
+             gsize          len)
+{
+    guint32 header = GUINT32_TO_BE ((guint32)len);
+    return g_output_stream_write_all (out, &header, sizeof(header), NULL, NULL, NULL) &&
+           g_output_stream_write_all (out, payload, len, NULL, NULL, NULL);
+}
+
+
+static gpointer
+response_writer (gpointer data)
+{
+    ServerRequest *request = (ServerRequest *)data;
+
+    GString *line;
+    while ((line = g_async_queue_pop (request->lines)) != request->stop) {
+        if (!g_atomic_int_get (&request->write_failed) && !write_frame (request->out, line->str, line->len)) {
+            g_atomic_int_set (&request->write_failed, TRUE);
+        }
+        g_string_free (line, TRUE);
+
+        g_mutex_lock (&request->pending_lock);
+        request->pending--;
+        g_cond_broadcast (&request->pending_cond);
+        g_mutex_unlock (&request->pending_lock);
+    }
+
+    return NULL;
+}
+
+
+static void
+queue_line (ServerRequest *request,
+            GString       *line)
+{
+    // Bounded memory: the workers wait for the writer when the client reads slowly. Once the client is gone the
+    // writer drops the lines as fast as they come.
+    g_mutex_lock (&request->pending_lock);
+    while (request->pending >= SERVER_MAX_PENDING && !g_atomic_int_get (&request->write_failed)) {
+        g_cond_wait (&request->pending_cond, &request->pending_lock);
+    }
+    request->pending++;
+    g_mutex_unlock (&request->pending_lock);
+    g_async_queue_push (request->lines, line);
+}
+
+
+static void
+queue_result (const gchar *path,
+              guint        changes,
+              gpointer     user_data)
+{
+    ServerRequest *request = (ServerRequest *)user_data;
+    GString *line = g_string_sized_new (256);
+
+    g_string_append (line, "{\"path\":");
+    report_append_json_string (line, path);
+    if (changes == FFC_RESULT_FAILED) {
+        g_string_append (line, ",\"error\":\"failed\"}");
+        request->failed++;
+    } else if (changes == FFC_RESULT_SKIPPED) {
+        g_string_append (line, ",\"skipped\":true}");
+    } else {
+        g_string_append_c (line, ',');
+        report_append_changes (line, changes);
+        g_string_append_c (line, '}');
+        if (changes != 0) request->changed++;
+    }
+    request->files++;
+
+    queue_line (request, line);
+}
+
+
+static void
+queue_error (ServerRequest *request,
+             const gchar   *path,
+             const gchar   *error)
+{
+    GString *line = g_string_sized_new (256);
+    g_string_append (line, "{\"path\":");
+    report_append_json_string (line, path);
+    g_string_append_printf (line, ",\"error\":\"%s\"}", error);
+    request->failed++;
+    queue_line (request, line);
+}
+
+
+static gboolean
+parse_operation (const gchar *op,
+                 Mode        *mode,
+                 gboolean    *tree)
+{
+    static const struct { const gchar *name; Mode mode; } operations[] = {
+        { "check", MODE_CHECK },
+        { "add", MODE_ADD },
+        { "update", MODE_UPDATE },
+    };
+
+    for (gsize i = 0; i < G_N_ELEMENTS (operations); i++) {
+        gsize len = strlen (operations[i].name);
+        if (strncmp (op, operations[i].name, len) != 0) continue;
+        if (op[len] == '\0' || g_strcmp0 (op + len, "-tree") == 0) {
+            *mode = operations[i].mode;
+            *tree = op[len] != '\0';
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+
+// Payload: the operation followed by the paths, all NUL separated. Results are streamed back one NDJSON
+// frame per path, then a final {"done":true,...} frame.
+static void
+serve_request (Server        *server,
+               GOutputStream *out,
+               gchar         *payload,
+               gsize          len)
+{
+    ServerRequest request = { .out = out };
+    g_mutex_init (&request.pending_lock);
+    g_cond_init (&request.pending_cond);
+    request.lines = g_async_queue_new ();
+    request.stop = g_string_new (NULL);
+    request.writer = g_thread_new ("ffc-response", response_writer, &request);
+
+    GPtrArray *paths = g_ptr_array_new_with_free_func (g_free);
+    const gchar *op = payload;
+    for (const gchar *p = op + strlen (op) + 1; p < payload + len; p += strlen (p) + 1) {
+        if (*p == '\0') continue;
+        if (!g_path_is_absolute (p)) {
+            queue_error (&request, p, "not an absolute path");
+            continue;
+        }
+        // Database keys are canonical paths: "/a//b/../c/" must match "/a/c"
+        g_ptr_array_add (paths, g_canonicalize_filename (p, NULL));
+    }
+
+    Mode mode;
+    gboolean tree;
+    const gchar *error = NULL;
+    if (!parse_operation (op, &mode, &tree)) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Server: unknown operation '%s'", op);
+        error = "bad request";
+    } else if (tree) {
+        for (guint i = 0; i < paths->len && error == NULL; i++) {
+            if (!ffc_process_tree (server->ctx, mode, g_ptr_array_index (paths, i), queue_result, &request)) error = "failed";
+        }
+    } else if (paths->len > 0) {
+        const gchar * const *list = (const gchar * const *)paths->pdata;
+        gboolean ok;
+        if (mode == MODE_CHECK) {
+            ok = ffc_verify (server->ctx, list, paths->len, queue_result, &request);
+        } else if (mode == MODE_ADD) {
+            ok = ffc_add (server->ctx, list, paths->len, queue_result, &request);
+        } else {
+            ok = ffc_update (server->ctx, list, paths->len, queue_result, &request);
+        }
+        if (!ok) error = "failed";
+    }
+
+    GString *done = g_string_new (NULL);
+    if (error == NULL) {
+        g_string_printf (done, "{\"done\":true,\"files\":%u,\"changed\":%u,\"failed\":%u}",
+                         request.files, request.changed, request.failed);
+    } else {
+        g_string_printf (done, "{\"done\":true,\"error\":\"%s\"}", error);
+    }
+    queue_line (&request, done);
+    g_async_queue_push (request.lines, request.stop);
+    g_thread_join (request.writer);
+
+    g_ptr_array_free (paths, TRUE);
+    g_string_free (request.stop, TRUE);
+    g_async_queue_unref (request.lines);
+    g_cond_clear (&request.pending_cond);
+    g_mutex_clear (&request.pending_lock);
+}
+
+
+// The peer credentials are those of the process that connected, as checked by the kernel
+static gboolean
+client_allowed (Server            *server,
+                GSocketConnection *connection)
+{
+    GError *error = NULL;
+    GCredentials *credentials = g_socket_get_credentials (g_socket_connection_get_socket (connection), &error);
+    if (credentials == NULL) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Server: unable to get the client credentials: %s", error->message);
+        g_clear_error (&error);
+        return FALSE;
+    }
+
+    const struct ucred *peer = g_credentials_get_native (credentials, G_CREDENTIALS_TYPE_LINUX_UCRED);
+    gboolean allowed = FALSE;
+    for (guint i = 0; peer && i < server->allowed_uids->len && !allowed; i++) {
+        allowed = g_array_index (server->allowed_uids, uid_t, i) == peer->uid;
+    }
+    for (guint i = 0; peer && i < server->allowed_gids->len && !allowed; i++) {
+        allowed = g_array_index (server->allowed_gids, gid_t, i) == peer->gid;
+    }
+    if (!allowed && peer) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Server: refused a client with uid %u, gid %u (pid %d)",
+               (guint)peer->uid, (guint)peer->gid, (gint)peer->pid);
+    }
+    g_object_unref (credentials);
+
+    return allowed;
+}
+
+
+// Appends the ids of a comma-separated list of names or numbers; FALSE on an unknown name
+static gboolean
+parse_ids (const gchar *list,
+           gboolean     groups,
+           GArray      *ids)
+{
+    if (list == NULL) return TRUE;
+
+    gchar **names = g_strsplit (list, ",", -1);
+    gboolean ok = TRUE;
+    for (gchar **name = names; *name && ok; name++) {
+        g_strstrip (*name);
+        if (**name == '\0') continue;
+
+        gchar *end;
+        guint64 number = g_ascii_strtoull (*name, &end, 10);
+        if (*end == '\0' && number <= G_MAXUINT32) {
+            guint32 id = (guint32)number;
+            g_array_append_val (ids, id);
+        } else if (groups) {
+            struct group *group = getgrnam (*name);
+            ok = group != NULL;
+            if (ok) g_array_append_val (ids, group->gr_gid);
+        } else {
+            struct passwd *user = getpwnam (*name);
+            ok = user != NULL;
+            if (ok) g_array_append_val (ids, user->pw_uid);
+        }
+        if (!ok) g_log (NULL, G_LOG_LEVEL_WARNING, "Server: unknown %s '%s' in allowed_%s", groups ? "group" : "user", *name, groups ? "groups" : "users");
+    }
+    g_strfreev (names);
+
+    return ok;
+}
+
+
+static gboolean
+handle_connection (GThreadedSocketService *service __attribute__((unused)),
+                   GSocketConnection      *connection,
+                   GObject                *source __attribute__((unused)),
+                   gpointer                user_data)
+{
+    Server *server = (Server *)user_data;
+    GInputStream *in = g_io_stream_get_input_stream (G_IO_STREAM (connection));
+    GOutputStream *out = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+
+    if (!client_allowed (server, connection)) return TRUE;
+
+    g_mutex_lock (&server->active_lock);
+    server->active++;
+    g_mutex_unlock (&server->active_lock);
+
+    // A connection may send any number of requests, one after the other
+    while (!g_cancellable_is_cancelled (server->cancellable)) {
+        guint32 header;
+        gsize bytes_read = 0;
+        if (!g_input_stream_read_all (in, &header, sizeof(header), &bytes_read, server->cancellable, NULL) ||
+            bytes_read != sizeof(header)) {
+            break;
+        }
+
+        gsize len = GUINT32_FROM_BE (header);
+        if (len == 0 || len > SERVER_MAX_FRAME_SIZE) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "Server: invalid request size %" G_GSIZE_FORMAT ", closing the connection", len);
+            break;
+        }
+
+        // NUL terminated so that the last path needs no trailing separator
+        gchar *payload = g_try_malloc (len + 1);
+        if (payload == NULL) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "Server: failed to allocate memory for a request");
+            break;
+        }
+        if (!g_input_stream_read_all (in, payload, len, &bytes_read, server->cancellable, NULL) || bytes_read != len) {
+            g_free (payload);
+            break;
+        }
+        payload[len] = '\0';
+
+        serve_request (server, out, payload, len);
+        g_free (payload);
+    }
+
+    g_mutex_lock (&server->active_lock);
+    if (--server->active == 0) g_cond_broadcast (&server->active_cond);
+    g_mutex_unlock (&server->active_lock);
+
+    return TRUE;
+}
+
+
+static gboolean
+quit_loop (gpointer user_data)
+{
+    g_main_loop_quit ((GMainLoop *)user_data);
+    return G_SOURCE_CONTINUE;
+}
+
+
+gboolean
+server_run (FfcContext       *ctx,
+            const ConfigData *config_data)
+{
+    const gchar *socket_path = config_data->socket_path;
+
+    // Root and the server's own user and group, and the configured ones
+    GArray *allowed_uids = g_array_new (FALSE, FALSE, sizeof(uid_t));
+    GArray *allowed_gids = g_array_new (FALSE, FALSE, sizeof(gid_t));
+    uid_t root = 0, uid = geteuid ();
+    gid_t gid = getegid ();
+    g_array_append_val (allowed_uids, root);
+    g_array_append_val (allowed_uids, uid);
+    g_array_append_val (allowed_gids, gid);
+    if (!parse_ids (config_data->allowed_users, FALSE, allowed_uids) ||
+        !parse_ids (config_data->allowed_groups, TRUE, allowed_gids)) {
+        g_array_free (allowed_uids, TRUE);
+        g_array_free (allowed_gids, TRUE);
+        return FALSE;
+    }
+
+    // Replace the socket left behind by a previous instance, never any other file
+    GStatBuf st;
+    if (g_lstat (socket_path, &st) == 0) {
+        if (!S_ISSOCK (st.st_mode)) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "Server: %s exists and is not a socket", socket_path);
+            g_array_free (allowed_uids, TRUE);
+            g_array_free (allowed_gids, TRUE);
+            return FALSE;
+        }
+        g_unlink (socket_path);
+    }
+
+    Server server = { .ctx = ctx, .allowed_uids = allowed_uids, .allowed_gids = allowed_gids };
+    g_mutex_init (&server.active_lock);
+    g_cond_init (&server.active_cond);
+    server.cancellable = g_cancellable_new ();
+
+    GError *error = NULL;
+    GSocketService *service = g_threaded_socket_service_new (SERVER_MAX_CONNECTIONS);
+    GSocketAddress *address = g_unix_socket_address_new (socket_path);
+    // Created with its final mode: a chmod after bind() would leave a window where anyone may connect. The umask is
+    // per process, but it only makes files created meanwhile by other threads (the log) less accessible.
+    mode_t old_umask = umask (SERVER_SOCKET_UMASK);
+    gboolean ok = g_socket_listener_add_address (G_SOCKET_LISTENER (service), address, G_SOCKET_TYPE_STREAM,
+                                                 G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL, &error);
+    umask (old_umask);
+    g_object_unref (address);
+    if (!ok) {
+        g_log (NULL, G_LOG_LEVEL_WARNING, "Server: unable to listen on %s: %s", socket_path, error->message);
+        g_clear_error (&error);
+        g_object_unref (service);
+        g_object_unref (server.cancellable);
+        g_cond_clear (&server.active_cond);
+        g_mutex_clear (&server.active_lock);
+        g_array_free (allowed_uids, TRUE);
+        g_array_free (allowed_gids, TRUE);
+        return FALSE;
+    }
+
+    g_signal_connect (service, "run", G_CALLBACK (handle_connection), &server);
+    g_socket_service_start (service);
+
+    GMainLoop *loop = g_main_loop_new (NULL, FALSE);
+    guint sigint_id = g_unix_signal_add (SIGINT, quit_loop, loop);
+    guint sigterm_id = g_unix_signal_add (SIGTERM, quit_loop, loop);
+
+    g_message ("Listening on %s", socket_path);
+    g_main_loop_run (loop);
+    g_message ("Shutting down the server");
+
+    // Stop accepting, let the running requests finish, then release the context
+    g_socket_service_stop (service);
+    g_socket_listener_close (G_SOCKET_LISTENER (service));
+    g_cancellable_cancel (server.cancellable);
+    g_mutex_lock (&server.active_lock);
+    while (server.active > 0) {
+        g_cond_wait (&server.active_cond, &server.active_lock);
+    }
+    g_mutex_unlock (&server.active_lock);
+
+    g_source_remove (sigint_id);
+    g_source_remove (sigterm_id);
+    g_main_loop_unref (loop);
+    g_object_unref (service);
+    g_object_unref (server.cancellable);
+    g_cond_clear (&server.active_cond);
+    g_mutex_clear (&server.active_lock);
+    g_array_free (allowed_uids, TRUE);
+    g_array_free (allowed_gids, TRUE);
+    g_unlink (socket_path);
+
+    return TRUE;
+}
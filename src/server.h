@@ -0,0 +1,10 @@
+#pragma once
+
+#include <glib.h>
+#include "ffc.h"
+
+// Serves check/add/update requests on config_data->socket_path using the context's open databases and workers,
+// until SIGINT or SIGTERM. Only root, the server's user and group and the configured allowed_users/allowed_groups
+// are served. Returns FALSE if the socket cannot be set up.
+gboolean server_run (FfcContext       *ctx,
+                     const ConfigData *config_data);
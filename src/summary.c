@@ -1,4 +1,7 @@
 #include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xxhash.h>
 #include "summary.h"
 
 #include "config.h"
@@ -14,50 +17,120 @@ change_type_to_string (ChangeType type)
         case CHANGE_BLOCKS:         return "Block count changed";
         case CHANGE_MISSING_IN_DB:  return "File is missing in the database";
         case CHANGE_MISSING_IN_FS:  return "File is missing from the file system";
+        case CHANGE_MOVED:          return "File was moved or renamed";
+        case CHANGE_TIMEOUT:        return "File could not be read within read_timeout";
         default:                    return "Unknown change";
     }
 }
 
 
+const gchar *
+change_type_to_key (ChangeType type)
+{
+    switch (type) {
+        case CHANGE_HASH:           return "hash";
+        case CHANGE_INODE:          return "inode";
+        case CHANGE_LINKS:          return "links";
+        case CHANGE_BLOCKS:         return "blocks";
+        case CHANGE_MISSING_IN_DB:  return "missing_in_db";
+        case CHANGE_MISSING_IN_FS:  return "missing_in_fs";
+        case CHANGE_MOVED:          return "moved";
+        case CHANGE_TIMEOUT:        return "timeout";
+        default:                    return "unknown";
+    }
+}
+
+
+static __thread SummaryShard *thread_shard = NULL;
+static __thread guint64 thread_shard_owner = 0;
+static guint64 next_summary_id = 0;     // protected by summary_id_lock
+G_LOCK_DEFINE_STATIC (summary_id_lock);
+
+
+static SummaryShard *
+get_thread_shard (SummaryData *summary_data)
+{
+    if (G_UNLIKELY (thread_shard_owner != summary_data->id)) {
+        guint index = (guint)g_atomic_int_add ((volatile gint*)&summary_data->next_shard, 1);
+        thread_shard = &summary_data->shards[index % summary_data->n_shards];
+        thread_shard_owner = summary_data->id;
+    }
+    return thread_shard;
+}
+
+
 SummaryData *
-summary_new (void)
+summary_new (guint n_shards)
 {
     SummaryData *summary_data = g_try_new0 (SummaryData, 1);
     if (!summary_data) {
         g_log (NULL, G_LOG_LEVEL_ERROR, "Failed to allocate memory for SummaryData");
         return NULL;
     }
-    g_mutex_init (&summary_data->mutex);
-    summary_data->changed_files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_array_unref);
+
+    G_LOCK (summary_id_lock);
+    summary_data->id = ++next_summary_id;
+    G_UNLOCK (summary_id_lock);
+
+    summary_data->n_shards = MAX (n_shards, 1);
+    void *shards = NULL;
+    if (posix_memalign (&shards, SUMMARY_CACHELINE_SIZE, summary_data->n_shards * sizeof(SummaryShard)) != 0) {
+        g_log (NULL, G_LOG_LEVEL_ERROR, "Failed to allocate memory for the summary shards");
+        g_free (summary_data);
+        return NULL;
+    }
+    memset (shards, 0, summary_data->n_shards * sizeof(SummaryShard));
+    summary_data->shards = shards;
+    for (guint i = 0; i < summary_data->n_shards; i++) {
+        g_mutex_init (&summary_data->shards[i].mutex);
+        summary_data->shards[i].changed_files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        summary_data->shards[i].streamed_paths = g_array_new (FALSE, FALSE, sizeof(guint64));
+    }
+    summary_data->changed_files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
     return summary_data;
 }
 
 
 void
-record_change (SummaryData *summary_data,
-               const char  *filepath,
-               ChangeType   change)
+record_changes (SummaryData *summary_data,
+                const char  *filepath,
+                guint        changes)
 {
-    g_mutex_lock (&summary_data->mutex);
+    if (changes == 0) return;
+
+    SummaryShard *shard = get_thread_shard (summary_data);
+    g_mutex_lock (&shard->mutex);
 
-    GArray *changes = g_hash_table_lookup (summary_data->changed_files, filepath);
-    if (!changes) {
-        changes = g_array_new( FALSE, FALSE, sizeof(ChangeType));
-        g_hash_table_insert (summary_data->changed_files, g_strdup (filepath), changes);
-        summary_data->files_with_changes++;
+    if (summary_data->report) {
+        // Only a digest is kept: streaming is meant for runs with too many changes to hold their paths
+        guint64 digest = XXH3_64bits (filepath, strlen (filepath));
+        g_array_append_val (shard->streamed_paths, digest);
+    } else {
+        gpointer recorded = g_hash_table_lookup (shard->changed_files, filepath);
+        if (recorded) {
+            g_hash_table_replace (shard->changed_files, g_strdup (filepath), GUINT_TO_POINTER(GPOINTER_TO_UINT(recorded) | changes));
+        } else {
+            g_hash_table_insert (shard->changed_files, g_strdup (filepath), GUINT_TO_POINTER(changes));
+        }
     }
-    g_array_append_val (changes, change);
-
-    switch (change) {
-        case CHANGE_HASH: summary_data->hash_mismatches++; break;
-        case CHANGE_INODE: summary_data->inode_changes++; break;
-        case CHANGE_LINKS: summary_data->link_changes++; break;
-        case CHANGE_BLOCKS: summary_data->block_changes++; break;
-        case CHANGE_MISSING_IN_DB: summary_data->missing_files_in_db++; break;
-        case CHANGE_MISSING_IN_FS: summary_data->missing_files_in_fs++; break;
+
+    for (ChangeType change = 0; change < CHANGE_TYPE_COUNT; change++) {
+        if (changes & CHANGE_BIT(change)) shard->change_counts[change]++;
     }
 
-    g_mutex_unlock (&summary_data->mutex);
+    g_mutex_unlock (&shard->mutex);
+
+    // Streamed outside of the lock: the sink has its own queue
+    if (summary_data->report) report_emit (summary_data->report, filepath, changes);
+}
+
+
+void
+record_change (SummaryData *summary_data,
+               const char  *filepath,
+               ChangeType   change)
+{
+    record_changes (summary_data, filepath, CHANGE_BIT(change));
 }
 
 
@@ -65,20 +138,112 @@ void
 summary_increment_processed (SummaryData *summary_data,
                              guint        delta)
 {
-    g_atomic_int_add ((volatile gint*)&summary_data->total_files_processed, (gint)delta);
+    SummaryShard *shard = get_thread_shard (summary_data);
+    g_atomic_int_add ((volatile gint*)&shard->processed, (gint)delta);
 }
 
 
 guint
 summary_get_processed (SummaryData *summary_data)
 {
-    return (guint)g_atomic_int_get ((volatile gint*)&summary_data->total_files_processed);
+    guint processed = 0;
+    for (guint i = 0; i < summary_data->n_shards; i++) {
+        processed += (guint)g_atomic_int_get ((volatile gint*)&summary_data->shards[i].processed);
+    }
+    return processed;
+}
+
+
+void
+summary_add_verified (SummaryData *summary_data,
+                      guint64      bytes)
+{
+    SummaryShard *shard = get_thread_shard (summary_data);
+    g_mutex_lock (&shard->mutex);
+    shard->verified_files++;
+    shard->verified_bytes += bytes;
+    g_mutex_unlock (&shard->mutex);
+}
+
+
+void
+summary_add_deferred (SummaryData *summary_data)
+{
+    SummaryShard *shard = get_thread_shard (summary_data);
+    g_mutex_lock (&shard->mutex);
+    shard->deferred_files++;
+    g_mutex_unlock (&shard->mutex);
+}
+
+
+static gint
+compare_digests (gconstpointer a,
+                 gconstpointer b)
+{
+    guint64 x = *(const guint64 *)a, y = *(const guint64 *)b;
+    return (x > y) - (x < y);
+}
+
+
+void
+summary_merge (SummaryData *summary_data)
+{
+    guint change_counts[CHANGE_TYPE_COUNT] = { 0 };
+    GArray *streamed_paths = g_array_new (FALSE, FALSE, sizeof(guint64));
+
+    summary_data->total_files_processed = summary_get_processed (summary_data);
+    summary_data->verified_files = 0;
+    summary_data->verified_bytes = 0;
+    summary_data->deferred_files = 0;
+    g_hash_table_remove_all (summary_data->changed_files);
+
+    for (guint i = 0; i < summary_data->n_shards; i++) {
+        SummaryShard *shard = &summary_data->shards[i];
+        g_mutex_lock (&shard->mutex);
+
+        // The same file can be reported by different threads (e.g. metadata and content pass): merge the masks
+        GHashTableIter iter;
+        gpointer key, value;
+        g_hash_table_iter_init (&iter, shard->changed_files);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            gpointer merged = g_hash_table_lookup (summary_data->changed_files, key);
+            g_hash_table_replace (summary_data->changed_files, g_strdup (key), GUINT_TO_POINTER(GPOINTER_TO_UINT(merged) | GPOINTER_TO_UINT(value)));
+        }
+
+        for (guint c = 0; c < CHANGE_TYPE_COUNT; c++) change_counts[c] += shard->change_counts[c];
+        g_array_append_vals (streamed_paths, shard->streamed_paths->data, shard->streamed_paths->len);
+        summary_data->verified_files += shard->verified_files;
+        summary_data->verified_bytes += shard->verified_bytes;
+        summary_data->deferred_files += shard->deferred_files;
+
+        g_mutex_unlock (&shard->mutex);
+    }
+
+    // A path reported several times (e.g. by the metadata and the content pass) counts once, as in changed_files
+    g_array_sort (streamed_paths, compare_digests);
+    guint streamed_files = 0;
+    for (guint i = 0; i < streamed_paths->len; i++) {
+        if (i == 0 || g_array_index (streamed_paths, guint64, i) != g_array_index (streamed_paths, guint64, i - 1)) streamed_files++;
+    }
+    g_array_free (streamed_paths, TRUE);
+
+    summary_data->files_with_changes = g_hash_table_size (summary_data->changed_files) + streamed_files;
+    summary_data->hash_mismatches = change_counts[CHANGE_HASH];
+    summary_data->inode_changes = change_counts[CHANGE_INODE];
+    summary_data->link_changes = change_counts[CHANGE_LINKS];
+    summary_data->block_changes = change_counts[CHANGE_BLOCKS];
+    summary_data->missing_files_in_db = change_counts[CHANGE_MISSING_IN_DB];
+    summary_data->missing_files_in_fs = change_counts[CHANGE_MISSING_IN_FS];
+    summary_data->moved_files = change_counts[CHANGE_MOVED];
+    summary_data->timed_out_files = change_counts[CHANGE_TIMEOUT];
 }
 
 
 void
 print_summary (SummaryData *summary_data, Mode mode)
 {
+    summary_merge (summary_data);
+
     g_print ("\n=== Summary ===\n");
     g_print ("Total files processed: %u\n", summary_data->total_files_processed);
 
@@ -92,25 +257,60 @@ print_summary (SummaryData *summary_data, Mode mode)
             g_print ("- Block count changes: %u\n", summary_data->block_changes);
             g_print ("- Missing files in the database (e.g. renamed, created): %u\n", summary_data->missing_files_in_db);
             g_print ("- Missing files from the file system (e.g. deleted, moved): %u\n", summary_data->missing_files_in_fs);
-            g_print ("\nAffected files:\n");
-            GHashTableIter iter;
-            gpointer key, value;
-            g_hash_table_iter_init (&iter, summary_data->changed_files);
-            while (g_hash_table_iter_next(&iter, &key, &value)) {
-                const char *filepath = key;
-                GArray *changes = value;
-                g_print ("%s:\n", filepath);
-                for (guint i = 0; i < changes->len; i++) {
-                    ChangeType change = g_array_index (changes, ChangeType, i);
-                    g_print("  - %s\n", change_type_to_string (change));
+            g_print ("- Moved or renamed files: %u\n", summary_data->moved_files);
+            g_print ("- Files not readable within read_timeout (hung or failing storage): %u\n", summary_data->timed_out_files);
+            if (summary_data->report) {
+                g_print ("\nAffected files were streamed to the change report.\n");
+            } else {
+                g_print ("\nAffected files:\n");
+                GHashTableIter iter;
+                gpointer key, value;
+                g_hash_table_iter_init (&iter, summary_data->changed_files);
+                while (g_hash_table_iter_next(&iter, &key, &value)) {
+                    const char *filepath = key;
+                    guint changes = GPOINTER_TO_UINT(value);
+                    g_print ("%s:\n", filepath);
+                    for (ChangeType change = 0; change < CHANGE_TYPE_COUNT; change++) {
+                        if (changes & CHANGE_BIT(change)) g_print("  - %s\n", change_type_to_string (change));
+                    }
                 }
+                g_print ("\n");
             }
-            g_print ("\n");
         } else {
             g_print ("No changes detected.\n");
         }
+        if (summary_data->budgeted) {
+            gchar *verified_size = g_format_size (summary_data->verified_bytes);
+            g_print ("\nFull-content verification: %u files (%s) verified", summary_data->verified_files, verified_size);
+            if (summary_data->deferred_files > 0) {
+                g_print (", %u deferred to a later run", summary_data->deferred_files);
+            }
+            g_print ("\n");
+            if (summary_data->overdue_files > 0) {
+                g_print ("Files overdue for a full-content check: %u\n", summary_data->overdue_files);
+            }
+            g_free (verified_size);
+        }
     } else {
         g_print ("Database %s completed successfully.\n", mode == MODE_ADD ? "addition" : "update");
+        if (summary_data->moved_files > 0) {
+            g_print ("Moved or renamed files (records kept under the new path): %u\n", summary_data->moved_files);
+        }
+        if (summary_data->timed_out_files > 0) {
+            g_print ("Files skipped, not readable within read_timeout: %u\n", summary_data->timed_out_files);
+        }
+    }
+
+    if (summary_data->memory_budget > 0) {
+        gchar *budget = g_format_size (summary_data->memory_budget);
+        gchar *peak = g_format_size (summary_data->memory_peak);
+        g_print ("\nIn-flight file data: peak %s of a %s budget", peak, budget);
+        if (summary_data->memory_waits > 0) {
+            g_print (", %" G_GUINT64_FORMAT " reads waited for memory", summary_data->memory_waits);
+        }
+        g_print ("\n");
+        g_free (peak);
+        g_free (budget);
     }
 }
 
@@ -119,8 +319,13 @@ void
 free_summary (SummaryData *summary_data)
 {
     if (summary_data) {
+        for (guint i = 0; i < summary_data->n_shards; i++) {
+            g_hash_table_destroy (summary_data->shards[i].changed_files);
+            g_array_free (summary_data->shards[i].streamed_paths, TRUE);
+            g_mutex_clear (&summary_data->shards[i].mutex);
+        }
+        free (summary_data->shards);
         g_hash_table_destroy (summary_data->changed_files);
-        g_mutex_clear (&summary_data->mutex);
         g_free (summary_data);
     }
-}
\ No newline at end of file
+}
@@ -2,10 +2,46 @@
 
 #include <glib.h>
 #include "config.h"
+#include "report.h"
+
+#define SUMMARY_CACHELINE_SIZE 64
+
+typedef enum change_type_t {
+    CHANGE_HASH,
+    CHANGE_INODE,
+    CHANGE_LINKS,
+    CHANGE_BLOCKS,
+    CHANGE_MISSING_IN_DB,
+    CHANGE_MISSING_IN_FS,
+    CHANGE_MOVED,               // the record of a path that is gone now belongs to this file (rename or move)
+    CHANGE_TIMEOUT,             // no read progress within read_timeout: the file was given up, its record left as is
+    CHANGE_TYPE_COUNT
+} ChangeType;
+
+#define CHANGE_BIT(change) (1u << (change))
+
+// Per-thread accounting. Each worker thread is bound to one shard, so the lock is uncontended unless there are
+// more threads than shards; shards are cache line aligned so that workers never write to the same line.
+typedef struct summary_shard_t {
+    guint processed;            // atomic: read by the progress reporter while workers run
+    GMutex mutex;               // protects everything below
+    GHashTable *changed_files;  // filepath -> GUINT_TO_POINTER(mask of CHANGE_BIT()), unused when changes are streamed
+    GArray *streamed_paths;     // guint64 XXH3 of every path sent to the report, one per call: merged into distinct paths
+    guint change_counts[CHANGE_TYPE_COUNT];
+    guint verified_files;
+    guint64 verified_bytes;
+    guint deferred_files;
+} __attribute__((aligned(SUMMARY_CACHELINE_SIZE))) SummaryShard;
 
 typedef struct summary_data_t {
-    GHashTable *changed_files;  // filepath -> array of change types
-    GMutex mutex;               // protects changed_files and files_with_changes
+    SummaryShard *shards;
+    guint n_shards;
+    guint next_shard;           // atomic: round-robin assignment of threads to shards
+    guint64 id;                 // unique per summary: threads cache their shard by id, addresses get reused
+    ReportSink *report;         // optional NDJSON change report
+
+    // Totals, filled in by summary_merge()
+    GHashTable *changed_files;  // filepath -> GUINT_TO_POINTER(mask of CHANGE_BIT())
     guint total_files_processed;
     guint files_with_changes;
     guint hash_mismatches;
@@ -14,18 +50,22 @@ typedef struct summary_data_t {
     guint block_changes;
     guint missing_files_in_db;
     guint missing_files_in_fs;
+    guint moved_files;
+    guint timed_out_files;
+    // Budgeted (rolling) content verification
+    gboolean budgeted;
+    guint verified_files;       // files whose content was hashed and compared
+    guint64 verified_bytes;
+    guint deferred_files;       // planned files left for a later run because the time budget ran out
+    guint overdue_files;        // files not verified within verify_cycle_days after this run (set by the planner)
+    // In-flight file data (set by the engine at the end of a run)
+    guint64 memory_budget;
+    guint64 memory_peak;
+    guint64 memory_waits;       // reservations that had to wait for other workers to release memory
 } SummaryData;
 
-typedef enum change_type_t {
-    CHANGE_HASH,
-    CHANGE_INODE,
-    CHANGE_LINKS,
-    CHANGE_BLOCKS,
-    CHANGE_MISSING_IN_DB,
-    CHANGE_MISSING_IN_FS
-} ChangeType;
-
-SummaryData *summary_new   (void);
+// n_shards should match the number of threads that record changes (workers plus helper threads)
+SummaryData *summary_new   (guint        n_shards);
 
 void          free_summary  (SummaryData *summary);
 
@@ -33,10 +73,25 @@ void          record_change (SummaryData *summary,
                              const gchar *filepath,
                              ChangeType   change);
 
+// Records all changes detected for one file at once; changes is a mask of CHANGE_BIT() values
+void          record_changes (SummaryData *summary,
+                              const gchar *filepath,
+                              guint        changes);
+
+const gchar  *change_type_to_key (ChangeType change);
+
 void          summary_increment_processed (SummaryData *summary,
                                           guint        delta);
 
 guint         summary_get_processed (SummaryData *summary);
 
+void          summary_add_verified  (SummaryData *summary,
+                                     guint64      bytes);
+
+void          summary_add_deferred  (SummaryData *summary);
+
+// Folds all shards into the totals; must be called once all threads are done recording
+void          summary_merge (SummaryData *summary);
+
 void          print_summary (SummaryData *summary,
-                             Mode         mode);
\ No newline at end of file
+                             Mode         mode);
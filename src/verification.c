@@ -0,0 +1,252 @@
+#include <glib.h>
+#include <lmdb.h>
+#include "verification.h"
+
+#define SECONDS_PER_DAY (24 * 60 * 60)
+#define VERIFY_FIRST_ROUND_BYTES (1ULL << 30)     // time budget alone: size of the first round, doubled every round
+
+typedef struct verify_candidate_t {
+    gchar *filepath;
+    gint64 last_verified;
+    guint64 size;
+} VerifyCandidate;
+
+
+static gint
+compare_candidates (gconstpointer a,
+                    gconstpointer b)
+{
+    const VerifyCandidate *ca = a;
+    const VerifyCandidate *cb = b;
+
+    if (ca->last_verified != cb->last_verified) {
+        return ca->last_verified < cb->last_verified ? -1 : 1;
+    }
+    return g_strcmp0 (ca->filepath, cb->filepath);
+}
+
+
+// Max-heap on compare_candidates(): the newest of the planned candidates is on top
+static void
+heap_push (GArray          *heap,
+           VerifyCandidate *candidate)
+{
+    g_array_append_val (heap, *candidate);
+    guint i = heap->len - 1;
+    while (i > 0) {
+        guint parent = (i - 1) / 2;
+        VerifyCandidate *child = &g_array_index (heap, VerifyCandidate, i);
+        VerifyCandidate *above = &g_array_index (heap, VerifyCandidate, parent);
+        if (compare_candidates (above, child) >= 0) break;
+        VerifyCandidate tmp = *above;
+        *above = *child;
+        *child = tmp;
+        i = parent;
+    }
+}
+
+
+static VerifyCandidate
+heap_pop (GArray *heap)
+{
+    VerifyCandidate top = g_array_index (heap, VerifyCandidate, 0);
+    g_array_index (heap, VerifyCandidate, 0) = g_array_index (heap, VerifyCandidate, heap->len - 1);
+    g_array_set_size (heap, heap->len - 1);
+
+    guint i = 0;
+    while (TRUE) {
+        guint largest = i;
+        guint left = 2 * i + 1, right = 2 * i + 2;
+        if (left < heap->len && compare_candidates (&g_array_index (heap, VerifyCandidate, left), &g_array_index (heap, VerifyCandidate, largest)) > 0) largest = left;
+        if (right < heap->len && compare_candidates (&g_array_index (heap, VerifyCandidate, right), &g_array_index (heap, VerifyCandidate, largest)) > 0) largest = right;
+        if (largest == i) break;
+        VerifyCandidate tmp = g_array_index (heap, VerifyCandidate, i);
+        g_array_index (heap, VerifyCandidate, i) = g_array_index (heap, VerifyCandidate, largest);
+        g_array_index (heap, VerifyCandidate, largest) = tmp;
+        i = largest;
+    }
+
+    return top;
+}
+
+
+static guint64
+estimate_size (const FileEntryData *entry)
+{
+    // Records written before the size was stored only know the allocated blocks (512 bytes each)
+    if (entry->size > 0) return (guint64)entry->size;
+    return (guint64)entry->block_count * 512;
+}
+
+
+// The sizes of all records, for the share of the verification cycle
+static guint64
+total_size (DatabaseData *db_data)
+{
+    guint64 total_bytes = 0;
+
+    for (guint i = 0; i < db_data->n_shards; i++) {
+        DbShard *shard = &db_data->shards[i];
+        MDB_txn *txn;
+        MDB_cursor *cursor;
+        MDB_val key, data;
+
+        int rc = db_txn_begin (shard, MDB_RDONLY, &txn, NULL);
+        if (rc != 0) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "mdb_txn_begin failed: %s\n", mdb_strerror (rc));
+            continue;
+        }
+
+        rc = mdb_cursor_open (txn, shard->dbi, &cursor);
+        if (rc != 0) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "mdb_cursor_open failed: %s\n", mdb_strerror (rc));
+            db_txn_abort (shard, txn);
+            continue;
+        }
+
+        for (rc = db_cursor_first (cursor, &key, &data); rc == 0; rc = mdb_cursor_get (cursor, &key, &data, MDB_NEXT)) {
+            FileEntryData entry;
+            db_read_entry (&data, &entry);
+            total_bytes += estimate_size (&entry);
+        }
+        mdb_cursor_close (cursor);
+        db_txn_abort (shard, txn);
+    }
+
+    return total_bytes;
+}
+
+
+VerifyPlan *
+build_verification_plan (DatabaseData     *db_data,
+                         ConfigData       *config_data,
+                         SummaryData      *summary_data,
+                         const VerifyPlan *previous)
+{
+    VerifyPlan *plan = g_new0 (VerifyPlan, 1);
+    plan->paths = g_ptr_array_new ();
+
+    // Honour the verification cycle: every run must cover at least its share of the whole dataset, whichever budget
+    // it has. The byte budget is raised to it; the time budget lets the files covering it finish (floor_files).
+    guint64 cycle_share = 0;
+    if (previous == NULL && config_data->verify_cycle_days > 0) {
+        guint64 total_bytes = total_size (db_data);
+        cycle_share = (total_bytes + config_data->verify_cycle_days - 1) / config_data->verify_cycle_days;
+    }
+    if (config_data->byte_budget > 0) {
+        plan->round_bytes = config_data->byte_budget;
+        if (cycle_share > plan->round_bytes) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "Byte budget raised from %" G_GUINT64_FORMAT " to %" G_GUINT64_FORMAT " bytes to cover all files within %u days",
+                   plan->round_bytes, cycle_share, config_data->verify_cycle_days);
+            plan->round_bytes = cycle_share;
+        }
+    } else if (previous) {
+        plan->round_bytes = previous->round_bytes <= G_MAXUINT64 / 2 ? previous->round_bytes * 2 : G_MAXUINT64;
+    } else {
+        plan->round_bytes = MAX (cycle_share, VERIFY_FIRST_ROUND_BYTES);
+    }
+
+    gint64 overdue_before = (config_data->verify_cycle_days > 0)
+                            ? g_get_real_time () / G_USEC_PER_SEC - (gint64)config_data->verify_cycle_days * SECONDS_PER_DAY
+                            : G_MININT64;
+    VerifyCandidate after = { .filepath = previous ? previous->last_path : NULL, .last_verified = previous ? previous->last_verified : 0 };
+
+    // The heap keeps the oldest candidates that fit in the round. Once one was dropped for the size, newer ones can't
+    // take its place: the plan stays the oldest-first prefix of all candidates, starting with at least one file so
+    // that large files can't starve.
+    GArray *heap = g_array_new (FALSE, FALSE, sizeof(VerifyCandidate));
+    VerifyCandidate cutoff = { .filepath = NULL };
+    guint64 planned_bytes = 0;
+    guint64 seen_files = 0;
+    guint overdue_files = 0;
+
+    for (guint i = 0; i < db_data->n_shards; i++) {
+        DbShard *shard = &db_data->shards[i];
+        MDB_txn *txn;
+        MDB_cursor *cursor;
+        MDB_val key, data;
+
+        int rc = db_txn_begin (shard, MDB_RDONLY, &txn, NULL);
+        if (rc != 0) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "mdb_txn_begin failed: %s\n", mdb_strerror (rc));
+            continue;
+        }
+
+        rc = mdb_cursor_open (txn, shard->dbi, &cursor);
+        if (rc != 0) {
+            g_log (NULL, G_LOG_LEVEL_WARNING, "mdb_cursor_open failed: %s\n", mdb_strerror (rc));
+            db_txn_abort (shard, txn);
+            continue;
+        }
+
+        for (rc = db_cursor_first (cursor, &key, &data); rc == 0; rc = mdb_cursor_get (cursor, &key, &data, MDB_NEXT)) {
+            FileEntryData entry;
+            db_read_entry (&data, &entry);
+            seen_files++;
+            if (entry.last_verified < overdue_before) overdue_files++;
+
+            // Compared before copying the path: most records are not planned
+            VerifyCandidate candidate = { .last_verified = entry.last_verified };
+            if (after.filepath && candidate.last_verified < after.last_verified) continue;
+            if (cutoff.filepath && candidate.last_verified > cutoff.last_verified) continue;
+            candidate.filepath = g_strndup (key.mv_data, key.mv_size);
+            candidate.size = estimate_size (&entry);
+            if ((after.filepath && compare_candidates (&candidate, &after) <= 0) ||
+                (cutoff.filepath && compare_candidates (&candidate, &cutoff) >= 0)) {
+                g_free (candidate.filepath);
+                continue;
+            }
+
+            heap_push (heap, &candidate);
+            planned_bytes += candidate.size;
+            while (heap->len > 1 && planned_bytes > plan->round_bytes) {
+                VerifyCandidate dropped = heap_pop (heap);
+                planned_bytes -= dropped.size;
+                // Dropped in decreasing order: the last one is the oldest left out
+                g_free (cutoff.filepath);
+                cutoff = dropped;
+            }
+        }
+        mdb_cursor_close (cursor);
+        db_txn_abort (shard, txn);
+    }
+
+    // A byte budget is spent by its single plan; a round that left nothing out was the last one
+    plan->last_round = config_data->byte_budget > 0 || cutoff.filepath == NULL;
+    g_free (cutoff.filepath);
+
+    g_array_sort (heap, compare_candidates);
+    guint64 floor_bytes = 0;
+    for (guint i = 0; i < heap->len; i++) {
+        VerifyCandidate *candidate = &g_array_index (heap, VerifyCandidate, i);
+        if (candidate->last_verified < overdue_before) overdue_files--;
+        if (floor_bytes < cycle_share) {
+            floor_bytes += candidate->size;
+            plan->floor_files++;
+        }
+        g_ptr_array_add (plan->paths, candidate->filepath);
+    }
+    if (heap->len > 0) {
+        VerifyCandidate *last = &g_array_index (heap, VerifyCandidate, heap->len - 1);
+        plan->last_verified = last->last_verified;
+        plan->last_path = g_strdup (last->filepath);
+    }
+    g_array_free (heap, TRUE);
+
+    // Every round recounts the records still overdue once its files are checked
+    summary_data->overdue_files = overdue_files;
+    g_message ("Verification plan: %u of %" G_GUINT64_FORMAT " files (%" G_GUINT64_FORMAT " bytes) due for a full-content check",
+               plan->paths->len, seen_files, planned_bytes);
+
+    return plan;
+}
+
+
+void
+verify_plan_free (VerifyPlan *plan)
+{
+    if (!plan) return;
+    g_ptr_array_free (plan->paths, TRUE);
+    g_free (plan->last_path);
+    g_free (plan);
+}
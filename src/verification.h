@@ -0,0 +1,26 @@
+#pragma once
+
+#include <glib.h>
+#include "config.h"
+#include "database.h"
+#include "summary.h"
+
+typedef struct verify_plan_t {
+    GPtrArray *paths;           // newly allocated paths owned by the caller, oldest-verified first (no free function is set)
+    guint floor_files;          // the first paths cover the share of the verification cycle: checked even past the time budget
+    gboolean last_round;        // no file is left after this plan
+    guint64 round_bytes;        // size bound of the plan
+    gint64 last_verified;       // position of the last planned file: the next round starts after it
+    gchar *last_path;
+} VerifyPlan;
+
+// Builds the list of files due for a full-content check, oldest-verified first. A byte budget bounds a single plan;
+// a time budget alone is served in rounds of growing size, each one starting after the previous plan (NULL first).
+// Only the planned files are held in memory.
+VerifyPlan *build_verification_plan (DatabaseData     *db_data,
+                                     ConfigData       *config_data,
+                                     SummaryData      *summary_data,
+                                     const VerifyPlan *previous);
+
+// Frees the plan and its array, not the paths handed to the workers
+void        verify_plan_free        (VerifyPlan       *plan);